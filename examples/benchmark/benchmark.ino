@@ -0,0 +1,295 @@
+/**************************************************************************/
+/*!
+    @file     benchmark.ino
+    @author   Rennan Cockles
+
+    CPU cost of the library hot paths, no Chameleon device needed: frames
+    go to a transport that answers right away. Output follows the Go
+    benchmark format, one line per benchmark, so runs can be compared
+    with benchstat:
+
+      BenchmarkName  <iterations>  <ns> ns/op  <bytes> B/op  <n> allocs/op
+
+    Allocations are counted through operator new, malloc calls made by
+    String are not included unless the library is built with
+    CHAMELEON_ALLOC_AUDIT on ESP-IDF heap hooks. The scan, read, write and
+    eload commands are then run once under AllocAudit and must not
+    allocate.
+
+    Library commands log to Serial, so the timed loops only call
+    commands that print nothing.
+
+    extras/host builds the same sketch on Linux and ctest runs it.
+*/
+/**************************************************************************/
+#include <chameleonUltra.h>
+#include <allocAudit.h>
+#include <new>
+
+// Library internals measured in isolation
+uint8_t calculateLRC(const uint8_t *data, size_t length);
+extern ChameleonUltra::ResponseQueue chameleonResponses;
+
+#define BENCH_MIN_TIME_US 500000
+
+ChameleonUltra chmUltra = ChameleonUltra();
+
+// The library hooks the allocator itself when built with the audit
+#ifndef CHAMELEON_ALLOC_AUDIT
+void *operator new(size_t size) {
+  AllocAudit::record(size);
+  void *p = malloc(size);
+  if (!p) abort();
+  return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  AllocAudit::record(size);
+  return malloc(size);
+}
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept { return operator new(size, tag); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Harness
+/////////////////////////////////////////////////////////////////////////////////////
+typedef void (*BenchFn)(uint32_t iterations);
+
+// Doubles the iterations until a run takes BENCH_MIN_TIME_US
+void bench(const char *name, BenchFn fn) {
+  uint32_t iterations = 1;
+  uint32_t elapsed = 0;
+  uint32_t allocs = 0;
+  uint32_t bytes = 0;
+
+  fn(1);  // warm up
+
+  while (true) {
+    chameleonResponses.clear();
+    uint32_t startAllocs = AllocAudit::totalAllocations();
+    uint32_t startBytes = AllocAudit::totalBytes();
+    uint32_t start = micros();
+
+    fn(iterations);
+
+    elapsed = micros() - start;
+    allocs = AllocAudit::totalAllocations() - startAllocs;
+    bytes = AllocAudit::totalBytes() - startBytes;
+
+    if (elapsed >= BENCH_MIN_TIME_US || iterations >= (1UL << 24)) break;
+    iterations *= elapsed < BENCH_MIN_TIME_US / 16 ? 8 : 2;
+  }
+
+  Serial.printf(
+    "Benchmark%s\t%u\t%.1f ns/op\t%.1f B/op\t%.2f allocs/op\n",
+    name, iterations,
+    elapsed * 1000.0 / iterations, (double)bytes / iterations, (double)allocs / iterations
+  );
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Fake device
+/////////////////////////////////////////////////////////////////////////////////////
+uint8_t response[10 + 512];
+size_t responseData = 16;
+uint16_t mtu = 244;
+
+// Answers every frame with HF_TAG_OK and responseData bytes, split in
+// mtu sized notifications like the BLE link does
+bool answer(const uint8_t *frame, size_t length, void *ctx) {
+  response[0] = 0x11;
+  response[1] = 0xEF;
+  response[2] = frame[2];
+  response[3] = frame[3];
+  response[4] = 0x00;
+  response[5] = ChameleonUltra::HF_TAG_OK;
+  response[6] = responseData >> 8;
+  response[7] = responseData & 0xFF;
+  response[8] = calculateLRC(response + 2, 6);
+  response[9 + responseData] = calculateLRC(response + 9, responseData);
+
+  size_t size = 10 + responseData;
+  for (size_t offset = 0; offset < size; offset += mtu) {
+    ChameleonUltra::notify(response + offset, min<size_t>(mtu, size - offset));
+  }
+  return true;
+}
+
+// Takes the frame and reports it unsent, so a command returns right after
+// encoding it
+bool drop(const uint8_t *frame, size_t length, void *ctx) {
+  return false;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+/////////////////////////////////////////////////////////////////////////////////////
+uint8_t payload[512];
+uint8_t frame16[10 + 16];
+uint8_t frame512[10 + 512];
+uint8_t keyList[83 * 6];
+String dump1k;
+
+void benchLRC(uint32_t n) {
+  volatile uint8_t sink = 0;
+  for (uint32_t i = 0; i < n; i++) sink += calculateLRC(payload, sizeof(payload));
+}
+
+void benchNotify16(uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    ChameleonUltra::notify(frame16, sizeof(frame16));
+    chameleonResponses.clear();
+  }
+}
+
+void benchNotify512(uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    for (size_t offset = 0; offset < sizeof(frame512); offset += mtu) {
+      ChameleonUltra::notify(frame512 + offset, min<size_t>(mtu, sizeof(frame512) - offset));
+    }
+    chameleonResponses.clear();
+  }
+}
+
+// Argument packing and frame encoding in writeCommand/sendCommand only
+void benchEncode8(uint32_t n) {
+  uint8_t key[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  chmUltra.setTransport(drop);
+  for (uint32_t i = 0; i < n; i++) chmUltra.cmdMfAuthBlock(ChameleonUltra::MF_KEY_A, 4, key);
+  chmUltra.setTransport(answer);
+}
+
+// 83 keys, a 508 byte payload
+void benchEncode508(uint32_t n) {
+  uint8_t mask[10] = {};
+  ChameleonUltra::MfSectorKeys keys[40];
+  chmUltra.setTransport(drop);
+  for (uint32_t i = 0; i < n; i++) chmUltra.cmdMfCheckKeys(mask, keyList, 83, keys);
+  chmUltra.setTransport(answer);
+}
+
+// Frame encoding, transport, notify parsing and checkResponse dispatch
+void benchRoundTrip(uint32_t n) {
+  uint8_t cmd[8] = {ChameleonUltra::MF_KEY_A, 4, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  ChameleonUltra::CmdRequest request = {ChameleonUltra::MF1_READ_ONE_BLOCK, cmd, sizeof(cmd)};
+  for (uint32_t i = 0; i < n; i++) chmUltra.runPipeline(&request, 1);
+}
+
+void benchPipeline16(uint32_t n) {
+  uint8_t cmds[16][8];
+  ChameleonUltra::CmdRequest requests[16];
+  for (int i = 0; i < 16; i++) {
+    cmds[i][0] = ChameleonUltra::MF_KEY_A;
+    cmds[i][1] = i;
+    memset(cmds[i] + 2, 0xFF, 6);
+    requests[i] = {ChameleonUltra::MF1_READ_ONE_BLOCK, cmds[i], 8};
+  }
+  for (uint32_t i = 0; i < n; i++) chmUltra.runPipeline(requests, 16);
+}
+
+void benchGetTagType(uint32_t n) {
+  volatile int sink = 0;
+  for (uint32_t i = 0; i < n; i++) sink += chmUltra.getTagType(i & 1 ? 0x08 : 0x18);
+}
+
+void benchGetTagTypeName(uint32_t n) {
+  volatile size_t sink = 0;
+  for (uint32_t i = 0; i < n; i++) sink += strlen(chmUltra.getTagTypeName(i & 1 ? 0x08 : 0x18));
+}
+
+void benchGetTagTypeStr(uint32_t n) {
+  volatile size_t sink = 0;
+  for (uint32_t i = 0; i < n; i++) sink += chmUltra.getTagTypeStr(i & 1 ? 0x08 : 0x18).length();
+}
+
+void benchEload1K(uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) chmUltra.cmdMfEload(dump1k.c_str(), dump1k.length());
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Allocation audit
+/////////////////////////////////////////////////////////////////////////////////////
+// Each hot path command runs once in its own scope, the scope reports the
+// command when it allocated
+void audit() {
+  uint8_t key[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  uint8_t block[16] = {};
+  uint8_t page[4] = {};
+  uint8_t uid[5] = {0x01, 0x02, 0x03, 0x04, 0x05};
+  uint8_t raw[2] = {0x30, 0x00};
+  ChameleonUltra::RawOptions opt;
+
+  AllocAudit::resetFailures();
+  { AllocAudit a("cmd14aScan"); chmUltra.cmd14aScan(); }
+  { AllocAudit a("cmdLFRead"); chmUltra.cmdLFRead(); }
+  { AllocAudit a("cmd14aRaw"); chmUltra.cmd14aRaw(opt, 200, raw, sizeof(raw)); }
+  { AllocAudit a("cmdMfReadBlock"); chmUltra.cmdMfReadBlock(4, key); }
+  { AllocAudit a("cmdMfWriteBlock"); chmUltra.cmdMfWriteBlock(4, key, block, sizeof(block)); }
+  { AllocAudit a("cmdMfuReadPage"); chmUltra.cmdMfuReadPage(4); }
+  { AllocAudit a("cmdMfuWritePage"); chmUltra.cmdMfuWritePage(4, page, sizeof(page)); }
+  { AllocAudit a("cmdLFEconfig"); chmUltra.cmdLFEconfig(uid, sizeof(uid)); }
+  { AllocAudit a("cmdMfEconfig"); chmUltra.cmdMfEconfig(uid, 4, chmUltra.hfTagData.atqaByte, 0x08); }
+  { AllocAudit a("cmdMfEload"); chmUltra.cmdMfEload(dump1k); }
+  { AllocAudit a("getTagTypeName"); chmUltra.getTagTypeName(0x08); }
+}
+
+
+void setup(void) {
+  Serial.begin(115200);
+  delay(1000);
+
+  for (size_t i = 0; i < sizeof(payload); i++) payload[i] = i * 7;
+  for (size_t i = 0; i < sizeof(keyList); i++) keyList[i] = i * 11;
+
+  // Prebuilt responses for the notify benchmarks
+  responseData = 16;
+  answer(frame16, 10, nullptr);
+  memcpy(frame16, response, sizeof(frame16));
+  responseData = 512;
+  answer(frame16, 10, nullptr);
+  memcpy(frame512, response, sizeof(frame512));
+  chameleonResponses.clear();
+  responseData = 16;
+
+  char hex[3];
+  dump1k.reserve(2048);
+  for (int i = 0; i < 1024; i++) {
+    sprintf(hex, "%02X", (uint8_t)(i * 13));
+    dump1k += hex;
+  }
+
+  chmUltra.hfTagData.atqaByte[0] = 0x00;
+  chmUltra.hfTagData.atqaByte[1] = 0x04;
+  chmUltra.setTransport(answer);
+
+  Serial.println("goos: arduino");
+  Serial.println("pkg: ESP-ChameleonUltra");
+
+  bench("LRC/512", benchLRC);
+  bench("Notify/16", benchNotify16);
+  bench("Notify/512", benchNotify512);
+  bench("Encode/8", benchEncode8);
+  bench("Encode/508", benchEncode508);
+  bench("RoundTrip", benchRoundTrip);
+  bench("Pipeline/16", benchPipeline16);
+  bench("GetTagType", benchGetTagType);
+  bench("GetTagTypeName", benchGetTagTypeName);
+  bench("GetTagTypeStr", benchGetTagTypeStr);
+  bench("Eload/1K", benchEload1K);
+
+  audit();
+  Serial.println(AllocAudit::failures() == 0 ? "PASS" : "FAIL");
+}
+
+
+void loop(void) {
+  delay(1000);
+}
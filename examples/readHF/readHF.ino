@@ -28,7 +28,7 @@ void loop(void) {
   if (!chmUltra.cmd14aScan()) return;
 
   Serial.print("Card Type: ");
-  Serial.println(chmUltra.getTagTypeStr(chmUltra.hfTagData.sak));
+  Serial.println(chmUltra.identifyTag().name);
 
   Serial.print("UID: ");
   for (byte i = 0; i < chmUltra.hfTagData.size; i++) {
@@ -0,0 +1,18 @@
+/**
+ * @file benchmark.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Runs the benchmark sketch on the host
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#include <Arduino.h>
+#include "../../examples/benchmark/benchmark.ino"
+
+
+int main() {
+    setup();
+    Serial.flush();
+    return AllocAudit::failures() == 0 ? 0 : 1;
+}
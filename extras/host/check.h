@@ -0,0 +1,30 @@
+/**
+ * @file check.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Assertions for the host tests
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __HOST_CHECK_H__
+#define __HOST_CHECK_H__
+
+#include <stdio.h>
+
+static int checkFailures = 0;
+
+// Reports the failed condition and keeps going, main returns checkResult()
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        checkFailures++; \
+    } \
+} while (0)
+
+static inline int checkResult() {
+    printf(checkFailures ? "FAIL (%d)\n" : "PASS\n", checkFailures);
+    return checkFailures ? 1 : 0;
+}
+
+#endif
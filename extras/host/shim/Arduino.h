@@ -0,0 +1,167 @@
+/**
+ * @file Arduino.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Minimal Arduino core for the host build
+ * @version 0.1
+ * @date 2024-10-09
+ *
+ * Only what the library and the benchmark sketch use. Serial writes to
+ * stdout, time comes from std::chrono.
+ */
+
+
+#ifndef __HOST_ARDUINO_H__
+#define __HOST_ARDUINO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+#define HEX 16
+#define DEC 10
+
+typedef uint8_t byte;
+
+using std::min;
+using std::max;
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// String
+/////////////////////////////////////////////////////////////////////////////////////
+class String {
+public:
+    String() {}
+    String(const char *str) : _str(str ? str : "") {}
+    String(const std::string &str) : _str(str) {}
+    String(char c) : _str(1, c) {}
+    String(int value, int base = DEC) : _str(format((long long)value, base)) {}
+    String(unsigned value, int base = DEC) : _str(format((unsigned long long)value, base)) {}
+    String(long value, int base = DEC) : _str(format((long long)value, base)) {}
+    String(unsigned long value, int base = DEC) : _str(format((unsigned long long)value, base)) {}
+    String(long long value, int base = DEC) : _str(format(value, base)) {}
+    String(unsigned long long value, int base = DEC) : _str(format(value, base)) {}
+    String(double value, unsigned char decimals = 2);
+
+    const char *c_str() const { return _str.c_str(); }
+    unsigned length() const { return _str.size(); }
+    bool reserve(unsigned size) { _str.reserve(size); return true; }
+    char charAt(unsigned index) const { return index < _str.size() ? _str[index] : 0; }
+    char operator[](unsigned index) const { return charAt(index); }
+
+    String substring(unsigned from) const { return from < _str.size() ? String(_str.substr(from)) : String(); }
+    String substring(unsigned from, unsigned to) const;
+    int indexOf(char c, unsigned from = 0) const;
+    int indexOf(const String &str, unsigned from = 0) const;
+    bool startsWith(const String &prefix) const { return _str.compare(0, prefix._str.size(), prefix._str) == 0; }
+    bool endsWith(const String &suffix) const;
+    void toCharArray(char *buf, unsigned size) const;
+    void toUpperCase();
+    void toLowerCase();
+    void trim();
+    long toInt() const { return strtol(_str.c_str(), nullptr, 10); }
+
+    String &operator+=(const String &rhs) { _str += rhs._str; return *this; }
+    String &operator+=(const char *rhs) { _str += rhs; return *this; }
+    String &operator+=(char rhs) { _str += rhs; return *this; }
+    bool concat(const String &rhs) { _str += rhs._str; return true; }
+
+    friend String operator+(const String &lhs, const String &rhs) { return String(lhs._str + rhs._str); }
+    friend String operator+(const String &lhs, const char *rhs) { return String(lhs._str + rhs); }
+    friend String operator+(const char *lhs, const String &rhs) { return String(lhs + rhs._str); }
+    bool operator==(const String &rhs) const { return _str == rhs._str; }
+    bool operator==(const char *rhs) const { return _str == rhs; }
+    bool operator!=(const String &rhs) const { return _str != rhs._str; }
+    bool operator!=(const char *rhs) const { return _str != rhs; }
+
+private:
+    std::string _str;
+
+    static std::string format(long long value, int base);
+    static std::string format(unsigned long long value, int base);
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Print and Stream
+/////////////////////////////////////////////////////////////////////////////////////
+class Print {
+public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+    size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+    virtual void flush() {}
+
+    size_t print(const char *str) { return write(str); }
+    size_t print(const String &str) { return write(str.c_str()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char value, int base = DEC) { return print((unsigned long long)value, base); }
+    size_t print(int value, int base = DEC) { return print((long long)value, base); }
+    size_t print(unsigned value, int base = DEC) { return print((unsigned long long)value, base); }
+    size_t print(long value, int base = DEC) { return print((long long)value, base); }
+    size_t print(unsigned long value, int base = DEC) { return print((unsigned long long)value, base); }
+    size_t print(long long value, int base = DEC) { return print(String(value, base)); }
+    size_t print(unsigned long long value, int base = DEC) { return print(String(value, base)); }
+    size_t print(double value, int decimals = 2) { return print(String(value, (unsigned char)decimals)); }
+
+    size_t println() { return write("\r\n"); }
+    template <typename T> size_t println(const T &value) { size_t n = print(value); return n + println(); }
+    template <typename T> size_t println(const T &value, int format) { size_t n = print(value, format); return n + println(); }
+
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+    size_t readBytes(uint8_t *buffer, size_t length);
+    size_t readBytes(char *buffer, size_t length) { return readBytes((uint8_t *)buffer, length); }
+
+protected:
+    unsigned long _timeout = 1000;
+};
+
+class HardwareSerial : public Stream {
+public:
+    void begin(unsigned long /* baud */) {}
+    void end() {}
+
+    size_t write(uint8_t c) override { return fwrite(&c, 1, 1, stdout); }
+    size_t write(const uint8_t *buffer, size_t size) override { return fwrite(buffer, 1, size, stdout); }
+    using Print::write;
+    void flush() override { fflush(stdout); }
+
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+
+    operator bool() const { return true; }
+};
+
+extern HardwareSerial Serial;
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Time
+/////////////////////////////////////////////////////////////////////////////////////
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * @file FS.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Host file system over stdio, rooted at a directory
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __HOST_FS_H__
+#define __HOST_FS_H__
+
+#include <Arduino.h>
+#include <memory>
+#include <string>
+
+namespace fs {
+
+enum SeekMode {
+    SeekSet = 0,
+    SeekCur = 1,
+    SeekEnd = 2
+};
+
+class File : public Stream {
+public:
+    File() {}
+    File(FILE *fp, const char *path);
+
+    operator bool() const { return (bool)_fp; }
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    void flush() override { if (_fp) fflush(_fp.get()); }
+
+    int available() override { return size() - position(); }
+    int read() override;
+    int peek() override;
+    size_t read(uint8_t *buffer, size_t size);
+
+    bool seek(uint32_t pos, SeekMode mode = SeekSet);
+    size_t position() const;
+    size_t size() const;
+    void close() { _fp.reset(); }
+
+    const char *path() const { return _path.c_str(); }
+    const char *name() const;
+    bool isDirectory() const { return false; }
+
+private:
+    std::shared_ptr<FILE> _fp;
+    std::string _path;
+};
+
+// Paths are relative to root, like a mounted LittleFS or SD
+class FS {
+public:
+    FS(const char *root = ".") : _root(root) {}
+
+    File open(const char *path, const char *mode = "r", bool create = false);
+    File open(const String &path, const char *mode = "r", bool create = false) {
+        return open(path.c_str(), mode, create);
+    }
+    bool exists(const char *path);
+    bool exists(const String &path) { return exists(path.c_str()); }
+    bool remove(const char *path);
+    bool remove(const String &path) { return remove(path.c_str()); }
+
+private:
+    std::string _root;
+
+    std::string fullPath(const char *path) const;
+};
+
+}
+
+using fs::File;
+using fs::FS;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+
+#endif
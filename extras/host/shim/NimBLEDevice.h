@@ -0,0 +1,137 @@
+/**
+ * @file NimBLEDevice.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief NimBLE-Arduino 1.x client API without a radio
+ * @version 0.1
+ * @date 2024-10-09
+ *
+ * Scans find nothing and connections fail, so the host build talks to a
+ * device only through ChameleonUltra::setTransport.
+ */
+
+
+#ifndef __HOST_NIMBLE_DEVICE_H__
+#define __HOST_NIMBLE_DEVICE_H__
+
+#include <Arduino.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+class NimBLEUUID {
+public:
+    NimBLEUUID() {}
+    NimBLEUUID(const char *uuid) : _uuid(uuid) {}
+    std::string toString() const { return _uuid; }
+
+private:
+    std::string _uuid;
+};
+
+class NimBLEAddress {
+public:
+    NimBLEAddress(uint64_t address = 0) : _address(address) {}
+    std::string toString() const;
+    operator uint64_t() const { return _address; }
+
+private:
+    uint64_t _address;
+};
+
+class NimBLERemoteCharacteristic;
+typedef std::function<void(NimBLERemoteCharacteristic *, uint8_t *, size_t, bool)> notify_callback;
+
+class NimBLERemoteDescriptor {
+public:
+    std::string toString() { return ""; }
+};
+
+class NimBLERemoteCharacteristic {
+public:
+    bool writeValue(const uint8_t * /* data */, size_t /* length */, bool /* response */ = false) { return false; }
+    bool subscribe(bool /* notifications */ = true, notify_callback /* callback */ = nullptr, bool /* response */ = false) { return false; }
+
+    NimBLEUUID getUUID() { return NimBLEUUID(); }
+    std::string getValue() { return ""; }
+    std::string toString() { return ""; }
+    bool canRead() { return false; }
+    bool canWrite() { return false; }
+    bool canWriteNoResponse() { return false; }
+    bool canNotify() { return false; }
+    bool canIndicate() { return false; }
+    bool canBroadcast() { return false; }
+    std::vector<NimBLERemoteDescriptor *> *getDescriptors(bool /* refresh */ = false) { return &_descriptors; }
+
+private:
+    std::vector<NimBLERemoteDescriptor *> _descriptors;
+};
+
+class NimBLERemoteService {
+public:
+    NimBLERemoteCharacteristic *getCharacteristic(const NimBLEUUID & /* uuid */) { return nullptr; }
+    std::vector<NimBLERemoteCharacteristic *> *getCharacteristics(bool /* refresh */ = false) { return &_characteristics; }
+    std::string toString() { return ""; }
+
+private:
+    std::vector<NimBLERemoteCharacteristic *> _characteristics;
+};
+
+class NimBLEAdvertisedDevice {
+public:
+    std::string getName() { return ""; }
+    NimBLEAddress getAddress() { return NimBLEAddress(); }
+};
+
+class NimBLEAdvertisedDeviceCallbacks {
+public:
+    virtual ~NimBLEAdvertisedDeviceCallbacks() {}
+    virtual void onResult(NimBLEAdvertisedDevice * /* device */) {}
+};
+
+class NimBLEScanResults {
+public:
+    int getCount() { return 0; }
+    NimBLEAdvertisedDevice getDevice(uint32_t /* index */) { return NimBLEAdvertisedDevice(); }
+};
+typedef NimBLEScanResults BLEScanResults;
+
+class NimBLEScan {
+public:
+    void setAdvertisedDeviceCallbacks(NimBLEAdvertisedDeviceCallbacks *callbacks) { _callbacks = callbacks; }
+    void setActiveScan(bool /* active */) {}
+    NimBLEScanResults start(uint32_t /* duration */) { return NimBLEScanResults(); }
+    bool stop() { return true; }
+    void clearResults() {}
+
+private:
+    NimBLEAdvertisedDeviceCallbacks *_callbacks = nullptr;
+};
+
+class NimBLEClient {
+public:
+    bool connect(NimBLEAdvertisedDevice * /* device */, bool /* deleteAttributes */ = true) { return false; }
+    bool disconnect() { return true; }
+    bool isConnected() { return false; }
+    NimBLEAddress getPeerAddress() { return NimBLEAddress(); }
+    uint16_t getMTU() { return 23; }
+    NimBLERemoteService *getService(const NimBLEUUID & /* uuid */) { return nullptr; }
+    std::vector<NimBLERemoteService *> *getServices(bool /* refresh */ = false) { return &_services; }
+
+private:
+    std::vector<NimBLERemoteService *> _services;
+};
+
+class NimBLEDevice {
+public:
+    static void init(const std::string & /* name */) { _initialized = true; }
+    static void deinit(bool /* clearAll */ = false) { _initialized = false; }
+    static bool getInitialized() { return _initialized; }
+    static NimBLEScan *getScan();
+    static NimBLEClient *createClient();
+
+private:
+    static bool _initialized;
+};
+typedef NimBLEDevice BLEDevice;
+
+#endif
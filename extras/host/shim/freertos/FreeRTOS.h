@@ -0,0 +1,30 @@
+/**
+ * @file FreeRTOS.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief FreeRTOS types for the host build, tasks run on std::thread
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __HOST_FREERTOS_H__
+#define __HOST_FREERTOS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+
+// One tick per millisecond
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+#endif
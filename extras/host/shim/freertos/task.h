@@ -0,0 +1,28 @@
+/**
+ * @file task.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief FreeRTOS tasks for the host build
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __HOST_FREERTOS_TASK_H__
+#define __HOST_FREERTOS_TASK_H__
+
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+// Runs the task on a detached thread, stack size and priority are ignored
+BaseType_t xTaskCreate(
+    TaskFunction_t task, const char *name, uint32_t stackDepth, void *params,
+    UBaseType_t priority, TaskHandle_t *handle
+);
+// Only deleting the calling task is supported, it ends when the task
+// function returns
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+
+#endif
@@ -0,0 +1,377 @@
+/**
+ * @file shim.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Host implementation of the Arduino, FS, NimBLE and FreeRTOS shims
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#include <Arduino.h>
+#include <FS.h>
+#include <NimBLEDevice.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <chrono>
+#include <condition_variable>
+#include <ctype.h>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+HardwareSerial Serial;
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// String
+/////////////////////////////////////////////////////////////////////////////////////
+String::String(double value, unsigned char decimals) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", decimals, value);
+    _str = buf;
+}
+
+
+std::string String::format(long long value, int base) {
+    if (value < 0 && base == DEC) return "-" + format((unsigned long long)-value, base);
+    return format((unsigned long long)value, base);
+}
+
+
+std::string String::format(unsigned long long value, int base) {
+    if (base < 2 || base > 36) base = DEC;
+    char buf[65];
+    char *p = buf + sizeof(buf) - 1;
+    *p = 0;
+    do {
+        uint8_t digit = value % base;
+        *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        value /= base;
+    } while (value);
+    return p;
+}
+
+
+String String::substring(unsigned from, unsigned to) const {
+    if (from > to) std::swap(from, to);
+    if (from >= _str.size()) return String();
+    return String(_str.substr(from, to - from));
+}
+
+
+int String::indexOf(char c, unsigned from) const {
+    size_t pos = _str.find(c, from);
+    return pos == std::string::npos ? -1 : (int)pos;
+}
+
+
+int String::indexOf(const String &str, unsigned from) const {
+    size_t pos = _str.find(str._str, from);
+    return pos == std::string::npos ? -1 : (int)pos;
+}
+
+
+bool String::endsWith(const String &suffix) const {
+    return _str.size() >= suffix._str.size()
+        && _str.compare(_str.size() - suffix._str.size(), suffix._str.size(), suffix._str) == 0;
+}
+
+
+void String::toCharArray(char *buf, unsigned size) const {
+    if (!size) return;
+    size_t n = std::min<size_t>(size - 1, _str.size());
+    memcpy(buf, _str.data(), n);
+    buf[n] = 0;
+}
+
+
+void String::toUpperCase() {
+    for (char &c : _str) c = toupper((unsigned char)c);
+}
+
+
+void String::toLowerCase() {
+    for (char &c : _str) c = tolower((unsigned char)c);
+}
+
+
+void String::trim() {
+    size_t start = 0;
+    size_t end = _str.size();
+    while (start < end && isspace((unsigned char)_str[start])) start++;
+    while (end > start && isspace((unsigned char)_str[end - 1])) end--;
+    _str = _str.substr(start, end - start);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Print and Stream
+/////////////////////////////////////////////////////////////////////////////////////
+size_t Print::write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (n < size && write(buffer[n])) n++;
+    return n;
+}
+
+
+size_t Print::printf(const char *format, ...) {
+    char buf[256];
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (length < 0) return 0;
+    if ((size_t)length < sizeof(buf)) return write((const uint8_t *)buf, length);
+
+    std::vector<char> large(length + 1);
+    va_start(args, format);
+    vsnprintf(large.data(), large.size(), format, args);
+    va_end(args);
+    return write((const uint8_t *)large.data(), length);
+}
+
+
+size_t Stream::readBytes(uint8_t *buffer, size_t length) {
+    size_t n = 0;
+    unsigned long start = millis();
+    while (n < length && millis() - start < _timeout) {
+        int c = read();
+        if (c < 0) {
+            if (!available()) break;
+            continue;
+        }
+        buffer[n++] = c;
+    }
+    return n;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Time
+/////////////////////////////////////////////////////////////////////////////////////
+static const std::chrono::steady_clock::time_point bootTime = std::chrono::steady_clock::now();
+
+
+unsigned long millis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - bootTime).count();
+}
+
+
+// Wraps at 32 bits like on the ESP32
+unsigned long micros() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bootTime).count();
+}
+
+
+void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+
+void delayMicroseconds(unsigned int us) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+
+void yield() {
+    std::this_thread::yield();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// FS
+/////////////////////////////////////////////////////////////////////////////////////
+namespace fs {
+
+File::File(FILE *fp, const char *path) : _fp(fp, fclose), _path(path) {}
+
+
+size_t File::write(const uint8_t *buffer, size_t size) {
+    return _fp ? fwrite(buffer, 1, size, _fp.get()) : 0;
+}
+
+
+int File::read() {
+    if (!_fp) return -1;
+    int c = fgetc(_fp.get());
+    return c == EOF ? -1 : c;
+}
+
+
+int File::peek() {
+    if (!_fp) return -1;
+    int c = fgetc(_fp.get());
+    if (c == EOF) return -1;
+    ungetc(c, _fp.get());
+    return c;
+}
+
+
+size_t File::read(uint8_t *buffer, size_t size) {
+    return _fp ? fread(buffer, 1, size, _fp.get()) : 0;
+}
+
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+    static const int whence[] = {SEEK_SET, SEEK_CUR, SEEK_END};
+    return _fp && fseek(_fp.get(), pos, whence[mode]) == 0;
+}
+
+
+size_t File::position() const {
+    return _fp ? ftell(_fp.get()) : 0;
+}
+
+
+size_t File::size() const {
+    if (!_fp) return 0;
+    long pos = ftell(_fp.get());
+    fseek(_fp.get(), 0, SEEK_END);
+    long end = ftell(_fp.get());
+    fseek(_fp.get(), pos, SEEK_SET);
+    return end;
+}
+
+
+const char *File::name() const {
+    size_t slash = _path.rfind('/');
+    return _path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+}
+
+
+std::string FS::fullPath(const char *path) const {
+    return _root + (path[0] == '/' ? "" : "/") + path;
+}
+
+
+// Arduino modes map to binary stdio modes, "r+" and "w+" included
+File FS::open(const char *path, const char *mode, bool /* create */) {
+    std::string m = mode;
+    m.insert(1, "b");
+    FILE *fp = fopen(fullPath(path).c_str(), m.c_str());
+    return fp ? File(fp, path) : File();
+}
+
+
+bool FS::exists(const char *path) {
+    FILE *fp = fopen(fullPath(path).c_str(), "rb");
+    if (fp) fclose(fp);
+    return fp != nullptr;
+}
+
+
+bool FS::remove(const char *path) {
+    return ::remove(fullPath(path).c_str()) == 0;
+}
+
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// NimBLE
+/////////////////////////////////////////////////////////////////////////////////////
+bool NimBLEDevice::_initialized = false;
+
+
+std::string NimBLEAddress::toString() const {
+    char buf[18];
+    snprintf(
+        buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x",
+        (uint8_t)(_address >> 40), (uint8_t)(_address >> 32), (uint8_t)(_address >> 24),
+        (uint8_t)(_address >> 16), (uint8_t)(_address >> 8), (uint8_t)_address
+    );
+    return buf;
+}
+
+
+NimBLEScan *NimBLEDevice::getScan() {
+    static NimBLEScan scan;
+    return &scan;
+}
+
+
+NimBLEClient *NimBLEDevice::createClient() {
+    static NimBLEClient client;
+    return &client;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// FreeRTOS
+/////////////////////////////////////////////////////////////////////////////////////
+struct HostQueue {
+    size_t length;
+    size_t itemSize;
+    std::deque<std::vector<uint8_t>> items;
+    std::mutex lock;
+    std::condition_variable changed;
+};
+
+
+template <typename Pred>
+static bool waitFor(HostQueue *queue, std::unique_lock<std::mutex> &lock, TickType_t wait, Pred ready) {
+    if (wait == portMAX_DELAY) {
+        queue->changed.wait(lock, ready);
+        return true;
+    }
+    return queue->changed.wait_for(lock, std::chrono::milliseconds(wait), ready);
+}
+
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+    return new HostQueue{length, itemSize, {}, {}, {}};
+}
+
+
+void vQueueDelete(QueueHandle_t queue) {
+    delete queue;
+}
+
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait) {
+    std::unique_lock<std::mutex> lock(queue->lock);
+    if (!waitFor(queue, lock, wait, [&] { return queue->items.size() < queue->length; })) return pdFALSE;
+
+    const uint8_t *p = (const uint8_t *)item;
+    queue->items.emplace_back(p, p + queue->itemSize);
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait) {
+    std::unique_lock<std::mutex> lock(queue->lock);
+    if (!waitFor(queue, lock, wait, [&] { return !queue->items.empty(); })) return pdFALSE;
+
+    memcpy(item, queue->items.front().data(), queue->itemSize);
+    queue->items.pop_front();
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    std::lock_guard<std::mutex> lock(queue->lock);
+    return queue->items.size();
+}
+
+
+BaseType_t xTaskCreate(
+    TaskFunction_t task, const char * /* name */, uint32_t /* stackDepth */, void *params,
+    UBaseType_t /* priority */, TaskHandle_t *handle
+) {
+    std::thread thread(task, params);
+    if (handle) *handle = (TaskHandle_t)(uintptr_t)std::hash<std::thread::id>()(thread.get_id());
+    thread.detach();
+    return pdPASS;
+}
+
+
+void vTaskDelete(TaskHandle_t /* task */) {}
+
+
+void vTaskDelay(TickType_t ticks) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS));
+}
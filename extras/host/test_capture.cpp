@@ -0,0 +1,143 @@
+/**
+ * @file test_capture.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Records a session against a fake card and replays it without one
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#include <Arduino.h>
+#include <FS.h>
+#include <chameleonUltra.h>
+#include <capture.h>
+#include "check.h"
+
+uint8_t calculateLRC(const uint8_t *data, size_t length);
+
+uint8_t card[64 * 16];
+uint8_t response[10 + 16];
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Fake device
+/////////////////////////////////////////////////////////////////////////////////////
+// Reads return the card block, everything else succeeds with no data. Each
+// command takes 2 ms, so the capture has delays to replay.
+bool answer(const uint8_t *frame, size_t /* length */, void * /* ctx */) {
+    uint16_t cmd = frame[2] << 8 | frame[3];
+    size_t size = 0;
+    if (cmd == ChameleonUltra::MF1_READ_ONE_BLOCK) {
+        memcpy(response + 9, card + frame[10] * 16, 16);
+        size = 16;
+    }
+
+    response[0] = 0x11;
+    response[1] = 0xEF;
+    response[2] = frame[2];
+    response[3] = frame[3];
+    response[4] = 0x00;
+    response[5] = ChameleonUltra::HF_TAG_OK;
+    response[6] = 0x00;
+    response[7] = size;
+    response[8] = calculateLRC(response + 2, 6);
+    response[9 + size] = calculateLRC(response + 9, size);
+
+    delay(2);
+    ChameleonUltra::notify(response, 10 + size);
+    return true;
+}
+
+
+// Three reads and a pipelined write over two sectors
+bool session(ChameleonUltra &chm, uint8_t blocks[3][16]) {
+    uint8_t key[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    bool ok = true;
+
+    for (int i = 0; i < 3; i++) {
+        uint8_t cmd[8] = {ChameleonUltra::MF_KEY_A, (uint8_t)(4 + i)};
+        memcpy(cmd + 2, key, 6);
+        ChameleonUltra::CmdRequest request = {ChameleonUltra::MF1_READ_ONE_BLOCK, cmd, sizeof(cmd)};
+        ok &= chm.runPipeline(&request, 1);
+        memcpy(blocks[i], chm.cmdResponse.data, 16);
+    }
+
+    ChameleonUltra::MfSectorKeys keys[16];
+    for (auto &k : keys) {
+        k = {true, true, {}, {}, ChameleonUltra::MF_KEY_A};
+        memcpy(k.keyA, key, 6);
+        memcpy(k.keyB, key, 6);
+    }
+    uint8_t data[16] = {1, 2, 3};
+    ChameleonUltra::MfBlockImage images[] = {{8, data}, {9, data}, {10, data}, {12, data}};
+    ok &= chm.mfWriteBlocks(images, 4, keys);
+
+    return ok;
+}
+
+
+int main() {
+    fs::FS fs(".");
+    for (size_t i = 0; i < sizeof(card); i++) card[i] = i * 7;
+
+    // Live session, recorded
+    uint8_t live[3][16] = {};
+    ChameleonUltra chm;
+    BleCapture capture;
+    CHECK(capture.begin());
+    chm.setTransport(answer);
+    chm.setCapture(&capture);
+    CHECK(session(chm, live));
+    chm.setCapture(nullptr);
+    CHECK(memcmp(live[0], card + 4 * 16, 16) == 0);
+    CHECK(capture.records() > 0 && capture.dropped() == 0);
+
+    File out = fs.open("/capture.bin", "w");
+    CHECK(capture.writeTo(out) > 0);
+    out.close();
+
+    // Replayed, at the captured pace and 4 times faster
+    for (float speed : {1.0f, 4.0f}) {
+        uint8_t replayed[3][16] = {};
+        ChameleonUltra offline;
+        BleReplay replay;
+        File in = fs.open("/capture.bin", "r");
+        CHECK(replay.load(in));
+        CHECK(replay.start(offline, speed));
+        CHECK(session(offline, replayed));
+        CHECK(replay.wait(1000));
+
+        BleReplay::Stats stats = replay.stats();
+        replay.stop();
+        CHECK(memcmp(live, replayed, sizeof(live)) == 0);
+        CHECK(stats.txFrames > 0 && stats.txMismatches == 0);
+        CHECK(stats.rxFrames == stats.txFrames);
+        printf(
+            "replay x%.0f: %zu frames, captured %u us, replayed in %u us\n",
+            speed, stats.txFrames, stats.capturedUs, stats.elapsedUs
+        );
+    }
+
+    // A full ring drops the oldest records, not the newest
+    BleCapture small;
+    CHECK(small.begin(100));
+    uint8_t frame[30] = {};
+    for (uint8_t i = 0; i < 10; i++) {
+        frame[0] = i;
+        small.record(BleCapture::TX, frame, sizeof(frame));
+    }
+    CHECK(small.dropped() == 10 - small.records());
+
+    out = fs.open("/small.bin", "w");
+    small.writeTo(out);
+    out.close();
+    File in = fs.open("/small.bin", "r");
+    uint8_t last = 0;
+    BleCapture::read(in, [](const BleCapture::Record &, const uint8_t *data, void *ctx) {
+        *(uint8_t *)ctx = data[0];
+        return true;
+    }, &last);
+    CHECK(last == 9);
+
+    return checkResult();
+}
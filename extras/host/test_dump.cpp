@@ -0,0 +1,208 @@
+/**
+ * @file test_dump.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Round trips a MIFARE Classic 1K dump through every dump format
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#include <Arduino.h>
+#include <dump.h>
+#include <string>
+#include "check.h"
+
+#define BLOCKS 64
+#define SECTORS 16
+
+
+// In memory Stream, reads what was written
+class MemoryStream : public Stream {
+public:
+    std::string data;
+
+    size_t write(uint8_t c) override { data += (char)c; return 1; }
+    size_t write(const uint8_t *buffer, size_t size) override { data.append((const char *)buffer, size); return size; }
+    using Print::write;
+
+    int available() override { return data.size() - _pos; }
+    int read() override { return _pos < data.size() ? (uint8_t)data[_pos++] : -1; }
+    int peek() override { return _pos < data.size() ? (uint8_t)data[_pos] : -1; }
+
+private:
+    size_t _pos = 0;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Reference card
+/////////////////////////////////////////////////////////////////////////////////////
+uint8_t card[BLOCKS][16];
+bool cardValid[BLOCKS];
+ChameleonUltra::MfSectorKeys cardKeys[SECTORS];
+TagDump::Info cardInfo;
+
+void makeCard() {
+    const uint8_t uid[4] = {0xDE, 0xAD, 0xBE, 0xEF};
+    const uint8_t block0[16] = {
+        0xDE, 0xAD, 0xBE, 0xEF, 0xDE ^ 0xAD ^ 0xBE ^ 0xEF, 0x08, 0x04, 0x00,
+        0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69
+    };
+
+    for (int b = 0; b < BLOCKS; b++) {
+        for (int i = 0; i < 16; i++) card[b][i] = b * 13 + i;
+        cardValid[b] = true;
+    }
+    memcpy(card[0], block0, 16);
+
+    for (int s = 0; s < SECTORS; s++) {
+        ChameleonUltra::MfSectorKeys &k = cardKeys[s];
+        k = {true, true, {}, {}, ChameleonUltra::MF_KEY_A};
+        for (int i = 0; i < 6; i++) {
+            k.keyA[i] = 0xA0 + s;
+            k.keyB[i] = 0xB0 + i;
+        }
+        uint8_t *trailer = card[s * 4 + 3];
+        memcpy(trailer, k.keyA, 6);
+        trailer[6] = 0xFF;
+        trailer[7] = 0x07;
+        trailer[8] = 0x80;
+        trailer[9] = 0x69;
+        memcpy(trailer + 10, k.keyB, 6);
+    }
+
+    // A gap, a missing trailer and a run at the end
+    cardValid[9] = cardValid[10] = false;
+    cardValid[23] = false;
+    cardValid[60] = cardValid[61] = cardValid[62] = cardValid[63] = false;
+
+    cardInfo = {};
+    cardInfo.tagType = ChameleonUltra::MIFARE_1024;
+    cardInfo.blockSize = 16;
+    cardInfo.blockCount = BLOCKS;
+    cardInfo.uidSize = 4;
+    memcpy(cardInfo.uid, uid, 4);
+    cardInfo.atqa[0] = 0x00;
+    cardInfo.atqa[1] = 0x04;
+    cardInfo.sak = 0x08;
+}
+
+
+bool writeCard(Print &out, TagDump::Format format) {
+    TagDumpWriter writer(format);
+    if (!writer.begin(out, cardInfo)) return false;
+    for (int b = 0; b < BLOCKS; b++) {
+        if (cardValid[b] && !writer.write(b, card[b])) return false;
+    }
+    return writer.end(cardKeys, SECTORS);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Checks
+/////////////////////////////////////////////////////////////////////////////////////
+// zeroInvalid: the format keeps no validity, missing blocks come back
+// as valid zeroed blocks
+void checkBlocks(TagDumpReader &reader, bool zeroInvalid) {
+    uint8_t data[16];
+    uint16_t block;
+    bool valid;
+    int count = 0;
+
+    while (reader.read(block, data, valid)) {
+        CHECK(block == count);
+        if (block >= BLOCKS) break;
+
+        if (cardValid[block]) {
+            CHECK(valid);
+            CHECK(memcmp(data, card[block], 16) == 0);
+        } else {
+            uint8_t zero[16] = {};
+            CHECK(valid == zeroInvalid);
+            CHECK(memcmp(data, zero, 16) == 0);
+        }
+        count++;
+    }
+    CHECK(count == BLOCKS);
+}
+
+
+// trailersOnly: keys come from the trailers, zeroInvalid: a missing
+// trailer reads as zero keys
+void checkKeys(TagDumpReader &reader, bool trailersOnly, bool zeroInvalid) {
+    // Up to the last sector with a known key
+    int sectors = 0;
+    for (int s = 0; s < SECTORS; s++) {
+        if (!trailersOnly || zeroInvalid || cardValid[s * 4 + 3]) sectors = s + 1;
+    }
+    CHECK(reader.sectors() == sectors);
+
+    for (int s = 0; s < SECTORS; s++) {
+        const ChameleonUltra::MfSectorKeys &k = reader.keys()[s];
+        bool fromCard = !trailersOnly || cardValid[s * 4 + 3];
+        bool known = fromCard || zeroInvalid;
+        uint8_t zero[6] = {};
+
+        CHECK(k.hasKeyA == known && k.hasKeyB == known);
+        if (!known) continue;
+        CHECK(memcmp(k.keyA, fromCard ? cardKeys[s].keyA : zero, 6) == 0);
+        CHECK(memcmp(k.keyB, fromCard ? cardKeys[s].keyB : zero, 6) == 0);
+        CHECK(k.preferred == ChameleonUltra::MF_KEY_A);
+    }
+}
+
+
+void checkInfo(const TagDump::Info &info) {
+    CHECK(info.tagType == cardInfo.tagType);
+    CHECK(info.blockSize == 16);
+    CHECK(info.blockCount == BLOCKS);
+    CHECK(info.uidSize == 4 && memcmp(info.uid, cardInfo.uid, 4) == 0);
+    CHECK(info.atqa[0] == cardInfo.atqa[0] && info.atqa[1] == cardInfo.atqa[1]);
+    CHECK(info.sak == cardInfo.sak);
+}
+
+
+// The card written as .cud, converted to `format` and back
+void roundTrip(TagDump::Format format, bool zeroInvalid, bool trailersOnly) {
+    MemoryStream cud;
+    CHECK(writeCard(cud, TagDump::FORMAT_CUD));
+
+    MemoryStream converted;
+    CHECK(TagDump::convert(cud, TagDump::FORMAT_CUD, converted, format));
+
+    MemoryStream back;
+    CHECK(TagDump::convert(converted, format, back, TagDump::FORMAT_CUD));
+
+    TagDumpReader reader(TagDump::FORMAT_CUD);
+    CHECK(reader.begin(back));
+    checkInfo(reader.info());
+    checkBlocks(reader, zeroInvalid);
+    checkKeys(reader, trailersOnly, zeroInvalid);
+}
+
+
+int main() {
+    makeCard();
+
+    // .cud straight from the writer
+    MemoryStream cud;
+    CHECK(writeCard(cud, TagDump::FORMAT_CUD));
+    TagDumpReader reader(TagDump::FORMAT_CUD);
+    CHECK(reader.begin(cud));
+    checkInfo(reader.info());
+    checkBlocks(reader, false);
+    checkKeys(reader, false, false);
+
+    roundTrip(TagDump::FORMAT_CUD, false, false);
+    roundTrip(TagDump::FORMAT_BIN, true, true);
+    roundTrip(TagDump::FORMAT_EML, false, true);
+    roundTrip(TagDump::FORMAT_JSON, false, false);
+
+    // Format detection from the file name
+    CHECK(TagDump::formatOf("/dumps/card.BIN") == TagDump::FORMAT_BIN);
+    CHECK(TagDump::formatOf("card.eml") == TagDump::FORMAT_EML);
+    CHECK(TagDump::formatOf("card.json") == TagDump::FORMAT_JSON);
+    CHECK(TagDump::formatOf("card.cud") == TagDump::FORMAT_CUD);
+
+    return checkResult();
+}
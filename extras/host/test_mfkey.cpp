@@ -0,0 +1,166 @@
+/**
+ * @file test_mfkey.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Key recovery from fixed nonce vectors
+ * @version 0.1
+ * @date 2024-10-09
+ *
+ * The mfkey64 vector is the one shipped with the Proxmark3 mfkey64 tool.
+ * The others were generated with the forward cipher from the listed keys.
+ */
+
+
+#include <mfkey.h>
+#include "check.h"
+
+// Keys reported by the last recovery
+static uint64_t keys[8];
+static size_t keyCount = 0;
+
+static bool onKey(uint64_t key, void * /* ctx */) {
+    if (keyCount < 8) keys[keyCount] = key;
+    keyCount++;
+    return true;
+}
+
+static size_t reset() {
+    size_t count = keyCount;
+    keyCount = 0;
+    return count;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// mfkey64: one full auth, ar and at give 64 bits of keystream
+/////////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+    uint32_t uid;
+    uint32_t nt;
+    uint32_t nrEnc;
+    uint32_t ks3;
+} Mfkey64;
+
+static bool mfkey64State(const Crypto1 &state, void *ctx) {
+    Mfkey64 *m = (Mfkey64 *)ctx;
+    Crypto1 s = state;
+    if (s.word(0) != m->ks3) return true;
+
+    s.rollbackWord(0);
+    s.rollbackWord(0);
+    s.rollbackWord(m->nrEnc, true);
+    s.rollbackWord(m->uid ^ m->nt);
+    return onKey(s.getLfsr(), nullptr);
+}
+
+static void testMfkey64(size_t memory) {
+    const uint32_t uid = 0x9c599b32;
+    const uint32_t nt = 0x82a4166c;
+    const uint32_t nrEnc = 0xa1e458ce;
+    const uint32_t arEnc = 0x6eea41e0;
+    const uint32_t atEnc = 0x5cadf439;
+
+    // Forward: the key produces the recorded answers
+    Crypto1 cipher(0xffffffffffffULL);
+    cipher.word(uid ^ nt);
+    cipher.word(nrEnc, true);
+    CHECK((cipher.word(0) ^ Crypto1::prngSuccessor(nt, 64)) == arEnc);
+    CHECK((cipher.word(0) ^ Crypto1::prngSuccessor(nt, 96)) == atEnc);
+
+    Mfkey64 m = {uid, nt, nrEnc, atEnc ^ Crypto1::prngSuccessor(nt, 96)};
+    CHECK(Crypto1::recovery32(arEnc ^ Crypto1::prngSuccessor(nt, 64), 0, mfkey64State, &m, memory));
+    CHECK(keyCount == 1 && keys[0] == 0xffffffffffffULL);
+    reset();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Nested, static nested and darkside
+/////////////////////////////////////////////////////////////////////////////////////
+static void testNested() {
+    // Key 4b791bea7bcc, distance 320 off by -3, +2 and +5
+    const MfKey::NestedNonce nonces[] = {
+        {0x01200145, 0xfe36f34a, 0x00},
+        {0x8a4e3b2d, 0x6bf94ade, 0x04},
+        {0x5c3f9e11, 0xbb61fab6, 0x00},
+    };
+
+    CHECK(MfKey::nested(0x2e5b7c3a, 320, nonces, 3, onKey, nullptr) == 1);
+    CHECK(keys[0] == 0x4b791bea7bccULL);
+    CHECK(MfKey::checkNested(keys[0], 0x2e5b7c3a, 320, nonces[0], 10));
+    CHECK(!MfKey::checkNested(keys[0], 0x2e5b7c3a, 320, nonces[0], 2));
+    reset();
+}
+
+static void testStaticNested() {
+    // Key a0a1a2a3a4a5, the static nonce of two sectors
+    const MfKey::NestedNonce nonces[] = {
+        {0x009080a2, 0x10d54ab0, 0},
+        {0x01200145, 0x1b8dbc56, 0},
+    };
+
+    CHECK(MfKey::staticNested(0x2e5b7c3a, nonces, 2, onKey, nullptr) == 1);
+    CHECK(keys[0] == 0xa0a1a2a3a4a5ULL);
+    reset();
+}
+
+static void testDarkside() {
+    // Key 0123456789ab, encrypted ar 5a5a5a5a
+    const MfKey::DarksideNonce nonces[] = {
+        {
+            0x2e5b7c3a, 0x6c4a2f11, 0x11223300, 0x5a5a5a5a,
+            {0xda, 0x32, 0x42, 0xba, 0x82, 0xfa, 0x1a, 0x02},
+            {0x9, 0x7, 0x3, 0x6, 0xb, 0x5, 0x6, 0xf},
+        },
+        {
+            0x2e5b7c3a, 0x2b7f9903, 0x55667700, 0x5a5a5a5a,
+            {0x35, 0xfd, 0xed, 0x45, 0xbd, 0xe5, 0x45, 0x0d},
+            {0x9, 0x9, 0x3, 0xb, 0xf, 0x5, 0xb, 0x6},
+        },
+    };
+
+    CHECK(MfKey::darkside(nonces, 2, onKey, nullptr) == 1);
+    CHECK(keys[0] == 0x0123456789abULL);
+    CHECK(MfKey::checkDarkside(keys[0], nonces[1]));
+    reset();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// mfkey32: reader auths from the emulator detection log
+/////////////////////////////////////////////////////////////////////////////////////
+static void testMfkey32() {
+    // Proxmark3 mfkey32v2 vector, key a0a1a2a3a4a5
+    const MfKey::ReaderNonce proxmark[] = {
+        {0x1ad8df2b, 0x1d316024, 0x620ef048},
+        {0x30d6cb07, 0xc52077e2, 0x837ac61a},
+    };
+    CHECK(MfKey::mfkey32(0x12345678, proxmark, 2, onKey, nullptr) == 1);
+    CHECK(keys[0] == 0xa0a1a2a3a4a5ULL);
+    reset();
+
+    // Key ffeeddccbbaa, reader nonces 11111111 and 22222222
+    const MfKey::ReaderNonce generated[] = {
+        {0x8f6e2d11, 0xebb2d5f4, 0x27ea5eb6},
+        {0x3c1f5e02, 0x3413f26b, 0x108651b2},
+    };
+    CHECK(MfKey::mfkey32(0x2e5b7c3a, generated, 2, onKey, nullptr) == 1);
+    CHECK(keys[0] == 0xffeeddccbbaaULL);
+    reset();
+
+    // One auth leaves about 50k candidates, it is refused
+    CHECK(MfKey::mfkey32(0x2e5b7c3a, generated, 1, onKey, nullptr) == 0);
+    reset();
+}
+
+
+int main() {
+    testMfkey64(CRYPTO1_RECOVERY_MEMORY);
+    // Windowed search, the PSRAM budget
+    testMfkey64(2 * 1024 * 1024);
+    testNested();
+    testStaticNested();
+    testDarkside();
+    testMfkey32();
+
+    return checkResult();
+}
@@ -0,0 +1,99 @@
+/**
+ * @file test_uid_index.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Builds a UID allow list and looks UIDs up, mapped and from a file
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#include <Arduino.h>
+#include <FS.h>
+#include <uidIndex.h>
+#include <string>
+#include "check.h"
+
+#define INDEX_FILE "test_uid_index.bin"
+
+
+// Reads a string once
+class TextStream : public Stream {
+public:
+    TextStream(const char *text) : _text(text) {}
+
+    size_t write(uint8_t /* c */) override { return 0; }
+    int available() override { return _text.size() - _pos; }
+    int read() override { return _pos < _text.size() ? (uint8_t)_text[_pos++] : -1; }
+    int peek() override { return _pos < _text.size() ? (uint8_t)_text[_pos] : -1; }
+
+private:
+    std::string _text;
+    size_t _pos = 0;
+};
+
+
+const char *list =
+    "# allow list\n"
+    "DEADBEEF\n"
+    "04:11:22:33:44:55:66\n"
+    "0102030405  # EM410x\n"
+    "04112233445566778899\n"
+    "041122334455667788AA\n"
+    "deadbeef\n"          // duplicate
+    "XYZ\n"               // malformed
+    "010203\n";           // unsupported length
+
+const uint8_t uid4[4] = {0xDE, 0xAD, 0xBE, 0xEF};
+const uint8_t uid7[7] = {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+const uint8_t uid5[5] = {0x01, 0x02, 0x03, 0x04, 0x05};
+const uint8_t uid10a[10] = {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99};
+const uint8_t uid10b[10] = {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0xAA};
+// Same first 7 bytes as the listed 10 byte UIDs
+const uint8_t uid10c[10] = {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x98};
+const uint8_t uid10d[10] = {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x00, 0x00, 0x00};
+const uint8_t uid4x[4] = {0xDE, 0xAD, 0xBE, 0xEE};
+
+
+void checkLookups(UidIndex &index) {
+    CHECK(index.size() == 5);
+
+    CHECK(index.contains(uid4, sizeof(uid4)));
+    CHECK(index.contains(uid7, sizeof(uid7)));
+    CHECK(index.contains(uid5, sizeof(uid5)));
+    CHECK(index.contains(uid10a, sizeof(uid10a)));
+    CHECK(index.contains(uid10b, sizeof(uid10b)));
+
+    // 10 byte UIDs match on every byte
+    CHECK(!index.contains(uid10c, sizeof(uid10c)));
+    CHECK(!index.contains(uid10d, sizeof(uid10d)));
+    CHECK(!index.contains(uid4x, sizeof(uid4x)));
+    // The length is part of the key
+    CHECK(!index.contains(uid7, 4));
+    CHECK(!index.contains(uid10a, 4));
+    CHECK(!index.contains(uid10a, 3));
+}
+
+
+int main() {
+    FS root(".");
+    TextStream source(list);
+
+    File out = root.open(INDEX_FILE, "w");
+    CHECK(out);
+    CHECK(UidIndex::build(source, out) == 5);
+    out.close();
+
+    UidIndex index;
+    CHECK(index.begin(INDEX_FILE));
+    checkLookups(index);
+    index.end();
+    CHECK(index.size() == 0);
+    CHECK(!index.contains(uid4, sizeof(uid4)));
+
+    CHECK(index.begin(root.open(INDEX_FILE)));
+    checkLookups(index);
+    index.end();
+
+    root.remove(INDEX_FILE);
+    return checkResult();
+}
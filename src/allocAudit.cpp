@@ -0,0 +1,90 @@
+/**
+ * @file allocAudit.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Heap allocation audit of the library hot paths
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+#include "allocAudit.h"
+#include <new>
+
+#if defined(ESP_PLATFORM) && __has_include(<sdkconfig.h>)
+#include <sdkconfig.h>
+#endif
+
+
+volatile uint32_t AllocAudit::_allocations = 0;
+volatile uint32_t AllocAudit::_bytes = 0;
+volatile uint32_t AllocAudit::_failures = 0;
+AllocAudit::FailureHandler AllocAudit::_handler = nullptr;
+
+
+static void printFailure(const char *name, uint32_t allocations, uint32_t bytes) {
+    Serial.printf("ALLOC %s: %u allocations, %u bytes\n", name, (unsigned)allocations, (unsigned)bytes);
+}
+
+
+AllocAudit::AllocAudit(const char *name) {
+    _name = name;
+    _startAllocations = _allocations;
+    _startBytes = _bytes;
+}
+
+
+AllocAudit::~AllocAudit() {
+    uint32_t count = allocations();
+    if (count == 0) return;
+
+    // The handler may allocate, keep it out of the counters
+    uint32_t size = bytes();
+    _failures++;
+    (_handler ? _handler : printFailure)(_name, count, size);
+    _allocations = _startAllocations + count;
+    _bytes = _startBytes + size;
+}
+
+
+void AllocAudit::record(size_t size) {
+    _allocations = _allocations + 1;
+    _bytes = _bytes + size;
+}
+
+
+void AllocAudit::onFailure(FailureHandler handler) {
+    _handler = handler;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Allocator hooks
+/////////////////////////////////////////////////////////////////////////////////////
+#ifdef CHAMELEON_ALLOC_AUDIT
+
+#ifdef CONFIG_HEAP_USE_HOOKS
+// Every heap allocation, including the malloc calls made by String
+extern "C" void esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps) {
+    AllocAudit::record(size);
+}
+
+#else
+// Only operator new can be seen without the IDF heap hooks
+void *operator new(size_t size) {
+    AllocAudit::record(size);
+    void *p = malloc(size);
+    if (!p) abort();
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    AllocAudit::record(size);
+    return malloc(size);
+}
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept { return operator new(size, tag); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+#endif
+
+#endif
@@ -0,0 +1,61 @@
+/**
+ * @file allocAudit.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Heap allocation audit of the library hot paths
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __ALLOC_AUDIT_H__
+#define __ALLOC_AUDIT_H__
+
+#include <Arduino.h>
+
+// Scan, read, write and emulator upload commands are meant to run without
+// touching the heap. Build with CHAMELEON_ALLOC_AUDIT defined to count the
+// allocations made during each of them: operator new is replaced and, on
+// ESP-IDF with CONFIG_HEAP_USE_HOOKS, malloc is counted too. A command
+// that allocates is reported to the failure handler.
+//
+// Counters are global, allocations made by other tasks while a command
+// runs are charged to it.
+class AllocAudit {
+public:
+    typedef void (*FailureHandler)(const char *name, uint32_t allocations, uint32_t bytes);
+
+    AllocAudit(const char *name);
+    ~AllocAudit();
+
+    // Allocations made since this scope started
+    uint32_t allocations() const { return _allocations - _startAllocations; }
+    uint32_t bytes() const { return _bytes - _startBytes; }
+
+    // Called by the allocator hooks, custom allocators may call it as well
+    static void record(size_t size);
+    static uint32_t totalAllocations() { return _allocations; }
+    static uint32_t totalBytes() { return _bytes; }
+    // Audited scopes that allocated
+    static uint32_t failures() { return _failures; }
+    static void resetFailures() { _failures = 0; }
+    // nullptr restores the default handler, which prints the scope name
+    static void onFailure(FailureHandler handler);
+
+private:
+    const char *_name;
+    uint32_t _startAllocations;
+    uint32_t _startBytes;
+
+    static volatile uint32_t _allocations;
+    static volatile uint32_t _bytes;
+    static volatile uint32_t _failures;
+    static FailureHandler _handler;
+};
+
+#ifdef CHAMELEON_ALLOC_AUDIT
+#define CHM_ALLOC_AUDIT(name) AllocAudit _allocAudit(name)
+#else
+#define CHM_ALLOC_AUDIT(name)
+#endif
+
+#endif
@@ -0,0 +1,175 @@
+/**
+ * @file asyncSink.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Print that drains to a File, Stream or callback on its own task
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+#include "asyncSink.h"
+#include <freertos/task.h>
+
+// SD and LittleFS writes need a few KB of stack
+#define ASYNC_SINK_STACK 4096
+
+
+bool AsyncSink::begin(Print &sink, size_t chunkSize, UBaseType_t priority) {
+    end();
+    _print = &sink;
+    return start(chunkSize, priority);
+}
+
+
+bool AsyncSink::begin(Callback sink, void *ctx, size_t chunkSize, UBaseType_t priority) {
+    end();
+    if (!sink) return false;
+    _callback = sink;
+    _ctx = ctx;
+    return start(chunkSize, priority);
+}
+
+
+bool AsyncSink::start(size_t chunkSize, UBaseType_t priority) {
+    _stats = {};
+    _failed = false;
+    _current = -1;
+    _chunkSize = chunkSize;
+
+    // Allocated once, writes only copy into it
+    _memory = (uint8_t *)malloc(chunkSize * ASYNC_SINK_CHUNKS);
+    _free = xQueueCreate(ASYNC_SINK_CHUNKS, sizeof(int8_t));
+    _full = xQueueCreate(ASYNC_SINK_CHUNKS + 1, sizeof(int8_t));
+
+    if (chunkSize == 0 || !_memory || !_free || !_full) {
+        end();
+        return false;
+    }
+
+    for (int8_t i = 0; i < ASYNC_SINK_CHUNKS; i++) {
+        _chunks[i] = {_memory + i * chunkSize, 0};
+        xQueueSend(_free, &i, 0);
+    }
+
+    _running = true;
+    if (xTaskCreate(drain, "asyncSink", ASYNC_SINK_STACK, this, priority, nullptr) != pdPASS) {
+        _running = false;
+        end();
+        return false;
+    }
+
+    return true;
+}
+
+
+bool AsyncSink::end() {
+    if (_running) {
+        flush();
+
+        int8_t stop = -1;
+        xQueueSend(_full, &stop, portMAX_DELAY);
+        while (_running) vTaskDelay(1);
+    }
+
+    if (_free) vQueueDelete(_free);
+    if (_full) vQueueDelete(_full);
+    free(_memory);
+    _free = nullptr;
+    _full = nullptr;
+    _memory = nullptr;
+    _print = nullptr;
+    _callback = nullptr;
+    _current = -1;
+
+    return !_failed;
+}
+
+
+size_t AsyncSink::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+
+size_t AsyncSink::write(const uint8_t *data, size_t length) {
+    size_t done = 0;
+
+    while (done < length && !_failed) {
+        if (_current < 0 && !acquire()) break;
+
+        Chunk &chunk = _chunks[_current];
+        size_t n = min(length - done, _chunkSize - chunk.length);
+        memcpy(chunk.data + chunk.length, data + done, n);
+        chunk.length += n;
+        done += n;
+
+        if (chunk.length == _chunkSize) commit();
+    }
+
+    return done;
+}
+
+
+void AsyncSink::flush() {
+    if (!_running) return;
+
+    commit();
+    while (uxQueueMessagesWaiting(_free) < ASYNC_SINK_CHUNKS) vTaskDelay(1);
+}
+
+
+// Next free chunk, waits for the sink when it is behind
+bool AsyncSink::acquire() {
+    if (!_running) return false;
+
+    uint32_t start = millis();
+    int8_t index;
+    if (xQueueReceive(_free, &index, portMAX_DELAY) != pdTRUE) return false;
+    _stats.waitMs += millis() - start;
+
+    _current = index;
+    _chunks[index].length = 0;
+    return true;
+}
+
+
+void AsyncSink::commit() {
+    if (_current < 0) return;
+
+    int8_t index = _current;
+    _current = -1;
+    if (_chunks[index].length == 0) {
+        xQueueSend(_free, &index, portMAX_DELAY);
+        return;
+    }
+    xQueueSend(_full, &index, portMAX_DELAY);
+}
+
+
+void AsyncSink::drain(void *arg) {
+    AsyncSink *sink = (AsyncSink *)arg;
+    int8_t index;
+
+    while (xQueueReceive(sink->_full, &index, portMAX_DELAY) == pdTRUE && index >= 0) {
+        Chunk &chunk = sink->_chunks[index];
+
+        // A failed sink keeps recycling chunks so the producer never hangs
+        if (!sink->_failed) {
+            uint32_t start = millis();
+            size_t written = sink->_print
+                ? sink->_print->write(chunk.data, chunk.length)
+                : sink->_callback(chunk.data, chunk.length, sink->_ctx);
+            sink->_stats.sinkMs += millis() - start;
+
+            if (written == chunk.length) {
+                sink->_stats.bytes += written;
+                sink->_stats.chunks++;
+            }
+            else sink->_failed = true;
+        }
+
+        xQueueSend(sink->_free, &index, portMAX_DELAY);
+    }
+
+    if (sink->_print) sink->_print->flush();
+    sink->_running = false;
+    vTaskDelete(nullptr);
+}
@@ -0,0 +1,87 @@
+/**
+ * @file asyncSink.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Print that drains to a File, Stream or callback on its own task
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __ASYNC_SINK_H__
+#define __ASYNC_SINK_H__
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+// Chunks handed to the sink task, two make a double buffer
+#ifndef ASYNC_SINK_CHUNKS
+#define ASYNC_SINK_CHUNKS 4
+#endif
+
+// Bytes written to it are copied into fixed chunks and a task hands the
+// full ones to the sink, so tag reads and storage overlap:
+//
+//   AsyncSink sink;
+//   sink.begin(file);
+//   chm.mfDump(writer, sink);
+//   sink.end();
+//
+// write() blocks while every chunk waits for the sink. Once the sink
+// fails, write() returns 0 and end() returns false.
+class AsyncSink : public Print {
+public:
+    // Runs on the sink task, returns the number of bytes taken
+    typedef size_t (*Callback)(const uint8_t *data, size_t length, void *ctx);
+
+    typedef struct {
+        size_t bytes;     // written to the sink
+        uint32_t chunks;
+        uint32_t waitMs;  // producer blocked on a full ring
+        uint32_t sinkMs;  // spent in the sink
+    } Stats;
+
+    AsyncSink() {}
+    ~AsyncSink() { end(); }
+
+    // File and Stream are both a Print
+    bool begin(Print &sink, size_t chunkSize = 512, UBaseType_t priority = 1);
+    bool begin(Callback sink, void *ctx, size_t chunkSize = 512, UBaseType_t priority = 1);
+    // Drains what is left and stops the task. False when the sink failed.
+    bool end();
+
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *data, size_t length) override;
+    // Hands the partial chunk over and waits until the sink took everything
+    void flush() override;
+
+    bool failed() const { return _failed; }
+    const Stats &stats() const { return _stats; }
+
+private:
+    typedef struct {
+        uint8_t *data;
+        size_t length;
+    } Chunk;
+
+    Print *_print = nullptr;
+    Callback _callback = nullptr;
+    void *_ctx = nullptr;
+
+    uint8_t *_memory = nullptr;
+    size_t _chunkSize = 0;
+    Chunk _chunks[ASYNC_SINK_CHUNKS] = {};
+    int8_t _current = -1;           // chunk being filled
+    QueueHandle_t _free = nullptr;  // chunk indices, -1 stops the task
+    QueueHandle_t _full = nullptr;
+    volatile bool _running = false;
+    volatile bool _failed = false;
+    Stats _stats = {};
+
+    bool start(size_t chunkSize, UBaseType_t priority);
+    bool acquire();
+    void commit();
+    static void drain(void *arg);
+};
+
+#endif
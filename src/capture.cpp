@@ -0,0 +1,347 @@
+/**
+ * @file capture.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief BLE traffic capture and replay
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+#include "capture.h"
+#include <chrono>
+
+#define CAPTURE_MAGIC 0x50434D43  // "CMCP"
+#define CAPTURE_VERSION 1
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t records;
+    uint32_t dropped;
+} CaptureHeader;
+
+
+static void encodeRecord(const BleCapture::Record &record, uint8_t header[7]) {
+    header[0] = record.direction;
+    for (int i = 0; i < 4; i++) header[1 + i] = record.time >> (8 * i);
+    header[5] = record.length;
+    header[6] = record.length >> 8;
+}
+
+
+static void decodeRecord(const uint8_t header[7], BleCapture::Record &record) {
+    record.direction = (BleCapture::Direction)header[0];
+    record.time = header[1] | header[2] << 8 | header[3] << 16 | (uint32_t)header[4] << 24;
+    record.length = header[5] | header[6] << 8;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Capture
+/////////////////////////////////////////////////////////////////////////////////////
+bool BleCapture::begin(size_t capacity) {
+    end();
+
+    std::lock_guard<std::mutex> guard(_lock);
+    _ring = new (std::nothrow) uint8_t[capacity];
+    if (!_ring) return false;
+
+    _capacity = capacity;
+    _head = _used = _records = _dropped = 0;
+    _start = micros();
+    return true;
+}
+
+
+void BleCapture::end() {
+    std::lock_guard<std::mutex> guard(_lock);
+    delete[] _ring;
+    _ring = nullptr;
+    _capacity = _head = _used = _records = 0;
+}
+
+
+void BleCapture::clear() {
+    std::lock_guard<std::mutex> guard(_lock);
+    _head = _used = _records = _dropped = 0;
+    _start = micros();
+}
+
+
+void BleCapture::put(size_t pos, const uint8_t *data, size_t length) {
+    pos %= _capacity;
+    size_t first = min(length, _capacity - pos);
+    memcpy(_ring + pos, data, first);
+    memcpy(_ring, data + first, length - first);
+}
+
+
+void BleCapture::get(size_t pos, uint8_t *data, size_t length) const {
+    pos %= _capacity;
+    size_t first = min(length, _capacity - pos);
+    memcpy(data, _ring + pos, first);
+    memcpy(data + first, _ring, length - first);
+}
+
+
+void BleCapture::record(Direction direction, const uint8_t *data, size_t length) {
+    Record record = {direction, (uint32_t)(micros() - _start), (uint16_t)length};
+    size_t size = RECORD_HEADER_SIZE + length;
+
+    std::lock_guard<std::mutex> guard(_lock);
+    if (!_ring || size > _capacity) {
+        _dropped++;
+        return;
+    }
+
+    // Make room dropping the oldest records
+    while (_capacity - _used < size) {
+        uint8_t header[RECORD_HEADER_SIZE];
+        Record oldest;
+        get(_head + _capacity - _used, header, sizeof(header));
+        decodeRecord(header, oldest);
+        _used -= RECORD_HEADER_SIZE + oldest.length;
+        _records--;
+        _dropped++;
+    }
+
+    uint8_t header[RECORD_HEADER_SIZE];
+    encodeRecord(record, header);
+    put(_head, header, sizeof(header));
+    put(_head + sizeof(header), data, length);
+
+    _head = (_head + size) % _capacity;
+    _used += size;
+    _records++;
+}
+
+
+size_t BleCapture::forEach(RecordCallback onRecord, void *ctx) {
+    size_t pos = _head + _capacity - _used;
+    size_t count = 0;
+
+    for (size_t i = 0; i < _records; i++) {
+        uint8_t header[RECORD_HEADER_SIZE];
+        uint8_t data[sizeof(ChameleonUltra::CmdResponse::raw)];
+        Record record;
+
+        get(pos, header, sizeof(header));
+        decodeRecord(header, record);
+        size_t length = min<size_t>(record.length, sizeof(data));
+        get(pos + sizeof(header), data, length);
+        pos += sizeof(header) + record.length;
+
+        count++;
+        if (!onRecord(record, data, ctx)) break;
+    }
+
+    return count;
+}
+
+
+static bool writeRecordHandler(const BleCapture::Record &record, const uint8_t *data, void *ctx) {
+    Print *out = (Print *)ctx;
+    uint8_t header[7];
+    encodeRecord(record, header);
+    return out->write(header, sizeof(header)) == sizeof(header)
+        && out->write(data, record.length) == record.length;
+}
+
+
+size_t BleCapture::writeTo(Print &out) {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (!_ring) return 0;
+
+    CaptureHeader header = {CAPTURE_MAGIC, CAPTURE_VERSION, 0, (uint32_t)_records, (uint32_t)_dropped};
+    if (out.write((const uint8_t *)&header, sizeof(header)) != sizeof(header)) return 0;
+
+    return forEach(writeRecordHandler, &out);
+}
+
+
+static bool printRecordHandler(const BleCapture::Record &record, const uint8_t *data, void *ctx) {
+    Print *out = (Print *)ctx;
+    out->printf("%10u %s", (unsigned)record.time, record.direction == BleCapture::TX ? "TX" : "RX");
+    for (size_t i = 0; i < record.length; i++) out->printf(" %02X", data[i]);
+    out->println();
+    return true;
+}
+
+
+size_t BleCapture::printTo(Print &out) {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (!_ring) return 0;
+
+    out.printf("%u records, %u dropped\n", (unsigned)_records, (unsigned)_dropped);
+    return forEach(printRecordHandler, &out);
+}
+
+
+size_t BleCapture::read(Stream &in, RecordCallback onRecord, void *ctx) {
+    CaptureHeader header;
+    if (in.readBytes((uint8_t *)&header, sizeof(header)) != sizeof(header)) return 0;
+    if (header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION) return 0;
+
+    size_t count = 0;
+    for (uint32_t i = 0; i < header.records; i++) {
+        uint8_t recordHeader[RECORD_HEADER_SIZE];
+        uint8_t data[sizeof(ChameleonUltra::CmdResponse::raw)];
+        Record record;
+
+        if (in.readBytes(recordHeader, sizeof(recordHeader)) != sizeof(recordHeader)) break;
+        decodeRecord(recordHeader, record);
+        if (record.length > sizeof(data) || in.readBytes(data, record.length) != record.length) break;
+
+        count++;
+        if (!onRecord(record, data, ctx)) break;
+    }
+
+    return count;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Replay
+/////////////////////////////////////////////////////////////////////////////////////
+static bool loadRecordHandler(const BleCapture::Record &record, const uint8_t *data, void *ctx) {
+    std::vector<uint8_t> *entries = (std::vector<uint8_t> *)ctx;
+    uint8_t header[7];
+    encodeRecord(record, header);
+    entries->insert(entries->end(), header, header + sizeof(header));
+    entries->insert(entries->end(), data, data + record.length);
+    return true;
+}
+
+
+bool BleReplay::load(Stream &in) {
+    stop();
+    _entries.clear();
+    _data.clear();
+
+    if (BleCapture::read(in, loadRecordHandler, &_data) == 0) return false;
+
+    for (size_t pos = 0; pos < _data.size();) {
+        Entry entry;
+        decodeRecord(_data.data() + pos, entry.record);
+        entry.offset = pos + 7;
+        _entries.push_back(entry);
+        pos = entry.offset + entry.record.length;
+    }
+
+    return true;
+}
+
+
+bool BleReplay::start(ChameleonUltra &chm, float speed) {
+    stop();
+    if (_entries.empty() || speed <= 0) return false;
+
+    _chm = &chm;
+    _speed = speed;
+    _txCursor = 0;
+    _sentAt.clear();
+    _rxCursor = 0;
+    _stats = {};
+    _stats.capturedUs = _entries.back().record.time - _entries.front().record.time;
+    _startUs = micros();
+    _running = true;
+
+    chm.setTransport(onTx, this);
+    _thread = std::thread(&BleReplay::run, this);
+    return true;
+}
+
+
+bool BleReplay::onTx(const uint8_t *frame, size_t length, void *ctx) {
+    BleReplay *r = (BleReplay *)ctx;
+    std::lock_guard<std::mutex> guard(r->_lock);
+
+    r->_stats.txFrames++;
+
+    while (r->_txCursor < r->_entries.size() && r->_entries[r->_txCursor].record.direction != BleCapture::TX) {
+        r->_txCursor++;
+    }
+    if (r->_txCursor == r->_entries.size()) {
+        r->_stats.txMismatches++;
+        return true;
+    }
+
+    const Entry &entry = r->_entries[r->_txCursor++];
+    if (entry.record.length != length || memcmp(r->_data.data() + entry.offset, frame, length) != 0) {
+        r->_stats.txMismatches++;
+    }
+
+    r->_sentAt.push_back(micros());
+    r->_cond.notify_all();
+    return true;
+}
+
+
+// Each notification waits for the TX captured before it, then keeps the
+// captured delay from that TX
+void BleReplay::run() {
+    std::unique_lock<std::mutex> lock(_lock);
+    size_t txBefore = 0;
+    uint32_t txCaptured = _entries.front().record.time;
+
+    for (; _rxCursor < _entries.size() && _running; _rxCursor++) {
+        const Entry &entry = _entries[_rxCursor];
+        if (entry.record.direction == BleCapture::TX) {
+            txBefore++;
+            txCaptured = entry.record.time;
+            continue;
+        }
+
+        _cond.wait(lock, [&] { return !_running || _sentAt.size() >= txBefore; });
+        if (!_running) break;
+
+        uint32_t base = txBefore > 0 ? _sentAt[txBefore - 1] : _startUs;
+        uint32_t due = (entry.record.time - txCaptured) / _speed;
+        uint32_t waited = micros() - base;
+
+        if (due > waited) {
+            _cond.wait_for(lock, std::chrono::microseconds(due - waited), [&] { return !_running; });
+            if (!_running) break;
+        }
+
+        lock.unlock();
+        ChameleonUltra::notify(_data.data() + entry.offset, entry.record.length);
+        lock.lock();
+        _stats.rxFrames++;
+    }
+
+    _stats.elapsedUs = micros() - _startUs;
+    _cond.notify_all();
+}
+
+
+bool BleReplay::wait(uint32_t timeout) {
+    std::unique_lock<std::mutex> lock(_lock);
+    auto done = [&] { return _rxCursor >= _entries.size() || !_running; };
+
+    if (timeout == 0) _cond.wait(lock, done);
+    else _cond.wait_for(lock, std::chrono::milliseconds(timeout), done);
+
+    return _rxCursor >= _entries.size();
+}
+
+
+void BleReplay::stop() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _running = false;
+        _cond.notify_all();
+    }
+    if (_thread.joinable()) _thread.join();
+
+    if (_chm) _chm->setTransport(nullptr, nullptr);
+    _chm = nullptr;
+}
+
+
+BleReplay::Stats BleReplay::stats() {
+    std::lock_guard<std::mutex> guard(_lock);
+    Stats stats = _stats;
+    if (_rxCursor < _entries.size()) stats.elapsedUs = micros() - _startUs;
+    return stats;
+}
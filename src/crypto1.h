@@ -0,0 +1,117 @@
+/**
+ * @file crypto1.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief MIFARE Classic Crypto1 cipher and LFSR state recovery
+ * @version 0.1
+ * @date 2024-10-09
+ *
+ * Based on crapto1 by bla <blapost@gmail.com>. Plain C++ without Arduino
+ * dependencies so it also builds on the host.
+ */
+
+
+#ifndef __CRYPTO1_H__
+#define __CRYPTO1_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Heap used by Crypto1::recovery32. The search space is split in windows
+// when it doesn't fit, trading time for memory. One call measured on a
+// single x86 core: 0.6 s with the host default, 1.5 s in 2 MB and 23 s in
+// 96 KB. The ESP32 is slower still, so recovering keys on the device
+// needs PSRAM: in 96 KB every call takes minutes. That includes sniffing
+// reader auths with the emulator and running mfkey32 on them.
+#ifndef CRYPTO1_RECOVERY_MEMORY
+#if defined(BOARD_HAS_PSRAM) || defined(CONFIG_SPIRAM)
+#define CRYPTO1_RECOVERY_MEMORY (2 * 1024 * 1024)
+#elif defined(ESP_PLATFORM) || defined(ARDUINO)
+#define CRYPTO1_RECOVERY_MEMORY (96 * 1024)
+#else
+#define CRYPTO1_RECOVERY_MEMORY (32 * 1024 * 1024)
+#endif
+#endif
+
+class Crypto1 {
+public:
+    uint32_t odd = 0;
+    uint32_t even = 0;
+
+    // Return false to stop the search
+    typedef bool (*StateCallback)(const Crypto1 &state, void *ctx);
+
+    Crypto1() {}
+    Crypto1(uint64_t key) { init(key); }
+    Crypto1(uint32_t odd, uint32_t even) : odd(odd), even(even) {}
+
+    void init(uint64_t key);
+    uint64_t getLfsr() const;
+
+    uint8_t bit(uint8_t in, bool encrypted = false);
+    uint8_t byte(uint8_t in, bool encrypted = false);
+    uint32_t word(uint32_t in, bool encrypted = false);
+
+    uint8_t rollbackBit(uint32_t in, bool fb = false);
+    uint32_t rollbackWord(uint32_t in, bool fb = false);
+
+    static uint8_t filter(uint32_t x);
+    static uint8_t parity(uint32_t x) { return __builtin_parity(x); }
+    static uint8_t oddParity8(uint8_t x) { return !__builtin_parity(x); }
+    static uint32_t prngSuccessor(uint32_t x, uint32_t n);
+
+    // Bit n of x in the order words go through the cipher (MSB byte first,
+    // LSB first inside each byte)
+    static uint8_t beBit(uint32_t x, uint8_t n) { return (x >> (n ^ 24)) & 1; }
+
+    // Finds every state that outputs the keystream ks2 while `in` is shifted
+    // in. States are reported right after `in`. Returns false when memory
+    // could not be allocated or the search was incomplete.
+    static bool recovery32(
+        uint32_t ks2, uint32_t in, StateCallback onState, void *ctx,
+        size_t memory = CRYPTO1_RECOVERY_MEMORY
+    );
+
+    // Darkside: states sharing the reader nonce prefix pfx (last 3 bits
+    // cleared) and encrypted reader answer rr, given the 4 bit NACK
+    // keystream and the parity bits of each of the 8 nonce variants.
+    // States are reported right before the reader nonce.
+    static bool commonPrefix(
+        uint32_t pfx, uint32_t rr, const uint8_t ks[8], const uint8_t par[8][8], bool noPar,
+        StateCallback onState, void *ctx
+    );
+};
+
+// 64 Crypto1 states stepped together, lane i of every word belongs to
+// state i. Used to check recovered candidates in batches instead of one
+// at a time. recovery32 itself is scalar, so this only speeds up the
+// check that follows it, not the recovery.
+class Crypto1Slice {
+public:
+    static const size_t LANES = 64;
+
+    void load(const Crypto1 *states, size_t count);
+    Crypto1 get(size_t lane) const;
+
+    // Return the keystream bit of every lane
+    uint64_t bit(uint8_t in, bool encrypted = false);
+    uint64_t rollbackBit(uint8_t in, bool fb = false);
+
+    void word(uint32_t in, bool encrypted = false);
+    void rollbackWord(uint32_t in, bool fb = false);
+
+    // Lanes whose keystream while `in` is shifted in equals ks. Stops early
+    // when no lane is left.
+    uint64_t check(uint32_t in, uint32_t ks, bool encrypted = false);
+
+private:
+    // Each register is a ring, bit i lives at reg[r][(head[r] - i) & 31]
+    uint64_t reg[2][32];
+    uint8_t head[2] = {0, 0};
+    uint8_t odd = 0;
+
+    uint64_t at(uint8_t r, uint8_t i) const { return reg[r][(uint8_t)(head[r] - i) & 31]; }
+    uint64_t filter() const;
+    uint64_t polyParity() const;
+};
+
+#endif
@@ -0,0 +1,151 @@
+/**
+ * @file deviceCache.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Persistent Chameleon Ultra probe results
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+#include "deviceCache.h"
+
+#define DEVICE_CACHE_MAGIC 0x43444D43  // "CMDC"
+#define DEVICE_CACHE_VERSION 1
+#define DEVICE_CACHE_HEADER_SIZE 16
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t capacity;
+    uint16_t entrySize;
+    uint8_t reserved[6];
+} DeviceCacheHeader;
+
+static_assert(sizeof(DeviceCacheHeader) == DEVICE_CACHE_HEADER_SIZE, "device cache header size");
+
+
+bool DeviceCache::begin(fs::FS &fs, const char *path, uint8_t capacity) {
+    end();
+
+    if (fs.exists(path)) _file = fs.open(path, "r+");
+
+    DeviceCacheHeader header = {};
+    bool valid = _file
+        && _file.read((uint8_t *)&header, sizeof(header)) == sizeof(header)
+        && header.magic == DEVICE_CACHE_MAGIC
+        && header.version == DEVICE_CACHE_VERSION
+        && header.entrySize == sizeof(Entry)
+        && header.capacity <= UINT8_MAX
+        && _file.size() == DEVICE_CACHE_HEADER_SIZE + (size_t)header.capacity * sizeof(Entry);
+
+    if (!valid) {
+        Serial.println("Creating device cache");
+        _file = fs.open(path, "w+");
+        if (!_file || capacity == 0) return false;
+
+        header = {DEVICE_CACHE_MAGIC, DEVICE_CACHE_VERSION, capacity, sizeof(Entry), {}};
+        _file.write((const uint8_t *)&header, sizeof(header));
+
+        Entry empty = {};
+        for (uint8_t i = 0; i < capacity; i++) {
+            if (_file.write((const uint8_t *)&empty, sizeof(empty)) != sizeof(empty)) {
+                _file.close();
+                return false;
+            }
+        }
+        _file.flush();
+    }
+
+    _capacity = header.capacity;
+
+    _clock = 0;
+    Entry entry;
+    for (uint8_t i = 0; i < _capacity; i++) {
+        if (readEntry(i, entry) && entry.used && entry.lastUsed > _clock) _clock = entry.lastUsed;
+    }
+
+    return true;
+}
+
+
+void DeviceCache::end() {
+    if (_file) _file.close();
+    _capacity = 0;
+}
+
+
+bool DeviceCache::clear() {
+    if (!_file) return false;
+
+    Entry empty = {};
+    for (uint8_t i = 0; i < _capacity; i++) {
+        if (!writeEntry(i, empty)) return false;
+    }
+    _file.flush();
+    _clock = 0;
+
+    return true;
+}
+
+
+size_t DeviceCache::offsetOf(uint8_t slot) const {
+    return DEVICE_CACHE_HEADER_SIZE + (size_t)slot * sizeof(Entry);
+}
+
+
+bool DeviceCache::readEntry(uint8_t slot, Entry &entry) {
+    return _file.seek(offsetOf(slot)) && _file.read((uint8_t *)&entry, sizeof(entry)) == sizeof(entry);
+}
+
+
+bool DeviceCache::writeEntry(uint8_t slot, const Entry &entry) {
+    return _file.seek(offsetOf(slot)) && _file.write((const uint8_t *)&entry, sizeof(entry)) == sizeof(entry);
+}
+
+
+bool DeviceCache::load(uint64_t address, ChameleonUltra::DeviceInfo &info) {
+    Entry entry;
+    for (uint8_t i = 0; i < _capacity; i++) {
+        if (!readEntry(i, entry)) return false;
+        if (!entry.used || entry.address != address || !entry.info.valid) continue;
+
+        info = entry.info;
+        entry.lastUsed = ++_clock;
+        writeEntry(i, entry);
+        _file.flush();
+        return true;
+    }
+    return false;
+}
+
+
+bool DeviceCache::store(uint64_t address, const ChameleonUltra::DeviceInfo &info) {
+    if (!_file || _capacity == 0) return false;
+
+    // Same device, else a free slot, else the least recently used one
+    int16_t slot = -1;
+    uint32_t oldestUse = UINT32_MAX;
+    Entry entry;
+    for (uint8_t i = 0; i < _capacity; i++) {
+        if (!readEntry(i, entry)) return false;
+
+        if (entry.used && entry.address == address) {
+            slot = i;
+            break;
+        }
+        uint32_t lastUsed = entry.used ? entry.lastUsed : 0;
+        if (lastUsed < oldestUse) {
+            slot = i;
+            oldestUse = lastUsed;
+        }
+    }
+
+    entry = {};
+    entry.used = 1;
+    entry.address = address;
+    entry.lastUsed = ++_clock;
+    entry.info = info;
+
+    bool ok = writeEntry(slot, entry);
+    _file.flush();
+    return ok;
+}
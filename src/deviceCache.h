@@ -0,0 +1,46 @@
+/**
+ * @file deviceCache.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Persistent Chameleon Ultra probe results
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __DEVICE_CACHE_H__
+#define __DEVICE_CACHE_H__
+
+#include <FS.h>
+#include "chameleonUltra.h"
+
+// ChameleonUltra::probeDevice results keyed by the device BLE address, so
+// reconnecting to a known device costs a single version check. The file
+// holds a few fixed size entries, the least recently used one is replaced.
+class DeviceCache {
+public:
+    // Opens the cache file, creating it with `capacity` entries when missing
+    bool begin(fs::FS &fs, const char *path = "/chmdevs.bin", uint8_t capacity = 8);
+    void end();
+    bool clear();
+
+    bool load(uint64_t address, ChameleonUltra::DeviceInfo &info);
+    bool store(uint64_t address, const ChameleonUltra::DeviceInfo &info);
+
+private:
+    typedef struct __attribute__((packed)) {
+        uint8_t used;
+        uint64_t address;
+        uint32_t lastUsed;
+        ChameleonUltra::DeviceInfo info;
+    } Entry;
+
+    fs::File _file;
+    uint8_t _capacity = 0;
+    uint32_t _clock = 0;
+
+    size_t offsetOf(uint8_t slot) const;
+    bool readEntry(uint8_t slot, Entry &entry);
+    bool writeEntry(uint8_t slot, const Entry &entry);
+};
+
+#endif
@@ -0,0 +1,760 @@
+/**
+ * @file dump.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Tag dump container and .bin/.eml/.json converters
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+#include "dump.h"
+#include <stdarg.h>
+
+#define DUMP_MAGIC 0x55444D43  // "CMDU"
+#define DUMP_VERSION 1
+#define DUMP_KEY_ENTRY_SIZE 14
+#define DUMP_JSON_VALUE_SIZE 72
+#define DUMP_TEXT_LINE_SIZE 128
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t reserved[3];
+} DumpHeader;
+
+typedef struct __attribute__((packed)) {
+    uint16_t tagType;
+    uint8_t blockSize;
+    uint16_t blockCount;
+    uint8_t uidSize;
+    uint8_t uid[10];
+    uint8_t atqa[2];
+    uint8_t sak;
+    uint8_t atsSize;
+} DumpInfoRecord;  // followed by the ATS
+
+
+static int hexValue(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+// Bytes parsed from a hex string, -1 when it is not hex
+static int parseHex(const char *s, uint8_t *out, size_t maxLength) {
+    size_t length = strlen(s);
+    if (length % 2 || length / 2 > maxLength) return -1;
+
+    for (size_t i = 0; i < length; i += 2) {
+        int hi = hexValue(s[i]);
+        int lo = hexValue(s[i + 1]);
+        if (hi < 0 || lo < 0) return -1;
+        out[i / 2] = hi << 4 | lo;
+    }
+    return length / 2;
+}
+
+
+static void toHex(const uint8_t *data, size_t length, char *out) {
+    static const char digits[] = "0123456789ABCDEF";
+    for (size_t i = 0; i < length; i++) {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 0x0F];
+    }
+    out[2 * length] = '\0';
+}
+
+
+static bool isTrailer(uint16_t block) {
+    return block < 128 ? (block & 3) == 3 : (block & 15) == 15;
+}
+
+
+static uint8_t sectorOf(uint16_t block) {
+    return block < 128 ? block / 4 : 32 + (block - 128) / 16;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// TagDump
+/////////////////////////////////////////////////////////////////////////////////////
+TagDump::Format TagDump::formatOf(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext) return FORMAT_CUD;
+
+    if (strcasecmp(ext, ".bin") == 0 || strcasecmp(ext, ".dump") == 0) return FORMAT_BIN;
+    if (strcasecmp(ext, ".eml") == 0) return FORMAT_EML;
+    if (strcasecmp(ext, ".json") == 0) return FORMAT_JSON;
+    return FORMAT_CUD;
+}
+
+
+uint16_t TagDump::blockCountOf(ChameleonUltra::TagType tagType) {
+    switch (tagType) {
+        case ChameleonUltra::MIFARE_Mini: return 20;
+        case ChameleonUltra::MIFARE_1024: return 64;
+        case ChameleonUltra::MIFARE_2048: return 128;
+        case ChameleonUltra::MIFARE_4096: return 256;
+        case ChameleonUltra::NTAG_213: return 45;
+        case ChameleonUltra::NTAG_215: return 135;
+        case ChameleonUltra::NTAG_216: return 231;
+        case ChameleonUltra::MF0ICU1: return 16;
+        case ChameleonUltra::MF0ICU2: return 48;
+        case ChameleonUltra::MF0UL11: return 20;
+        case ChameleonUltra::MF0UL21: return 41;
+        case ChameleonUltra::NTAG_210: return 20;
+        case ChameleonUltra::NTAG_212: return 41;
+        default: return 0;
+    }
+}
+
+
+uint8_t TagDump::blockSizeOf(ChameleonUltra::TagType tagType) {
+    return tagType >= ChameleonUltra::NTAG_213 && tagType <= ChameleonUltra::NTAG_212 ? 4 : 16;
+}
+
+
+TagDump::Info TagDump::infoOf(const ChameleonUltra::HfTag &tag, ChameleonUltra::TagType tagType) {
+    Info info = {};
+    info.tagType = tagType;
+    info.blockSize = blockSizeOf(tagType);
+    info.blockCount = blockCountOf(tagType);
+    info.uidSize = min<uint8_t>(tag.size, sizeof(info.uid));
+    memcpy(info.uid, tag.uidByte, info.uidSize);
+    memcpy(info.atqa, tag.atqaByte, 2);
+    info.sak = tag.sak;
+    info.atsSize = min<uint8_t>(tag.atsSize, sizeof(info.ats));
+    memcpy(info.ats, tag.atsByte, info.atsSize);
+    return info;
+}
+
+
+bool TagDump::convert(Stream &in, Format from, Print &out, Format to) {
+    TagDumpReader reader(from);
+    if (!reader.begin(in)) return false;
+
+    TagDumpWriter writer(to);
+    if (!writer.begin(out, reader.info())) return false;
+
+    uint8_t data[MAX_BLOCK_SIZE];
+    uint16_t block;
+    bool valid;
+    while (reader.read(block, data, valid)) {
+        if (!writer.write(block, data, valid)) return false;
+    }
+
+    return writer.end(reader.keys(), reader.sectors());
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Writer
+/////////////////////////////////////////////////////////////////////////////////////
+bool TagDumpWriter::put(const uint8_t *data, size_t length) {
+    if (_ok && _out->write(data, length) != length) _ok = false;
+    return _ok;
+}
+
+
+bool TagDumpWriter::text(const char *format, ...) {
+    char line[DUMP_TEXT_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    return length >= 0 && put((const uint8_t *)line, min<size_t>(length, sizeof(line) - 1));
+}
+
+
+bool TagDumpWriter::section(uint8_t type, uint16_t length) {
+    uint8_t header[3] = {type, (uint8_t)length, (uint8_t)(length >> 8)};
+    return put(header, sizeof(header));
+}
+
+
+bool TagDumpWriter::begin(Print &out, const TagDump::Info &info) {
+    if (info.blockSize == 0 || info.blockSize > TagDump::MAX_BLOCK_SIZE) return false;
+
+    _out = &out;
+    _info = info;
+    _next = 0;
+    _written = 0;
+    _runCount = 0;
+    _ok = true;
+    memset(_valid, 0, sizeof(_valid));
+
+    char hex[2 * sizeof(info.ats) + 1];
+
+    switch (_format) {
+        case TagDump::FORMAT_CUD: {
+            DumpHeader header = {DUMP_MAGIC, DUMP_VERSION, {}};
+            DumpInfoRecord record = {
+                (uint16_t)info.tagType, info.blockSize, info.blockCount, info.uidSize, {},
+                {info.atqa[0], info.atqa[1]}, info.sak, info.atsSize
+            };
+            memcpy(record.uid, info.uid, sizeof(record.uid));
+
+            put((const uint8_t *)&header, sizeof(header));
+            section('I', sizeof(record) + info.atsSize);
+            put((const uint8_t *)&record, sizeof(record));
+            put(info.ats, info.atsSize);
+            break;
+        }
+
+        case TagDump::FORMAT_JSON: {
+            text("{\n  \"Created\": \"ESP-ChameleonUltra\",\n");
+            text("  \"FileType\": \"%s\",\n", info.blockSize == 16 ? "mfcard" : "mfu");
+            text("  \"Card\": {\n");
+            toHex(info.uid, info.uidSize, hex);
+            text("    \"UID\": \"%s\",\n", hex);
+            text("    \"ATQA\": \"%02X%02X\",\n", info.atqa[1], info.atqa[0]);
+            text("    \"SAK\": \"%02X\"", info.sak);
+            if (info.atsSize > 0) {
+                toHex(info.ats, info.atsSize, hex);
+                text(",\n    \"ATS\": \"%s\"", hex);
+            }
+            text("\n  },\n  \"blocks\": {\n");
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    return _ok;
+}
+
+
+bool TagDumpWriter::flushRun() {
+    if (_runCount == 0) return _ok;
+
+    uint16_t length = _runCount * _info.blockSize;
+    uint8_t first[2] = {(uint8_t)_runStart, (uint8_t)(_runStart >> 8)};
+    section('D', length + 2);
+    put(first, sizeof(first));
+    put(_run, length);
+
+    _runCount = 0;
+    return _ok;
+}
+
+
+bool TagDumpWriter::writeInvalid(uint16_t block) {
+    switch (_format) {
+        case TagDump::FORMAT_BIN: {
+            uint8_t zero[TagDump::MAX_BLOCK_SIZE] = {};
+            return put(zero, _info.blockSize);
+        }
+        case TagDump::FORMAT_EML: {
+            char line[2 * TagDump::MAX_BLOCK_SIZE + 2];
+            memset(line, '-', 2 * _info.blockSize);
+            line[2 * _info.blockSize] = '\n';
+            return put((const uint8_t *)line, 2 * _info.blockSize + 1);
+        }
+        default:
+            return _ok;
+    }
+}
+
+
+bool TagDumpWriter::write(uint16_t block, const uint8_t *data, bool valid) {
+    if (!_out || block < _next || block >= TagDump::MAX_BLOCKS) return false;
+
+    while (_next < block) writeInvalid(_next++);
+    _next = block + 1;
+
+    if (!valid) return writeInvalid(block);
+    _valid[block / 8] |= 1 << (block % 8);
+
+    switch (_format) {
+        case TagDump::FORMAT_CUD:
+            if (_runCount > 0 && (_runStart + _runCount != block || _runCount == RUN_BLOCKS)) flushRun();
+            if (_runCount == 0) _runStart = block;
+            memcpy(_run + _runCount++ * _info.blockSize, data, _info.blockSize);
+            break;
+
+        case TagDump::FORMAT_BIN:
+            put(data, _info.blockSize);
+            break;
+
+        case TagDump::FORMAT_EML: {
+            char line[2 * TagDump::MAX_BLOCK_SIZE + 2];
+            toHex(data, _info.blockSize, line);
+            line[2 * _info.blockSize] = '\n';
+            put((const uint8_t *)line, 2 * _info.blockSize + 1);
+            break;
+        }
+
+        case TagDump::FORMAT_JSON: {
+            char hex[2 * TagDump::MAX_BLOCK_SIZE + 1];
+            toHex(data, _info.blockSize, hex);
+            text("%s    \"%u\": \"%s\"", _written > 0 ? ",\n" : "", (unsigned)block, hex);
+            break;
+        }
+    }
+
+    _written++;
+    return _ok;
+}
+
+
+bool TagDumpWriter::end(const ChameleonUltra::MfSectorKeys *keys, uint8_t sectors) {
+    if (!_out) return false;
+
+    if (_info.blockCount == 0) _info.blockCount = _next;
+    while (_next < _info.blockCount) writeInvalid(_next++);
+
+    sectors = keys ? min<uint8_t>(sectors, TagDump::MAX_SECTORS) : 0;
+
+    switch (_format) {
+        case TagDump::FORMAT_CUD: {
+            flushRun();
+
+            uint8_t known = 0;
+            for (uint8_t s = 0; s < sectors; s++) known += keys[s].hasKeyA || keys[s].hasKeyB;
+            if (known > 0) {
+                section('K', known * DUMP_KEY_ENTRY_SIZE);
+                for (uint8_t s = 0; s < sectors; s++) {
+                    const ChameleonUltra::MfSectorKeys &k = keys[s];
+                    if (!k.hasKeyA && !k.hasKeyB) continue;
+
+                    uint8_t entry[DUMP_KEY_ENTRY_SIZE] = {s, (uint8_t)(k.hasKeyA | k.hasKeyB << 1)};
+                    if (k.hasKeyA) memcpy(entry + 2, k.keyA, 6);
+                    if (k.hasKeyB) memcpy(entry + 8, k.keyB, 6);
+                    put(entry, sizeof(entry));
+                }
+            }
+
+            uint16_t bitmapSize = (_info.blockCount + 7) / 8;
+            uint8_t count[2] = {(uint8_t)_info.blockCount, (uint8_t)(_info.blockCount >> 8)};
+            section('V', bitmapSize + 2);
+            put(count, sizeof(count));
+            put(_valid, bitmapSize);
+
+            section('E', 0);
+            break;
+        }
+
+        case TagDump::FORMAT_JSON: {
+            text("\n  }");
+
+            bool first = true;
+            char hex[13];
+            for (uint8_t s = 0; s < sectors; s++) {
+                const ChameleonUltra::MfSectorKeys &k = keys[s];
+                if (!k.hasKeyA && !k.hasKeyB) continue;
+
+                text("%s    \"%u\": {", first ? ",\n  \"SectorKeys\": {\n" : ",\n", (unsigned)s);
+                if (k.hasKeyA) {
+                    toHex(k.keyA, 6, hex);
+                    text("\n      \"KeyA\": \"%s\"%s", hex, k.hasKeyB ? "," : "");
+                }
+                if (k.hasKeyB) {
+                    toHex(k.keyB, 6, hex);
+                    text("\n      \"KeyB\": \"%s\"", hex);
+                }
+                text("\n    }");
+                first = false;
+            }
+            if (!first) text("\n  }");
+
+            text("\n}\n");
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    _out->flush();
+    _out = nullptr;
+    return _ok;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Reader
+/////////////////////////////////////////////////////////////////////////////////////
+bool TagDumpReader::readRaw(uint8_t *data, size_t length) {
+    return _in->readBytes(data, length) == length;
+}
+
+
+bool TagDumpReader::begin(Stream &in, uint8_t blockSize) {
+    _in = &in;
+    _info = {};
+    memset(_keys, 0, sizeof(_keys));
+    _sectors = 0;
+    _next = 0;
+    _ended = false;
+    _pendingBlock = -1;
+    _runRemaining = 0;
+    _depth = 0;
+    _peek = -1;
+
+    switch (_format) {
+        case TagDump::FORMAT_CUD: {
+            DumpHeader header;
+            if (!readRaw((uint8_t *)&header, sizeof(header))) return false;
+            if (header.magic != DUMP_MAGIC || header.version != DUMP_VERSION) return false;
+
+            uint8_t type = 0;
+            uint16_t length = 0;
+            uint8_t sectionHeader[3];
+            if (readRaw(sectionHeader, sizeof(sectionHeader))) {
+                type = sectionHeader[0];
+                length = sectionHeader[1] | sectionHeader[2] << 8;
+            }
+
+            DumpInfoRecord record;
+            if (type != 'I' || length < sizeof(record) || !readRaw((uint8_t *)&record, sizeof(record))) return false;
+            if (record.blockSize == 0 || record.blockSize > TagDump::MAX_BLOCK_SIZE) return false;
+
+            _info.tagType = (ChameleonUltra::TagType)record.tagType;
+            _info.blockSize = record.blockSize;
+            _info.blockCount = record.blockCount;
+            _info.uidSize = min<uint8_t>(record.uidSize, sizeof(_info.uid));
+            memcpy(_info.uid, record.uid, sizeof(_info.uid));
+            memcpy(_info.atqa, record.atqa, 2);
+            _info.sak = record.sak;
+            _info.atsSize = min<uint8_t>(record.atsSize, sizeof(_info.ats));
+
+            // Newer versions may append fields to the record
+            length -= sizeof(record);
+            if (!readRaw(_info.ats, min<uint16_t>(length, _info.atsSize))) return false;
+            for (length -= min<uint16_t>(length, _info.atsSize); length > 0; length--) _in->read();
+            return true;
+        }
+
+        case TagDump::FORMAT_BIN:
+            if (blockSize == 0 || blockSize > TagDump::MAX_BLOCK_SIZE) return false;
+            _info.blockSize = blockSize;
+            if (readRaw(_pending, blockSize)) {
+                _pendingBlock = 0;
+                _pendingValid = true;
+            }
+            break;
+
+        case TagDump::FORMAT_EML:
+            if (nextText(_pending, _pendingValid)) _pendingBlock = 0;
+            break;
+
+        case TagDump::FORMAT_JSON:
+            nextJsonBlock();
+            if (_info.sak || _info.uidSize) {
+                _info.tagType = ChameleonUltra::identifyTag(_info.sak, _info.atqa).tagType;
+                _info.blockCount = TagDump::blockCountOf(_info.tagType);
+            }
+            if (_info.blockSize == 0) _info.blockSize = TagDump::blockSizeOf(_info.tagType);
+            return true;
+    }
+
+    if (_pendingBlock == 0 && _pendingValid) infoFromBlock0(_pending);
+    if (_info.blockSize == 0) _info.blockSize = 16;
+    return true;
+}
+
+
+// MIFARE Classic manufacturer block of a 4 byte UID card
+void TagDumpReader::infoFromBlock0(const uint8_t *data) {
+    if (_info.blockSize != 16) return;
+    if ((data[0] ^ data[1] ^ data[2] ^ data[3]) != data[4]) return;
+
+    _info.uidSize = 4;
+    memcpy(_info.uid, data, 4);
+    _info.sak = data[5];
+    _info.atqa[1] = data[6];
+    _info.atqa[0] = data[7];
+    _info.tagType = ChameleonUltra::identifyTag(_info.sak, _info.atqa).tagType;
+    _info.blockCount = TagDump::blockCountOf(_info.tagType);
+}
+
+
+void TagDumpReader::keysFromBlock(uint16_t block, const uint8_t *data) {
+    if (_info.blockSize != 16 || !isTrailer(block)) return;
+
+    uint8_t sector = sectorOf(block);
+    if (sector >= TagDump::MAX_SECTORS) return;
+
+    ChameleonUltra::MfSectorKeys &k = _keys[sector];
+    k.hasKeyA = k.hasKeyB = true;
+    memcpy(k.keyA, data, 6);
+    memcpy(k.keyB, data + 10, 6);
+    k.preferred = ChameleonUltra::MF_KEY_A;
+    _sectors = max<uint8_t>(_sectors, sector + 1);
+}
+
+
+bool TagDumpReader::nextSection() {
+    uint8_t header[3];
+    if (!readRaw(header, sizeof(header))) {
+        _ended = true;
+        return false;
+    }
+
+    uint16_t length = header[1] | header[2] << 8;
+
+    switch (header[0]) {
+        case 'D': {
+            uint8_t first[2];
+            if (length < 2 || !readRaw(first, 2)) break;
+            _runBlock = first[0] | first[1] << 8;
+            _runRemaining = (length - 2) / _info.blockSize;
+            if (_runBlock < _next || (length - 2) % _info.blockSize) break;
+            return true;
+        }
+
+        case 'K':
+            for (; length >= DUMP_KEY_ENTRY_SIZE; length -= DUMP_KEY_ENTRY_SIZE) {
+                uint8_t entry[DUMP_KEY_ENTRY_SIZE];
+                if (!readRaw(entry, sizeof(entry))) break;
+                if (entry[0] >= TagDump::MAX_SECTORS) continue;
+
+                ChameleonUltra::MfSectorKeys &k = _keys[entry[0]];
+                k.hasKeyA = entry[1] & 1;
+                k.hasKeyB = entry[1] >> 1 & 1;
+                memcpy(k.keyA, entry + 2, 6);
+                memcpy(k.keyB, entry + 8, 6);
+                k.preferred = k.hasKeyA ? ChameleonUltra::MF_KEY_A : ChameleonUltra::MF_KEY_B;
+                _sectors = max<uint8_t>(_sectors, entry[0] + 1);
+            }
+            if (length == 0) return true;
+            break;
+
+        case 'V': {
+            // Validity already follows from the 'D' runs, only the count matters
+            uint8_t count[2];
+            if (length < 2 || !readRaw(count, 2)) break;
+            if (_info.blockCount == 0) _info.blockCount = count[0] | count[1] << 8;
+            for (length -= 2; length > 0; length--) _in->read();
+            return true;
+        }
+
+        case 'E':
+            _ended = true;
+            return true;
+
+        default:
+            for (; length > 0; length--) _in->read();
+            return true;
+    }
+
+    // Truncated or corrupt
+    _runRemaining = 0;
+    _ended = true;
+    return false;
+}
+
+
+bool TagDumpReader::nextText(uint8_t *data, bool &valid) {
+    while (true) {
+        size_t digits = 0;
+        bool unknown = false;
+        bool bad = false;
+        int c;
+
+        for (c = _in->read(); c >= 0 && c != '\n'; c = _in->read()) {
+            if (c == '\r' || c == ' ' || c == '\t') continue;
+
+            int v = c == '-' ? 0 : hexValue(c);
+            if (v < 0 || digits == 2 * TagDump::MAX_BLOCK_SIZE) {
+                bad = true;
+                continue;
+            }
+            unknown |= c == '-';
+
+            if (digits % 2 == 0) data[digits / 2] = v << 4;
+            else data[digits / 2] |= v;
+            digits++;
+        }
+
+        if (digits > 0 && !bad && digits % 2 == 0) {
+            if (_info.blockSize == 0) _info.blockSize = digits / 2;
+            if (digits == 2 * _info.blockSize) {
+                valid = !unknown;
+                return true;
+            }
+        }
+        if (c < 0) return false;
+    }
+}
+
+
+int TagDumpReader::jsonChar() {
+    int c = _peek;
+    _peek = -1;
+    if (c < 0) c = _in->read();
+    while (c == ' ' || c == '\t' || c == '\r' || c == '\n') c = _in->read();
+    return c;
+}
+
+
+// Next scalar value. Its keys are left in _path[0.._depth-1], keys past
+// the third level are not kept.
+bool TagDumpReader::nextJson(char *value, size_t size) {
+    while (true) {
+        int c = jsonChar();
+        size_t length = 0;
+
+        switch (c) {
+            case -1:
+                return false;
+
+            case '{':
+            case '[':
+                if (_depth < 3) _path[_depth][0] = '\0';
+                _depth++;
+                continue;
+
+            case '}':
+            case ']':
+                if (_depth > 0) _depth--;
+                continue;
+
+            case ',':
+            case ':':
+                continue;
+
+            case '"':
+                for (c = _in->read(); c >= 0 && c != '"'; c = _in->read()) {
+                    if (c == '\\') c = _in->read();
+                    if (length + 1 < size) value[length++] = c;
+                }
+                value[length] = '\0';
+
+                c = jsonChar();
+                if (c == ':') {
+                    if (_depth > 0 && _depth <= 3) {
+                        strncpy(_path[_depth - 1], value, sizeof(_path[0]) - 1);
+                        _path[_depth - 1][sizeof(_path[0]) - 1] = '\0';
+                    }
+                    continue;
+                }
+                _peek = c;
+                return true;
+
+            default:
+                // number, true, false or null
+                for (; c >= 0 && !strchr(",}] \t\r\n", c); c = _in->read()) {
+                    if (length + 1 < size) value[length++] = c;
+                }
+                value[length] = '\0';
+                _peek = c;
+                return true;
+        }
+    }
+}
+
+
+// Reads up to the next "blocks" entry, picking the card info and the
+// sector keys on the way
+bool TagDumpReader::nextJsonBlock() {
+    char value[DUMP_JSON_VALUE_SIZE];
+    _pendingBlock = -1;
+
+    while (nextJson(value, sizeof(value))) {
+        if (_depth == 2 && strcmp(_path[0], "Card") == 0) {
+            if (strcmp(_path[1], "UID") == 0) {
+                int size = parseHex(value, _info.uid, sizeof(_info.uid));
+                _info.uidSize = size > 0 ? size : 0;
+            }
+            else if (strcmp(_path[1], "ATQA") == 0) {
+                uint8_t atqa[2];
+                if (parseHex(value, atqa, 2) == 2) {
+                    _info.atqa[1] = atqa[0];
+                    _info.atqa[0] = atqa[1];
+                }
+            }
+            else if (strcmp(_path[1], "SAK") == 0) {
+                parseHex(value, &_info.sak, 1);
+            }
+            else if (strcmp(_path[1], "ATS") == 0) {
+                int size = parseHex(value, _info.ats, sizeof(_info.ats));
+                _info.atsSize = size > 0 ? size : 0;
+            }
+        }
+        else if (_depth == 2 && strcmp(_path[0], "blocks") == 0) {
+            long block = strtol(_path[1], nullptr, 10);
+            if (block < _next || block >= TagDump::MAX_BLOCKS) continue;
+
+            int size = parseHex(value, _pending, TagDump::MAX_BLOCK_SIZE);
+            if (size > 0 && _info.blockSize == 0) _info.blockSize = size;
+
+            _pendingBlock = block;
+            _pendingValid = size > 0 && size == _info.blockSize;
+            return true;
+        }
+        else if (_depth == 3 && strcmp(_path[0], "SectorKeys") == 0) {
+            long sector = strtol(_path[1], nullptr, 10);
+            if (sector < 0 || sector >= TagDump::MAX_SECTORS) continue;
+
+            ChameleonUltra::MfSectorKeys &k = _keys[sector];
+            bool isA = strcmp(_path[2], "KeyA") == 0;
+            bool isB = strcmp(_path[2], "KeyB") == 0;
+            if ((!isA && !isB) || parseHex(value, isA ? k.keyA : k.keyB, 6) != 6) continue;
+
+            if (isA) k.hasKeyA = true;
+            else k.hasKeyB = true;
+            k.preferred = k.hasKeyA ? ChameleonUltra::MF_KEY_A : ChameleonUltra::MF_KEY_B;
+            _sectors = max<uint8_t>(_sectors, sector + 1);
+        }
+    }
+
+    return false;
+}
+
+
+bool TagDumpReader::read(uint16_t &block, uint8_t *data, bool &valid) {
+    uint8_t size = _info.blockSize;
+
+    while (_format == TagDump::FORMAT_CUD && _runRemaining == 0 && !_ended) nextSection();
+
+    bool pending = _format == TagDump::FORMAT_CUD ? _runRemaining > 0 : _pendingBlock >= 0;
+    int32_t pendingBlock = _format == TagDump::FORMAT_CUD ? _runBlock : _pendingBlock;
+
+    // Gaps before the next valid block, or up to the block count at the end
+    if ((pending && _next < pendingBlock) || (!pending && _next < _info.blockCount)) {
+        memset(data, 0, size);
+        block = _next++;
+        valid = false;
+        return true;
+    }
+    if (!pending) return false;
+
+    block = _next++;
+
+    if (_format == TagDump::FORMAT_CUD) {
+        valid = readRaw(data, size);
+        _runBlock++;
+        _runRemaining--;
+        if (!valid) {
+            memset(data, 0, size);
+            _runRemaining = 0;
+            _ended = true;
+        }
+        return true;
+    }
+
+    memcpy(data, _pending, size);
+    valid = _pendingValid;
+    if (valid && _format != TagDump::FORMAT_JSON) keysFromBlock(block, data);
+
+    switch (_format) {
+        case TagDump::FORMAT_BIN:
+            _pendingBlock = readRaw(_pending, size) ? _next : -1;
+            _pendingValid = true;
+            break;
+        case TagDump::FORMAT_EML:
+            _pendingBlock = nextText(_pending, _pendingValid) ? _next : -1;
+            break;
+        case TagDump::FORMAT_JSON:
+            nextJsonBlock();
+            break;
+        default:
+            break;
+    }
+
+    return true;
+}
@@ -0,0 +1,149 @@
+/**
+ * @file dump.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Tag dump container and .bin/.eml/.json converters
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __DUMP_H__
+#define __DUMP_H__
+
+#include <Arduino.h>
+#include "chameleonUltra.h"
+
+// Dumps are passed block by block, readers and writers only keep the
+// block being converted, the sector keys and the validity bitmap.
+//
+// Container (.cud): an 8 byte header followed by sections, each a type
+// byte and a 16 bit length (little endian):
+//   'I' tag type, block size, block count, UID, ATQA, SAK, ATS
+//   'D' first block number and a run of valid blocks
+//   'K' sector, flags (bit0 key A, bit1 key B), key A, key B
+//   'V' block count and validity bitmap
+//   'E' end
+// Invalid blocks are left out of the 'D' runs.
+class TagDump {
+public:
+    static constexpr uint16_t MAX_BLOCKS = 256;
+    static constexpr uint8_t MAX_SECTORS = 40;
+    static constexpr uint8_t MAX_BLOCK_SIZE = 16;
+
+    enum Format : uint8_t {
+        FORMAT_CUD,
+        FORMAT_BIN,   // raw blocks, invalid ones zeroed
+        FORMAT_EML,   // one hex block per line, invalid ones as '-'
+        FORMAT_JSON,  // proxmark3 layout, invalid blocks left out
+    };
+
+    typedef struct {
+        ChameleonUltra::TagType tagType;
+        uint8_t blockSize;    // 16 for MIFARE Classic, 4 for Ultralight/NTAG pages
+        uint16_t blockCount;  // 0 when unknown
+        uint8_t uidSize;
+        uint8_t uid[10];
+        uint8_t atqa[2];      // same byte order as HfTag::atqaByte
+        uint8_t sak;
+        uint8_t atsSize;
+        uint8_t ats[32];
+    } Info;
+
+    static Format formatOf(const char *path);
+    static uint16_t blockCountOf(ChameleonUltra::TagType tagType);
+    static uint8_t blockSizeOf(ChameleonUltra::TagType tagType);
+    static Info infoOf(const ChameleonUltra::HfTag &tag, ChameleonUltra::TagType tagType);
+
+    // Streams a dump from one format to another
+    static bool convert(Stream &in, Format from, Print &out, Format to);
+};
+
+
+class TagDumpWriter {
+public:
+    TagDumpWriter(TagDump::Format format = TagDump::FORMAT_CUD) : _format(format) {}
+
+    bool begin(Print &out, const TagDump::Info &info);
+    // Blocks go in increasing order, the ones skipped are invalid
+    bool write(uint16_t block, const uint8_t *data, bool valid = true);
+    // Keys of the first `sectors` sectors, nullptr when unknown
+    bool end(const ChameleonUltra::MfSectorKeys *keys = nullptr, uint8_t sectors = 0);
+
+    TagDump::Format format() const { return _format; }
+
+private:
+    static const uint8_t RUN_BLOCKS = 16;
+
+    TagDump::Format _format;
+    Print *_out = nullptr;
+    TagDump::Info _info = {};
+    uint16_t _next = 0;
+    uint16_t _written = 0;  // valid blocks
+    bool _ok = false;
+    uint8_t _valid[TagDump::MAX_BLOCKS / 8] = {};
+
+    // FORMAT_CUD run of valid blocks waiting for its 'D' section
+    uint8_t _run[RUN_BLOCKS * TagDump::MAX_BLOCK_SIZE];
+    uint16_t _runStart = 0;
+    uint8_t _runCount = 0;
+
+    bool put(const uint8_t *data, size_t length);
+    bool text(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    bool section(uint8_t type, uint16_t length);
+    bool flushRun();
+    bool writeInvalid(uint16_t block);
+};
+
+
+class TagDumpReader {
+public:
+    TagDumpReader(TagDump::Format format = TagDump::FORMAT_CUD) : _format(format) {}
+
+    // blockSize is only needed for FORMAT_BIN, other formats carry it
+    bool begin(Stream &in, uint8_t blockSize = 16);
+    const TagDump::Info &info() const { return _info; }
+
+    // Next block in order, false after the last one
+    bool read(uint16_t &block, uint8_t *data, bool &valid);
+
+    // Complete once read returned false. Text formats take the keys from
+    // the valid MIFARE Classic trailers.
+    const ChameleonUltra::MfSectorKeys *keys() const { return _keys; }
+    uint8_t sectors() const { return _sectors; }
+
+    TagDump::Format format() const { return _format; }
+
+private:
+    TagDump::Format _format;
+    Stream *_in = nullptr;
+    TagDump::Info _info = {};
+    ChameleonUltra::MfSectorKeys _keys[TagDump::MAX_SECTORS];
+    uint8_t _sectors = 0;
+    uint16_t _next = 0;
+    bool _ended = false;
+
+    // Block read ahead: block 0 for the tag info, or the next JSON block
+    uint8_t _pending[TagDump::MAX_BLOCK_SIZE];
+    int32_t _pendingBlock = -1;
+    bool _pendingValid = false;
+
+    // FORMAT_CUD 'D' section being read
+    uint16_t _runBlock = 0;
+    uint16_t _runRemaining = 0;
+
+    // FORMAT_JSON parser
+    uint8_t _depth = 0;
+    char _path[3][16];
+    int _peek = -1;
+
+    bool readRaw(uint8_t *data, size_t length);
+    bool nextSection();
+    bool nextText(uint8_t *data, bool &valid);
+    bool nextJson(char *value, size_t size);
+    bool nextJsonBlock();
+    int jsonChar();
+    void infoFromBlock0(const uint8_t *data);
+    void keysFromBlock(uint16_t block, const uint8_t *data);
+};
+
+#endif
@@ -0,0 +1,268 @@
+/**
+ * @file keyCache.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Persistent MIFARE Classic key cache
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+#include "keyCache.h"
+
+#define KEY_CACHE_MAGIC 0x434B4D43  // "CMKC"
+#define KEY_CACHE_VERSION 1
+#define KEY_CACHE_HEADER_SIZE 16
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t capacity;
+    uint16_t entrySize;
+    uint8_t reserved[6];
+} CacheFileHeader;
+
+static_assert(sizeof(CacheFileHeader) == KEY_CACHE_HEADER_SIZE, "cache header size");
+
+
+bool MfKeyCache::begin(fs::FS &fs, const char *path, uint16_t capacity) {
+    end();
+
+    if (fs.exists(path)) _file = fs.open(path, "r+");
+
+    CacheFileHeader header = {};
+    bool valid = _file
+        && _file.read((uint8_t *)&header, sizeof(header)) == sizeof(header)
+        && header.magic == KEY_CACHE_MAGIC
+        && header.version == KEY_CACHE_VERSION
+        && header.entrySize == sizeof(Entry)
+        && _file.size() == KEY_CACHE_HEADER_SIZE + (size_t)header.capacity * sizeof(Entry);
+
+    if (!valid) {
+        Serial.println("Creating key cache");
+        _file = fs.open(path, "w+");
+        if (!_file || capacity == 0) return false;
+
+        header = {KEY_CACHE_MAGIC, KEY_CACHE_VERSION, capacity, sizeof(Entry), {}};
+        _file.write((const uint8_t *)&header, sizeof(header));
+
+        uint8_t empty[sizeof(Entry)] = {};
+        for (uint16_t i = 0; i < capacity; i++) {
+            if (_file.write(empty, sizeof(empty)) != sizeof(empty)) {
+                _file.close();
+                return false;
+            }
+        }
+        _file.flush();
+    }
+
+    _capacity = header.capacity;
+
+    // The LRU clock continues from the most recent entry
+    _clock = 0;
+    EntryHeader entry;
+    for (uint16_t i = 0; i < _capacity; i++) {
+        if (readHeader(i, entry) && entry.used && entry.lastUsed > _clock) _clock = entry.lastUsed;
+    }
+
+    return true;
+}
+
+
+void MfKeyCache::end() {
+    if (_file) {
+        persistTouch();
+        _file.close();
+    }
+    _capacity = 0;
+}
+
+
+bool MfKeyCache::clear() {
+    if (!_file) return false;
+
+    _touchedSlot = -1;
+    uint8_t empty[sizeof(EntryHeader)] = {};
+    for (uint16_t i = 0; i < _capacity; i++) {
+        if (!_file.seek(offsetOf(i)) || _file.write(empty, sizeof(empty)) != sizeof(empty)) return false;
+    }
+    _file.flush();
+    _clock = 0;
+
+    return true;
+}
+
+
+MfKeyCache::CardId MfKeyCache::cardId(const ChameleonUltra::HfTag &tag) {
+    CardId card = {};
+    card.uidSize = min<uint8_t>(tag.size, sizeof(card.uid));
+    memcpy(card.uid, tag.uidByte, card.uidSize);
+    card.sak = tag.sak;
+    memcpy(card.atqa, tag.atqaByte, 2);
+    return card;
+}
+
+
+uint32_t MfKeyCache::hash(const CardId &card) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    const uint8_t *p = (const uint8_t *)&card;
+    for (size_t i = 0; i < sizeof(CardId); i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+bool MfKeyCache::sameCard(const CardId &a, const CardId &b) {
+    return a.uidSize == b.uidSize
+        && memcmp(a.uid, b.uid, a.uidSize) == 0
+        && a.sak == b.sak
+        && memcmp(a.atqa, b.atqa, 2) == 0;
+}
+
+
+size_t MfKeyCache::offsetOf(uint16_t slot) const {
+    return KEY_CACHE_HEADER_SIZE + (size_t)slot * sizeof(Entry);
+}
+
+
+bool MfKeyCache::readHeader(uint16_t slot, EntryHeader &header) {
+    return _file.seek(offsetOf(slot)) && _file.read((uint8_t *)&header, sizeof(header)) == sizeof(header);
+}
+
+
+int32_t MfKeyCache::find(const CardId &card, bool insert, bool &found) {
+    found = false;
+    if (!_file || _capacity == 0) return -1;
+
+    uint16_t start = hash(card) % _capacity;
+    int32_t oldest = -1;
+    uint32_t oldestUse = UINT32_MAX;
+    uint8_t window = min<uint16_t>(PROBE_WINDOW, _capacity);
+
+    // Entries are only ever replaced, never removed, so the first free
+    // slot ends the probe sequence
+    for (uint8_t i = 0; i < window; i++) {
+        uint16_t slot = (start + i) % _capacity;
+        EntryHeader header;
+        if (!readHeader(slot, header)) return -1;
+
+        if (!header.used) return insert ? slot : -1;
+        if (sameCard(header.card, card)) {
+            found = true;
+            return slot;
+        }
+        if (slot == _touchedSlot) header.lastUsed = _touchedUse;
+        if (header.lastUsed < oldestUse) {
+            oldest = slot;
+            oldestUse = header.lastUsed;
+        }
+    }
+
+    return insert ? oldest : -1;
+}
+
+
+void MfKeyCache::touch(uint16_t slot) {
+    if (_touchedSlot != slot) persistTouch();
+    _touchedSlot = slot;
+    _touchedUse = ++_clock;
+}
+
+
+bool MfKeyCache::persistTouch() {
+    if (_touchedSlot < 0) return true;
+
+    uint16_t slot = _touchedSlot;
+    _touchedSlot = -1;
+    bool ok = _file.seek(offsetOf(slot) + offsetof(EntryHeader, lastUsed))
+        && _file.write((const uint8_t *)&_touchedUse, sizeof(_touchedUse)) == sizeof(_touchedUse);
+    _file.flush();
+    return ok;
+}
+
+
+bool MfKeyCache::load(const CardId &card, ChameleonUltra::MfSectorKeys *keys) {
+    bool found;
+    int32_t slot = find(card, false, found);
+    if (!found) return false;
+
+    Entry entry;
+    if (!_file.seek(offsetOf(slot)) || _file.read((uint8_t *)&entry, sizeof(entry)) != sizeof(entry)) return false;
+
+    for (uint8_t s = 0; s < MAX_SECTORS; s++) {
+        ChameleonUltra::MfSectorKeys &k = keys[s];
+        k.hasKeyA = entry.header.hasKeyA[s / 8] >> (s % 8) & 1;
+        k.hasKeyB = entry.header.hasKeyB[s / 8] >> (s % 8) & 1;
+        memcpy(k.keyA, entry.keyA[s], 6);
+        memcpy(k.keyB, entry.keyB[s], 6);
+        k.preferred = k.hasKeyA || !k.hasKeyB ? ChameleonUltra::MF_KEY_A : ChameleonUltra::MF_KEY_B;
+    }
+
+    touch(slot);
+    return true;
+}
+
+
+bool MfKeyCache::getKey(const CardId &card, uint8_t sector, ChameleonUltra::MfKeyType type, uint8_t key[6]) {
+    if (sector >= MAX_SECTORS) return false;
+
+    bool found;
+    int32_t slot = find(card, false, found);
+    if (!found) return false;
+
+    EntryHeader header;
+    if (!readHeader(slot, header)) return false;
+
+    bool isB = type == ChameleonUltra::MF_KEY_B;
+    const uint8_t *bitmap = isB ? header.hasKeyB : header.hasKeyA;
+    if (!(bitmap[sector / 8] >> (sector % 8) & 1)) return false;
+
+    size_t offset = offsetOf(slot) + sizeof(EntryHeader) + (isB ? MAX_SECTORS * 6 : 0) + sector * 6;
+    if (!_file.seek(offset) || _file.read(key, 6) != 6) return false;
+
+    touch(slot);
+    return true;
+}
+
+
+bool MfKeyCache::putKey(const CardId &card, uint8_t sector, ChameleonUltra::MfKeyType type, const uint8_t key[6]) {
+    if (sector >= MAX_SECTORS) return false;
+
+    bool found;
+    int32_t slot = find(card, true, found);
+    if (slot < 0) return false;
+
+    EntryHeader header = {};
+    if (found && !readHeader(slot, header)) return false;
+
+    bool isB = type == ChameleonUltra::MF_KEY_B;
+    size_t keyOffset = offsetOf(slot) + sizeof(EntryHeader) + (isB ? MAX_SECTORS * 6 : 0) + sector * 6;
+    uint8_t *bitmap = isB ? header.hasKeyB : header.hasKeyA;
+    bool known = bitmap[sector / 8] >> (sector % 8) & 1;
+
+    if (known) {
+        uint8_t current[6];
+        if (_file.seek(keyOffset) && _file.read(current, 6) == 6 && memcmp(current, key, 6) == 0) return true;
+    }
+
+    if (!found) {
+        // New or evicted entry, the old keys must not leak into this card
+        Entry entry = {};
+        entry.header.used = 1;
+        entry.header.card = card;
+        if (!_file.seek(offsetOf(slot)) || _file.write((const uint8_t *)&entry, sizeof(entry)) != sizeof(entry)) return false;
+        header = entry.header;
+    }
+
+    bitmap[sector / 8] |= 1 << (sector % 8);
+    header.lastUsed = ++_clock;
+    // The header write below carries a newer lastUsed
+    if (_touchedSlot == slot) _touchedSlot = -1;
+
+    bool ok = _file.seek(keyOffset) && _file.write(key, 6) == 6
+        && _file.seek(offsetOf(slot)) && _file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+    _file.flush();
+
+    return ok;
+}
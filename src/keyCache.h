@@ -0,0 +1,79 @@
+/**
+ * @file keyCache.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Persistent MIFARE Classic key cache
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __KEY_CACHE_H__
+#define __KEY_CACHE_H__
+
+#include <FS.h>
+#include "chameleonUltra.h"
+
+// Sector keys of the cards seen before, keyed by UID, SAK and ATQA.
+// Entries live in a fixed size file used as an open addressing hash table.
+// When the probe window of a card is full, the least recently used entry
+// of that window is replaced.
+class MfKeyCache {
+public:
+    static const uint8_t MAX_SECTORS = 40;
+    static const uint8_t PROBE_WINDOW = 8;
+
+    typedef struct {
+        uint8_t uidSize;
+        uint8_t uid[10];
+        uint8_t sak;
+        uint8_t atqa[2];
+    } CardId;
+
+    // Opens the cache file, creating it with `capacity` entries when missing
+    bool begin(fs::FS &fs, const char *path = "/mfkeys.bin", uint16_t capacity = 256);
+    void end();
+    bool clear();
+
+    static CardId cardId(const ChameleonUltra::HfTag &tag);
+
+    // Fills keys[0..MAX_SECTORS) with the cached keys, false for unknown cards
+    bool load(const CardId &card, ChameleonUltra::MfSectorKeys *keys);
+    bool getKey(const CardId &card, uint8_t sector, ChameleonUltra::MfKeyType type, uint8_t key[6]);
+    bool putKey(const CardId &card, uint8_t sector, ChameleonUltra::MfKeyType type, const uint8_t key[6]);
+
+private:
+    typedef struct __attribute__((packed)) {
+        uint8_t used;
+        CardId card;
+        uint32_t lastUsed;
+        uint8_t hasKeyA[MAX_SECTORS / 8];
+        uint8_t hasKeyB[MAX_SECTORS / 8];
+        uint8_t reserved[4];
+    } EntryHeader;
+
+    typedef struct __attribute__((packed)) {
+        EntryHeader header;
+        uint8_t keyA[MAX_SECTORS][6];
+        uint8_t keyB[MAX_SECTORS][6];
+    } Entry;
+
+    fs::File _file;
+    uint16_t _capacity = 0;
+    uint32_t _clock = 0;
+    // Lookups only bump lastUsed in RAM, it reaches the file once the
+    // next card is looked up, on a key write or on end()
+    int32_t _touchedSlot = -1;
+    uint32_t _touchedUse = 0;
+
+    static uint32_t hash(const CardId &card);
+    static bool sameCard(const CardId &a, const CardId &b);
+    size_t offsetOf(uint16_t slot) const;
+    bool readHeader(uint16_t slot, EntryHeader &header);
+    // Slot holding the card, or -1. With `insert` a free or least recently
+    // used slot of the window is returned instead of -1.
+    int32_t find(const CardId &card, bool insert, bool &found);
+    void touch(uint16_t slot);
+    bool persistTouch();
+};
+
+#endif
@@ -0,0 +1,247 @@
+/**
+ * @file keyDict.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Flash resident MIFARE Classic key dictionary
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+#include "keyDict.h"
+#include <vector>
+#include <algorithm>
+
+#ifdef ESP_PLATFORM
+#include <esp_partition.h>
+#include <esp_idf_version.h>
+#if ESP_IDF_VERSION_MAJOR >= 5
+#define KEY_DICT_MMAP_DATA ESP_PARTITION_MMAP_DATA
+#define keyDictMunmap esp_partition_munmap
+#else
+#include <esp_spi_flash.h>
+#define KEY_DICT_MMAP_DATA SPI_FLASH_MMAP_DATA
+#define keyDictMunmap spi_flash_munmap
+#endif
+#elif defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define KEY_DICT_MAGIC 0x444B4D43  // "CMKD"
+#define KEY_DICT_VERSION 1
+#define KEY_DICT_HEADER_SIZE 16
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t keySize;
+    uint32_t count;
+    uint8_t reserved[4];
+} DictHeader;
+
+static_assert(sizeof(DictHeader) == KEY_DICT_HEADER_SIZE, "dictionary header size");
+
+
+static bool validHeader(const DictHeader &header, size_t available) {
+    return header.magic == KEY_DICT_MAGIC
+        && header.version == KEY_DICT_VERSION
+        && header.keySize == MfKeyDict::KEY_SIZE
+        && KEY_DICT_HEADER_SIZE + (size_t)header.count * MfKeyDict::KEY_SIZE <= available;
+}
+
+
+bool MfKeyDict::begin(const char *name) {
+    end();
+
+#ifdef ESP_PLATFORM
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name);
+    if (!part) return false;
+
+    DictHeader header;
+    if (esp_partition_read(part, 0, &header, sizeof(header)) != ESP_OK) return false;
+    if (!validHeader(header, part->size)) return false;
+
+    // Only the keys are mapped, the MMU has few pages to spare
+    size_t size = KEY_DICT_HEADER_SIZE + header.count * KEY_SIZE;
+    const void *ptr;
+    #if ESP_IDF_VERSION_MAJOR >= 5
+    esp_partition_mmap_handle_t handle;
+    #else
+    spi_flash_mmap_handle_t handle;
+    #endif
+    if (esp_partition_mmap(part, 0, size, KEY_DICT_MMAP_DATA, &ptr, &handle) != ESP_OK) return false;
+
+    _map = (void *)ptr;
+    _mapSize = size;
+    _mapHandle = handle;
+#elif defined(__unix__)
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    void *ptr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= KEY_DICT_HEADER_SIZE) {
+        ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (ptr == MAP_FAILED) return false;
+
+    _map = ptr;
+    _mapSize = st.st_size;
+
+    DictHeader header;
+    memcpy(&header, _map, sizeof(header));
+    if (!validHeader(header, _mapSize)) {
+        end();
+        return false;
+    }
+#else
+    return false;
+#endif
+
+    _data = (const uint8_t *)_map + KEY_DICT_HEADER_SIZE;
+    _count = header.count;
+    return true;
+}
+
+
+bool MfKeyDict::begin(fs::File file) {
+    end();
+
+    DictHeader header;
+    if (!file || file.read((uint8_t *)&header, sizeof(header)) != sizeof(header)) return false;
+    if (!validHeader(header, file.size())) return false;
+
+    _file = file;
+    _count = header.count;
+    return true;
+}
+
+
+void MfKeyDict::end() {
+    if (_map) {
+#ifdef ESP_PLATFORM
+        keyDictMunmap(_mapHandle);
+#elif defined(__unix__)
+        munmap(_map, _mapSize);
+#endif
+    }
+    if (_file) _file.close();
+
+    _map = nullptr;
+    _mapSize = 0;
+    _data = nullptr;
+    _count = 0;
+}
+
+
+bool MfKeyDict::getKey(size_t index, uint8_t key[6]) {
+    return read(index, key, 1) == 1;
+}
+
+
+size_t MfKeyDict::read(size_t index, uint8_t *keys, size_t maxKeys) {
+    if (index >= _count) return 0;
+    size_t count = min(maxKeys, _count - index);
+
+    if (_data) {
+        memcpy(keys, _data + index * KEY_SIZE, count * KEY_SIZE);
+        return count;
+    }
+
+    if (!_file.seek(KEY_DICT_HEADER_SIZE + index * KEY_SIZE)) return 0;
+    return _file.read(keys, count * KEY_SIZE) / KEY_SIZE;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Builder
+/////////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+    uint64_t key;
+    uint32_t first;   // position of the first occurrence
+    uint16_t count;   // sources listing the key
+    uint16_t source;  // last source that listed it
+} DictEntry;
+
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+// Next key of a text dictionary, skipping comments and malformed lines
+static bool nextTextKey(Stream &in, uint64_t &key) {
+    while (true) {
+        key = 0;
+        uint8_t digits = 0;
+        bool valid = true;
+        bool comment = false;
+        int c;
+
+        for (c = in.read(); c >= 0 && c != '\n'; c = in.read()) {
+            if (comment || c == '\r' || c == ' ' || c == '\t') continue;
+            if (c == '#') {
+                comment = true;
+                continue;
+            }
+
+            int v = hexValue(c);
+            if (v < 0 || digits == 2 * MfKeyDict::KEY_SIZE) valid = false;
+            else key = key << 4 | v;
+            digits++;
+        }
+
+        if (valid && digits == 2 * MfKeyDict::KEY_SIZE) return true;
+        if (c < 0) return false;
+    }
+}
+
+
+size_t MfKeyDict::build(Stream *const *sources, size_t count, Print &out) {
+    std::vector<DictEntry> entries;
+    uint32_t position = 0;
+
+    for (size_t s = 0; s < count; s++) {
+        uint64_t key;
+        while (nextTextKey(*sources[s], key)) {
+            entries.push_back({key, position++, 1, (uint16_t)s});
+        }
+    }
+
+    // Merge duplicates, a key counts once per source listing it
+    std::sort(entries.begin(), entries.end(), [](const DictEntry &a, const DictEntry &b) {
+        return a.key != b.key ? a.key < b.key : a.first < b.first;
+    });
+
+    size_t unique = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (unique > 0 && entries[unique - 1].key == entries[i].key) {
+            DictEntry &e = entries[unique - 1];
+            if (e.source != entries[i].source) e.count++;
+            e.source = entries[i].source;
+            continue;
+        }
+        entries[unique++] = entries[i];
+    }
+    entries.resize(unique);
+
+    std::sort(entries.begin(), entries.end(), [](const DictEntry &a, const DictEntry &b) {
+        return a.count != b.count ? a.count > b.count : a.first < b.first;
+    });
+
+    DictHeader header = {KEY_DICT_MAGIC, KEY_DICT_VERSION, KEY_SIZE, (uint32_t)unique, {}};
+    if (out.write((const uint8_t *)&header, sizeof(header)) != sizeof(header)) return 0;
+
+    for (const DictEntry &e : entries) {
+        uint8_t key[KEY_SIZE];
+        for (size_t i = 0; i < KEY_SIZE; i++) key[i] = e.key >> (8 * (KEY_SIZE - 1 - i));
+        if (out.write(key, sizeof(key)) != sizeof(key)) return 0;
+    }
+
+    return unique;
+}
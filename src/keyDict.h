@@ -0,0 +1,59 @@
+/**
+ * @file keyDict.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Flash resident MIFARE Classic key dictionary
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __KEY_DICT_H__
+#define __KEY_DICT_H__
+
+#include <FS.h>
+
+// Packed dictionary: a 16 byte header followed by 6 byte keys, without
+// duplicates and ordered from the most to the least frequent. Mapped
+// dictionaries are read in place, so their size costs no RAM.
+class MfKeyDict {
+public:
+    static const size_t KEY_SIZE = 6;
+
+    // Maps the dictionary: a data partition label on ESP32, a file path on
+    // Linux
+    bool begin(const char *name = "keys");
+    // Reads the dictionary from a file, when it can't be mapped
+    bool begin(fs::File file);
+    void end();
+
+    size_t size() const { return _count; }
+    // Keys in place for mapped dictionaries, nullptr otherwise
+    const uint8_t *data() const { return _data; }
+
+    bool getKey(size_t index, uint8_t key[6]);
+    // Copies up to maxKeys keys starting at index, returns the number copied
+    size_t read(size_t index, uint8_t *keys, size_t maxKeys);
+
+    // Packs text dictionaries (one hex key per line, # comments) into out.
+    // Keys are ordered by the number of sources listing them, ties keep
+    // the order they first appeared in. Needs 16 bytes of heap per unique
+    // key, meant to run on the host or with PSRAM.
+    static size_t build(Stream *const *sources, size_t count, Print &out);
+    static size_t build(Stream &source, Print &out) {
+        Stream *sources[1] = {&source};
+        return build(sources, 1, out);
+    }
+
+private:
+    const uint8_t *_data = nullptr;
+    size_t _count = 0;
+    fs::File _file;
+
+    void *_map = nullptr;
+    size_t _mapSize = 0;
+    #ifdef ESP_PLATFORM
+    uint32_t _mapHandle = 0;
+    #endif
+};
+
+#endif
@@ -0,0 +1,302 @@
+/**
+ * @file mfkey.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief MIFARE Classic key recovery from darkside, nested and reader nonces
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+#include "mfkey.h"
+
+#define MAX_NESTED_CANDIDATES 64
+
+
+uint64_t MfKey::keyFromBytes(const uint8_t key[6]) {
+    uint64_t k = 0;
+    for (int i = 0; i < 6; i++) k = (k << 8) | key[i];
+    return k;
+}
+
+
+void MfKey::keyToBytes(uint64_t key, uint8_t out[6]) {
+    for (int i = 5; i >= 0; i--) {
+        out[i] = key & 0xFF;
+        key >>= 8;
+    }
+}
+
+
+uint32_t MfKey::bytesToU32(const uint8_t *data) {
+    return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Darkside
+/////////////////////////////////////////////////////////////////////////////////////
+bool MfKey::checkDarkside(uint64_t key, const DarksideNonce &nonce) {
+    uint32_t prefix = nonce.nr & 0xFFFFFF1F;
+
+    for (uint32_t c = 0; c < 8; c++) {
+        Crypto1 state(key);
+        state.word(nonce.uid ^ nonce.nt);
+        uint32_t nrEnc = prefix | c << 5;
+        uint32_t ks1 = state.word(nrEnc, true);
+        uint32_t ks2 = state.word(0);
+        uint8_t ks3 = 0;
+        for (int i = 0; i < 4; i++) ks3 |= state.bit(0) << i;
+
+        if (ks3 != (nonce.ks[c] & 0x0F)) return false;
+
+        uint32_t nr = nrEnc ^ ks1;
+        uint32_t ar = nonce.ar ^ ks2;
+        for (int j = 0; j < 8; j++) {
+            uint8_t plain = j < 4 ? nr >> (24 - 8 * j) : ar >> (56 - 8 * j);
+            uint8_t next;
+            if (j < 3) next = Crypto1::beBit(ks1, 8 * (j + 1));
+            else if (j < 7) next = Crypto1::beBit(ks2, 8 * (j - 3));
+            else next = ks3 & 1;
+
+            if ((Crypto1::oddParity8(plain) ^ next) != ((nonce.par[c] >> j) & 1)) return false;
+        }
+    }
+
+    return true;
+}
+
+
+struct DarksideCtx {
+    const MfKey::DarksideNonce *nonces;
+    size_t count;
+    MfKey::KeyCallback onKey;
+    void *ctx;
+    size_t found;
+};
+
+
+static bool darksideState(const Crypto1 &state, void *ctx) {
+    DarksideCtx *d = (DarksideCtx *)ctx;
+    Crypto1 s = state;
+    s.rollbackWord(d->nonces[0].uid ^ d->nonces[0].nt);
+    uint64_t key = s.getLfsr();
+
+    for (size_t i = 1; i < d->count; i++) {
+        if (!MfKey::checkDarkside(key, d->nonces[i])) return true;
+    }
+
+    d->found++;
+    return d->onKey(key, d->ctx);
+}
+
+
+size_t MfKey::darkside(const DarksideNonce *nonces, size_t count, KeyCallback onKey, void *ctx) {
+    if (count == 0) return 0;
+
+    const DarksideNonce &first = nonces[0];
+    uint8_t par[8][8];
+    bool noPar = true;
+    for (int c = 0; c < 8; c++) {
+        if (first.par[c]) noPar = false;
+        for (int j = 0; j < 8; j++) par[c][j] = (first.par[c] >> j) & 1;
+    }
+
+    DarksideCtx d = {nonces, count, onKey, ctx, 0};
+    Crypto1::commonPrefix(first.nr & 0xFFFFFF1F, first.ar, first.ks, par, noPar, darksideState, &d);
+    return d.found;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Nested
+/////////////////////////////////////////////////////////////////////////////////////
+bool MfKey::validNonce(uint32_t nt, uint32_t ntEnc, uint8_t par) {
+    uint32_t ks1 = nt ^ ntEnc;
+    for (int j = 0; j < 3; j++) {
+        uint8_t shift = 24 - 8 * j;
+        if (Crypto1::oddParity8(nt >> shift) !=
+            (((par >> j) & 1) ^ Crypto1::oddParity8(ntEnc >> shift) ^ Crypto1::beBit(ks1, 8 * (j + 1))))
+            return false;
+    }
+    return true;
+}
+
+
+bool MfKey::checkNested(uint64_t key, uint32_t uid, uint32_t dist, const NestedNonce &nonce, uint16_t tolerance) {
+    for (int32_t d = -(int32_t)tolerance; d <= (int32_t)tolerance; d++) {
+        uint32_t nt = Crypto1::prngSuccessor(nonce.nt, dist + d);
+        if (!validNonce(nt, nonce.ntEnc, nonce.par)) continue;
+
+        Crypto1 state(key);
+        if ((nt ^ state.word(uid ^ nt)) == nonce.ntEnc) return true;
+    }
+    return false;
+}
+
+
+struct NestedCtx {
+    uint32_t uid;
+    uint32_t in;
+    uint32_t dist;
+    uint16_t tolerance;
+    bool isStatic;
+    const MfKey::NestedNonce *nonces;
+    size_t count;
+    size_t skip;
+    MfKey::KeyCallback onKey;
+    void *ctx;
+    size_t found;
+    bool stop;
+};
+
+
+static bool nestedState(const Crypto1 &state, void *ctx) {
+    NestedCtx *n = (NestedCtx *)ctx;
+    Crypto1 s = state;
+    s.rollbackWord(n->in);
+    uint64_t key = s.getLfsr();
+
+    for (size_t i = 0; i < n->count; i++) {
+        if (i == n->skip) continue;
+        const MfKey::NestedNonce &other = n->nonces[i];
+        if (n->isStatic) {
+            Crypto1 check(key);
+            if ((other.nt ^ check.word(n->uid ^ other.nt)) != other.ntEnc) return true;
+        } else if (!MfKey::checkNested(key, n->uid, n->dist, other, n->tolerance)) {
+            return true;
+        }
+    }
+
+    n->found++;
+    if (!n->onKey(key, n->ctx)) {
+        n->stop = true;
+        return false;
+    }
+    return true;
+}
+
+
+size_t MfKey::nested(
+    uint32_t uid, uint32_t dist, const NestedNonce *nonces, size_t count,
+    KeyCallback onKey, void *ctx, uint16_t tolerance
+) {
+    if (count == 0) return 0;
+
+    // Every plain nonce that passes the parity check costs a full recovery,
+    // so start from the sample that leaves the fewest of them
+    uint32_t candidates[MAX_NESTED_CANDIDATES];
+    size_t best = 0;
+    size_t bestSize = SIZE_MAX;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t size = 0;
+        for (int32_t d = -(int32_t)tolerance; d <= (int32_t)tolerance; d++) {
+            uint32_t nt = Crypto1::prngSuccessor(nonces[i].nt, dist + d);
+            if (validNonce(nt, nonces[i].ntEnc, nonces[i].par)) size++;
+        }
+        if (size < bestSize) {
+            best = i;
+            bestSize = size;
+        }
+    }
+
+    size_t size = 0;
+    for (int32_t d = -(int32_t)tolerance; d <= (int32_t)tolerance && size < MAX_NESTED_CANDIDATES; d++) {
+        uint32_t nt = Crypto1::prngSuccessor(nonces[best].nt, dist + d);
+        if (validNonce(nt, nonces[best].ntEnc, nonces[best].par)) candidates[size++] = nt;
+    }
+
+    NestedCtx n = {uid, 0, dist, tolerance, false, nonces, count, best, onKey, ctx, 0, false};
+    for (size_t i = 0; i < size && !n.stop; i++) {
+        n.in = uid ^ candidates[i];
+        Crypto1::recovery32(candidates[i] ^ nonces[best].ntEnc, n.in, nestedState, &n);
+    }
+
+    return n.found;
+}
+
+
+size_t MfKey::staticNested(uint32_t uid, const NestedNonce *nonces, size_t count, KeyCallback onKey, void *ctx) {
+    if (count == 0) return 0;
+
+    NestedCtx n = {uid, uid ^ nonces[0].nt, 0, 0, true, nonces, count, 0, onKey, ctx, 0, false};
+    Crypto1::recovery32(nonces[0].nt ^ nonces[0].ntEnc, n.in, nestedState, &n);
+    return n.found;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Mfkey32
+/////////////////////////////////////////////////////////////////////////////////////
+// recovery32 yields ~50k candidates per reader auth, they are rolled back to
+// the key and checked against the other auths 64 at a time.
+struct Mfkey32Ctx {
+    uint32_t uid;
+    const MfKey::ReaderNonce *nonces;
+    size_t count;
+    MfKey::KeyCallback onKey;
+    void *ctx;
+    size_t found;
+    Crypto1 batch[Crypto1Slice::LANES];
+    size_t batchSize;
+};
+
+
+static bool mfkey32Flush(Mfkey32Ctx *m) {
+    size_t size = m->batchSize;
+    m->batchSize = 0;
+    if (size == 0) return true;
+
+    const MfKey::ReaderNonce &first = m->nonces[0];
+    Crypto1Slice keys;
+    keys.load(m->batch, size);
+    keys.rollbackWord(0);
+    keys.rollbackWord(first.nrEnc, true);
+    keys.rollbackWord(m->uid ^ first.nt);
+
+    uint64_t match = size < Crypto1Slice::LANES ? (1ULL << size) - 1 : ~0ULL;
+    for (size_t i = 1; i < m->count && match; i++) {
+        const MfKey::ReaderNonce &n = m->nonces[i];
+        Crypto1Slice s = keys;
+        s.word(m->uid ^ n.nt);
+        s.word(n.nrEnc, true);
+        match &= s.check(0, n.arEnc ^ Crypto1::prngSuccessor(n.nt, 64));
+    }
+
+    for (size_t lane = 0; lane < size; lane++) {
+        if (!(match >> lane & 1)) continue;
+
+        m->found++;
+        if (!m->onKey(keys.get(lane).getLfsr(), m->ctx)) return false;
+    }
+
+    return true;
+}
+
+
+static bool mfkey32State(const Crypto1 &state, void *ctx) {
+    Mfkey32Ctx *m = (Mfkey32Ctx *)ctx;
+    m->batch[m->batchSize++] = state;
+
+    if (m->batchSize < Crypto1Slice::LANES) return true;
+    return mfkey32Flush(m);
+}
+
+
+size_t MfKey::mfkey32(uint32_t uid, const ReaderNonce *nonces, size_t count, KeyCallback onKey, void *ctx) {
+    if (count < 2) return 0;
+
+    Mfkey32Ctx *m = new Mfkey32Ctx();
+    m->uid = uid;
+    m->nonces = nonces;
+    m->count = count;
+    m->onKey = onKey;
+    m->ctx = ctx;
+
+    uint32_t ks2 = nonces[0].arEnc ^ Crypto1::prngSuccessor(nonces[0].nt, 64);
+    Crypto1::recovery32(ks2, 0, mfkey32State, m);
+    mfkey32Flush(m);
+
+    size_t found = m->found;
+    delete m;
+    return found;
+}
@@ -0,0 +1,76 @@
+/**
+ * @file mfkey.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief MIFARE Classic key recovery from darkside, nested and reader nonces
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __MFKEY_H__
+#define __MFKEY_H__
+
+#include "crypto1.h"
+
+class MfKey {
+public:
+    // Return false to stop reporting keys
+    typedef bool (*KeyCallback)(uint64_t key, void *ctx);
+
+    // MF1_DARKSIDE_ACQUIRE result. par[c] bit j is the encrypted parity bit
+    // of byte j (nr then ar) for the nonce variant c, ks[c] the NACK keystream.
+    typedef struct {
+        uint32_t uid;
+        uint32_t nt;
+        uint32_t nr;
+        uint32_t ar;
+        uint8_t par[8];
+        uint8_t ks[8];
+    } DarksideNonce;
+
+    // MF1_NESTED_ACQUIRE result. nt is the plain nonce of the known key auth
+    // and ntEnc the encrypted nonce of the nested one. par bit j is the
+    // received parity of byte j xor the odd parity of ntEnc byte j.
+    // For static nested nt is the static nonce itself and par is unused.
+    typedef struct {
+        uint32_t nt;
+        uint32_t ntEnc;
+        uint8_t par;
+    } NestedNonce;
+
+    // Reader authentication recorded by the emulator detection log
+    typedef struct {
+        uint32_t nt;
+        uint32_t nrEnc;
+        uint32_t arEnc;
+    } ReaderNonce;
+
+    // All return the number of reported keys. Every candidate is checked
+    // against the remaining nonces before being reported.
+    //
+    // Cost is counted in Crypto1::recovery32 calls, see
+    // CRYPTO1_RECOVERY_MEMORY: nested makes one per plain nonce left by the
+    // parity check (about 3 with the default tolerance), static nested
+    // one. Darkside doesn't call it and takes 0.3 s on x86 at any size.
+    static size_t darkside(const DarksideNonce *nonces, size_t count, KeyCallback onKey, void *ctx);
+    static size_t nested(
+        uint32_t uid, uint32_t dist, const NestedNonce *nonces, size_t count,
+        KeyCallback onKey, void *ctx, uint16_t tolerance = 10
+    );
+    static size_t staticNested(uint32_t uid, const NestedNonce *nonces, size_t count, KeyCallback onKey, void *ctx);
+    // mfkey32: at least 2 reader auths for the same uid, block and key type.
+    // One scalar recovery32 call, measured on x86: 0.5 s unbounded, 1.1 s
+    // in 2 MB, 15 to 20 s in 96 KB. Not timed on an ESP32, where it is
+    // slower; recovery in seconds on the device is not reached.
+    static size_t mfkey32(uint32_t uid, const ReaderNonce *nonces, size_t count, KeyCallback onKey, void *ctx);
+
+    static bool checkDarkside(uint64_t key, const DarksideNonce &nonce);
+    static bool checkNested(uint64_t key, uint32_t uid, uint32_t dist, const NestedNonce &nonce, uint16_t tolerance);
+    static bool validNonce(uint32_t nt, uint32_t ntEnc, uint8_t par);
+
+    static uint64_t keyFromBytes(const uint8_t key[6]);
+    static void keyToBytes(uint64_t key, uint8_t out[6]);
+    static uint32_t bytesToU32(const uint8_t *data);
+};
+
+#endif
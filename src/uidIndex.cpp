@@ -0,0 +1,367 @@
+/**
+ * @file uidIndex.cpp
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Flash resident UID allow list
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+#include "uidIndex.h"
+#include <vector>
+#include <algorithm>
+
+#ifdef ESP_PLATFORM
+#include <esp_partition.h>
+#include <esp_idf_version.h>
+#if ESP_IDF_VERSION_MAJOR >= 5
+#define UID_INDEX_MMAP_DATA ESP_PARTITION_MMAP_DATA
+#define uidIndexMunmap esp_partition_munmap
+#else
+#include <esp_spi_flash.h>
+#define UID_INDEX_MMAP_DATA SPI_FLASH_MMAP_DATA
+#define uidIndexMunmap spi_flash_munmap
+#endif
+#elif defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define UID_INDEX_MAGIC 0x49554D43  // "CMUI"
+#define UID_INDEX_VERSION 2
+#define UID_INDEX_HEADER_SIZE 24
+#define UID_INDEX_BUCKET_SIZE 4
+#define UID_INDEX_READ_KEYS 8
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t count;
+    uint32_t buckets;
+    uint32_t wideCount;
+    uint32_t wideBuckets;
+} IndexHeader;
+
+// Length in the top byte of hi, then the UID. lo holds the last 3 bytes
+// of a 10 byte UID and is only stored for those.
+typedef struct {
+    uint64_t hi;
+    uint64_t lo;
+} UidKey;
+
+static_assert(sizeof(IndexHeader) == UID_INDEX_HEADER_SIZE, "index header size");
+
+
+// Size of one table: bucket offsets, then keys of `words` 64 bit words
+static size_t tableSize(size_t count, uint32_t buckets, size_t words) {
+    return ((size_t)buckets + 1) * 4 + count * words * 8;
+}
+
+
+static size_t indexSize(const IndexHeader &header) {
+    return UID_INDEX_HEADER_SIZE
+        + tableSize(header.count, header.buckets, 1)
+        + tableSize(header.wideCount, header.wideBuckets, 2);
+}
+
+
+static bool validBuckets(uint32_t buckets) {
+    return buckets > 0 && (buckets & (buckets - 1)) == 0;
+}
+
+
+static bool validHeader(const IndexHeader &header, size_t available) {
+    return header.magic == UID_INDEX_MAGIC
+        && header.version == UID_INDEX_VERSION
+        && validBuckets(header.buckets)
+        && validBuckets(header.wideBuckets)
+        && indexSize(header) <= available;
+}
+
+
+static bool uidKey(const uint8_t *uid, size_t length, UidKey &key) {
+    if (length != 4 && length != 5 && length != 7 && length != 10) return false;
+
+    key = {(uint64_t)length << 56, 0};
+    for (size_t i = 0; i < length && i < 7; i++) key.hi |= (uint64_t)uid[i] << (48 - 8 * i);
+    for (size_t i = 7; i < length; i++) key.lo |= (uint64_t)uid[i] << (48 - 8 * (i - 7));
+    return true;
+}
+
+
+static bool isWide(const UidKey &key) {
+    return key.hi >> 56 == 10;
+}
+
+
+static bool keyLess(const UidKey &a, const UidKey &b) {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+
+static bool keyEqual(const UidKey &a, const UidKey &b) {
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+
+static uint32_t bucketOf(const UidKey &uid, uint32_t buckets) {
+    // splitmix64 finalizer, keys of sequential UIDs spread evenly
+    uint64_t key = uid.hi ^ uid.lo;
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key & (buckets - 1);
+}
+
+
+bool UidIndex::begin(const char *name) {
+    end();
+
+    IndexHeader header;
+#ifdef ESP_PLATFORM
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name);
+    if (!part) return false;
+
+    if (esp_partition_read(part, 0, &header, sizeof(header)) != ESP_OK) return false;
+    if (!validHeader(header, part->size)) return false;
+
+    const void *ptr;
+    #if ESP_IDF_VERSION_MAJOR >= 5
+    esp_partition_mmap_handle_t handle;
+    #else
+    spi_flash_mmap_handle_t handle;
+    #endif
+    if (esp_partition_mmap(part, 0, indexSize(header), UID_INDEX_MMAP_DATA, &ptr, &handle) == ESP_OK) {
+        _map = (void *)ptr;
+        _mapSize = indexSize(header);
+        _mapHandle = handle;
+    }
+    else {
+        // Larger than the free MMU pages
+        _part = part;
+    }
+#elif defined(__unix__)
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    void *ptr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= UID_INDEX_HEADER_SIZE) {
+        ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (ptr == MAP_FAILED) return false;
+
+    _map = ptr;
+    _mapSize = st.st_size;
+
+    memcpy(&header, _map, sizeof(header));
+    if (!validHeader(header, _mapSize)) {
+        end();
+        return false;
+    }
+#else
+    return false;
+#endif
+
+    if (_map) _data = (const uint8_t *)_map + UID_INDEX_HEADER_SIZE;
+    _count = header.count;
+    _buckets = header.buckets;
+    _wideCount = header.wideCount;
+    _wideBuckets = header.wideBuckets;
+    return true;
+}
+
+
+bool UidIndex::begin(fs::File file) {
+    end();
+
+    IndexHeader header;
+    if (!file || file.read((uint8_t *)&header, sizeof(header)) != sizeof(header)) return false;
+    if (!validHeader(header, file.size())) return false;
+
+    _file = file;
+    _count = header.count;
+    _buckets = header.buckets;
+    _wideCount = header.wideCount;
+    _wideBuckets = header.wideBuckets;
+    return true;
+}
+
+
+void UidIndex::end() {
+    if (_map) {
+#ifdef ESP_PLATFORM
+        uidIndexMunmap(_mapHandle);
+#elif defined(__unix__)
+        munmap(_map, _mapSize);
+#endif
+    }
+    if (_file) _file.close();
+
+    _map = nullptr;
+    _mapSize = 0;
+    _data = nullptr;
+    _count = 0;
+    _buckets = 0;
+    _wideCount = 0;
+    _wideBuckets = 0;
+#ifdef ESP_PLATFORM
+    _part = nullptr;
+#endif
+}
+
+
+// offset counts from the end of the header
+bool UidIndex::readAt(size_t offset, void *buffer, size_t length) {
+    if (_data) {
+        memcpy(buffer, _data + offset, length);
+        return true;
+    }
+#ifdef ESP_PLATFORM
+    if (_part) {
+        return esp_partition_read((const esp_partition_t *)_part, UID_INDEX_HEADER_SIZE + offset, buffer, length) == ESP_OK;
+    }
+#endif
+    if (!_file || !_file.seek(UID_INDEX_HEADER_SIZE + offset)) return false;
+    return _file.read((uint8_t *)buffer, length) == length;
+}
+
+
+bool UidIndex::contains(const uint8_t *uid, size_t length) {
+    UidKey key;
+    if (!uidKey(uid, length, key)) return false;
+
+    if (!isWide(key)) return _count > 0 && find(0, _count, _buckets, key.hi, key.lo, 1);
+    size_t table = tableSize(_count, _buckets, 1);
+    return _wideCount > 0 && find(table, _wideCount, _wideBuckets, key.hi, key.lo, 2);
+}
+
+
+// Looks the key up in the table at offset `table`, whose keys are `words`
+// 64 bit words long
+bool UidIndex::find(size_t table, size_t count, uint32_t buckets, uint64_t hi, uint64_t lo, size_t words) {
+    UidKey key = {hi, lo};
+    uint32_t bucket = bucketOf(key, buckets);
+    uint32_t range[2];
+    if (!readAt(table + bucket * 4, range, sizeof(range))) return false;
+    if (range[1] > count || range[0] > range[1]) return false;
+
+    size_t keys = table + ((size_t)buckets + 1) * 4;
+    uint64_t buffer[UID_INDEX_READ_KEYS * 2];
+
+    for (uint32_t i = range[0]; i < range[1]; i += UID_INDEX_READ_KEYS) {
+        uint32_t n = min<uint32_t>(UID_INDEX_READ_KEYS, range[1] - i);
+        if (!readAt(keys + (size_t)i * words * 8, buffer, n * words * 8)) return false;
+
+        // Buckets are sorted
+        for (uint32_t j = 0; j < n; j++) {
+            UidKey entry = {buffer[j * words], words > 1 ? buffer[j * words + 1] : 0};
+            if (keyEqual(entry, key)) return true;
+            if (keyLess(key, entry)) return false;
+        }
+    }
+
+    return false;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Builder
+/////////////////////////////////////////////////////////////////////////////////////
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+// Next UID of a text list, skipping comments and malformed lines
+static bool nextTextUid(Stream &in, UidKey &key) {
+    while (true) {
+        uint8_t uid[10];
+        size_t digits = 0;
+        bool valid = true;
+        bool comment = false;
+        int c;
+
+        for (c = in.read(); c >= 0 && c != '\n'; c = in.read()) {
+            if (comment || c == '\r' || c == ' ' || c == '\t' || c == ':') continue;
+            if (c == '#') {
+                comment = true;
+                continue;
+            }
+
+            int v = hexValue(c);
+            if (v < 0 || digits == 2 * sizeof(uid)) {
+                valid = false;
+                continue;
+            }
+            if (digits % 2 == 0) uid[digits / 2] = v << 4;
+            else uid[digits / 2] |= v;
+            digits++;
+        }
+
+        if (valid && digits % 2 == 0 && uidKey(uid, digits / 2, key)) return true;
+        if (c < 0) return false;
+    }
+}
+
+
+// Bucket start offsets, then the end of the last one, then the keys
+static bool writeTable(Print &out, std::vector<UidKey> &keys, uint32_t buckets, size_t words) {
+    std::stable_sort(keys.begin(), keys.end(), [buckets](const UidKey &a, const UidKey &b) {
+        return bucketOf(a, buckets) < bucketOf(b, buckets);
+    });
+
+    size_t next = 0;
+    for (uint32_t b = 0; b <= buckets; b++) {
+        while (next < keys.size() && bucketOf(keys[next], buckets) < b) next++;
+        uint32_t offset = next;
+        if (out.write((const uint8_t *)&offset, sizeof(offset)) != sizeof(offset)) return false;
+    }
+
+    for (const UidKey &k : keys) {
+        if (out.write((const uint8_t *)&k, words * 8) != words * 8) return false;
+    }
+
+    return true;
+}
+
+
+static uint32_t bucketCount(size_t keys) {
+    uint32_t buckets = 1;
+    while (buckets * UID_INDEX_BUCKET_SIZE < keys) buckets <<= 1;
+    return buckets;
+}
+
+
+size_t UidIndex::build(Stream &source, Print &out) {
+    std::vector<UidKey> keys;
+    std::vector<UidKey> wideKeys;
+    UidKey key;
+    while (nextTextUid(source, key)) (isWide(key) ? wideKeys : keys).push_back(key);
+
+    for (std::vector<UidKey> *table : {&keys, &wideKeys}) {
+        std::sort(table->begin(), table->end(), keyLess);
+        table->erase(std::unique(table->begin(), table->end(), keyEqual), table->end());
+    }
+
+    uint32_t buckets = bucketCount(keys.size());
+    uint32_t wideBuckets = bucketCount(wideKeys.size());
+
+    IndexHeader header = {
+        UID_INDEX_MAGIC, UID_INDEX_VERSION, 0,
+        (uint32_t)keys.size(), buckets, (uint32_t)wideKeys.size(), wideBuckets
+    };
+    if (out.write((const uint8_t *)&header, sizeof(header)) != sizeof(header)) return 0;
+
+    if (!writeTable(out, keys, buckets, 1) || !writeTable(out, wideKeys, wideBuckets, 2)) return 0;
+
+    return keys.size() + wideKeys.size();
+}
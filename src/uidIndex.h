@@ -0,0 +1,63 @@
+/**
+ * @file uidIndex.h
+ * @author Rennan Cockles (https://github.com/rennancockles)
+ * @brief Flash resident UID allow list
+ * @version 0.1
+ * @date 2024-10-09
+ */
+
+
+#ifndef __UID_INDEX_H__
+#define __UID_INDEX_H__
+
+#include <FS.h>
+
+// Hashed index over HF (4, 7 and 10 byte) and EM410x (5 byte) UIDs. Each
+// UID is packed in a key: its length in the top byte, then the UID itself.
+// 4, 5 and 7 byte UIDs fit in 64 bits, 10 byte UIDs take a second word and
+// go in a table of their own, so every match is exact. Keys are grouped in
+// buckets of about 4, so a lookup reads one bucket offset pair and one
+// bucket, whatever the list size, and never allocates.
+//
+// Index file: a 24 byte header (magic, version, count, bucket count, 10
+// byte UID count and bucket count), then for each table the bucket
+// offsets (count + 1, 32 bit) and the keys ordered by bucket (64 bit, 128
+// bit for 10 byte UIDs), all little endian.
+class UidIndex {
+public:
+    // Maps the index: a data partition label on ESP32, a file path on
+    // Linux. Partitions too large to map are read in place.
+    bool begin(const char *name = "uids");
+    // Reads the index from a file, when it can't be mapped
+    bool begin(fs::File file);
+    void end();
+
+    size_t size() const { return _count + _wideCount; }
+    bool contains(const uint8_t *uid, size_t length);
+
+    // Packs a text list (one hex UID per line, # comments, spaces and
+    // colons ignored) into out. Needs 8 bytes of heap per UID, 16 for 10
+    // byte ones, meant to run on the host or with PSRAM. Returns the
+    // number of unique UIDs.
+    static size_t build(Stream &source, Print &out);
+
+private:
+    const uint8_t *_data = nullptr;  // offsets then keys, when mapped
+    size_t _count = 0;
+    uint32_t _buckets = 0;
+    size_t _wideCount = 0;  // 10 byte UIDs
+    uint32_t _wideBuckets = 0;
+    fs::File _file;
+
+    void *_map = nullptr;
+    size_t _mapSize = 0;
+    #ifdef ESP_PLATFORM
+    uint32_t _mapHandle = 0;
+    const void *_part = nullptr;
+    #endif
+
+    bool readAt(size_t offset, void *buffer, size_t length);
+    bool find(size_t table, size_t count, uint32_t buckets, uint64_t hi, uint64_t lo, size_t words);
+};
+
+#endif